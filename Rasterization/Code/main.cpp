@@ -15,7 +15,7 @@
 #include "point.h"
 #include "vector.h"
 #include "color.h"
-#include "bitmap_image.hpp"
+#include "../../RayTracing/image_writer.hpp" // shared with the ray tracer
 #include "triangle.h"
 #include "matrix.h"
 #include "plane.h"
@@ -297,78 +297,81 @@ int main(int argc, char *argv[])
     // double bottomY = ybottom + dy / 2.0;
     // double rightX = xright - dx / 2;
     double z_max = 2.0;
-    double **zBuffer = new double *[height];
-    for (int i = 0; i < height; i++)
+    // Scan conversion runs one band of rows at a time: the band's z-buffer rows go to the z-buffer file and its pixels
+    // to the image writer as soon as every triangle has been drawn into it, so neither is ever held in full.
+    const int bandRows = 64;
+    ImageWriter image;
+    if (!image.open(image_file, width, height))
+        return -1;
+    vector<int> topScanline(triangles.size()), bottomScanline(triangles.size());
+    for (int i = 0; i < triangles.size(); i++)
     {
-        zBuffer[i] = new double[width];
-        for (int j = 0; j < width; j++)
-        {
-            zBuffer[i][j] = z_max;
-        }
+        triangles[i].reorderVerticesByY();
+        Point p1 = triangles[i].getP1();
+        Point p2 = triangles[i].getP2();
+        Point p3 = triangles[i].getP3();
+        topScanline[i] = max(0, (int)round((topY - max(p1.y, max(p2.y, p3.y))) / dy));
+        bottomScanline[i] = min(height - 1, (int)round((topY - min(p1.y, min(p2.y, p3.y))) / dy));
     }
-    bitmap_image image(width, height);
-    image.set_all_channels(0, 0, 0);
-    for (int i = 0; i < triangles.size(); i++)
+    vector<double> zBuffer((size_t)bandRows * width);
+    vector<unsigned char> pixels((size_t)bandRows * width * 3);
+    zbufferFileOut << fixed << setprecision(6);
+    for (int bandTop = 0; bandTop < height; bandTop += bandRows)
     {
-        Triangle t = triangles[i];
-        t.reorderVerticesByY();
-        Point p1 = t.getP1();
-        Point p2 = t.getP2();
-        Point p3 = t.getP3();
-        Plane trianglePlane(p1, p2, p3);
-        int top_scanline = round((topY - max(p1.y, max(p2.y, p3.y))) / dy);
-        // cout << "top_scanline: " << top_scanline << endl;
-        top_scanline = max(0, top_scanline);
-        int bottom_scanline = round((topY - min(p1.y, min(p2.y, p3.y))) / dy);
-        // int bottom_scanline = height - 1 - round(min(p1.y, min(p2.y, p3.y)) - bottomY / dy);
-        // cout << "bottom_scanline: " << bottom_scanline << endl;
-        bottom_scanline = min(height - 1, bottom_scanline);
-        // double y_scanline = top_scanline;
-        // while (y_scanline <= bottom_scanline)
-        for (int row_no = top_scanline; row_no <= bottom_scanline; row_no++)
+        int bandBottom = min(height, bandTop + bandRows) - 1;
+        fill(zBuffer.begin(), zBuffer.end(), z_max);
+        fill(pixels.begin(), pixels.end(), 0);
+        for (int i = 0; i < triangles.size(); i++)
         {
-            int left_intersecting_column = round((min(p1.x, min(p2.x, p3.x)) - leftX) / dx);
-            // cout << "left_intersecting_column: " << left_intersecting_column << endl;
-            left_intersecting_column = max(0, left_intersecting_column);
-            int right_intersecting_column = round((max(p1.x, max(p2.x, p3.x)) - leftX) / dx);
-            // int right_intersecting_column = width - 1 - round((rightX - max(p1.x, max(p2.x, p3.x))) / dx);
-            // cout << "right_intersecting_column: " << right_intersecting_column << endl;
-            right_intersecting_column = min(width - 1, right_intersecting_column);
-            double y = topY - row_no * dy;
-            for (int col_no = left_intersecting_column; col_no <= right_intersecting_column; col_no++)
+            if (topScanline[i] > bandBottom || bottomScanline[i] < bandTop)
+                continue;
+            const Triangle &t = triangles[i];
+            Point p1 = t.getP1();
+            Point p2 = t.getP2();
+            Point p3 = t.getP3();
+            Plane trianglePlane(p1, p2, p3);
+            int top_scanline = max(bandTop, topScanline[i]);
+            int bottom_scanline = min(bandBottom, bottomScanline[i]);
+            for (int row_no = top_scanline; row_no <= bottom_scanline; row_no++)
             {
-                double x = leftX + col_no * dx;
-                if (t.insideTriangle(Point(x, y, 0.0)))
+                int left_intersecting_column = round((min(p1.x, min(p2.x, p3.x)) - leftX) / dx);
+                left_intersecting_column = max(0, left_intersecting_column);
+                int right_intersecting_column = round((max(p1.x, max(p2.x, p3.x)) - leftX) / dx);
+                right_intersecting_column = min(width - 1, right_intersecting_column);
+                double y = topY - row_no * dy;
+                double *zRow = &zBuffer[(size_t)(row_no - bandTop) * width];
+                for (int col_no = left_intersecting_column; col_no <= right_intersecting_column; col_no++)
                 {
-                    double z = trianglePlane.findZ(x, y);
-                    if (z < zBuffer[row_no][col_no] && z >= zFront && z <= zRear)
+                    double x = leftX + col_no * dx;
+                    if (t.insideTriangle(Point(x, y, 0.0)))
                     {
-                        zBuffer[row_no][col_no] = z;
-                        Color c = t.getColor();
-                        image.set_pixel(col_no, row_no, c.r, c.g, c.b);
+                        double z = trianglePlane.findZ(x, y);
+                        if (z < zRow[col_no] && z >= zFront && z <= zRear)
+                        {
+                            zRow[col_no] = z;
+                            Color c = t.getColor();
+                            unsigned char *pixel = &pixels[((size_t)(row_no - bandTop) * width + col_no) * 3];
+                            pixel[0] = c.r;
+                            pixel[1] = c.g;
+                            pixel[2] = c.b;
+                        }
                     }
                 }
             }
         }
-        // image.save_image("io/out" + to_string(i) + ".bmp");
-    }
-    image.save_image(image_file);
-    zbufferFileOut << fixed << setprecision(6);
-    for (int i = 0; i < height; i++)
-    {
-        for (int j = 0; j < width; j++)
+        image.writeRows(bandTop, bandBottom - bandTop + 1, pixels.data());
+        for (int i = 0; i <= bandBottom - bandTop; i++)
         {
-            if (zBuffer[i][j] < z_max)
-                zbufferFileOut << zBuffer[i][j] << "\t";
-            // else
-            //     zbufferFileOut << "\t";
+            for (int j = 0; j < width; j++)
+            {
+                if (zBuffer[(size_t)i * width + j] < z_max)
+                    zbufferFileOut << zBuffer[(size_t)i * width + j] << "\t";
+            }
+            zbufferFileOut << "\n";
         }
-        zbufferFileOut << "\n";
     }
-
-    for (int i = 0; i < height; i++)
-        delete[] zBuffer[i];
-    delete[] zBuffer;
+    if (!image.close())
+        cerr << "Could not write " << image_file << endl;
 
     stage3FileIn.close();
     zbufferFileOut.close();
@@ -1,2 +1,2 @@
-g++ main.cpp camera.cpp point.cpp plane.cpp vector.cpp cube.cpp ball.cpp color.cpp triangle.cpp matrix.cpp -o main 
+g++ main.cpp camera.cpp point.cpp plane.cpp vector.cpp cube.cpp ball.cpp color.cpp triangle.cpp matrix.cpp -o main -pthread
 ./main
\ No newline at end of file
@@ -0,0 +1,1013 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <limits>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <map>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "2005079_classes.hpp"
+#include "bitmap_image.hpp"
+
+using namespace std;
+
+vector<Object *> objects;
+vector<PointLight *> pointLights;
+vector<SpotLight *> spotLights;
+BVH bvh;
+
+// Allocations made so far by operator new, counted in 2005079_bench_alloc.cpp so a hot loop can be checked for them
+extern size_t allocationCount;
+
+// The Cramer's rule solve Triangle::intersect used before, kept as the baseline
+double matrixTriangleIntersect(const Triangle &tri, const Ray &r)
+{
+    const Point &p1 = tri.p1, &p2 = tri.p2, &p3 = tri.p3;
+    Matrix A = Matrix(3, 3);
+    Matrix betaMat = Matrix(3, 3);
+    Matrix gammaMat = Matrix(3, 3);
+    Matrix tMat = Matrix(3, 3);
+    A.setMatrix({{-r.direction.x, p2.x - p1.x, p3.x - p1.x},
+                 {-r.direction.y, p2.y - p1.y, p3.y - p1.y},
+                 {-r.direction.z, p2.z - p1.z, p3.z - p1.z}});
+    double detA = A.determinant();
+    if (fabs(detA) < 1e-6)
+        return -1.0;
+    tMat.setMatrix({{r.origin.x - p1.x, p2.x - p1.x, p3.x - p1.x},
+                    {r.origin.y - p1.y, p2.y - p1.y, p3.y - p1.y},
+                    {r.origin.z - p1.z, p2.z - p1.z, p3.z - p1.z}});
+    betaMat.setMatrix({{-r.direction.x, r.origin.x - p1.x, p3.x - p1.x},
+                       {-r.direction.y, r.origin.y - p1.y, p3.y - p1.y},
+                       {-r.direction.z, r.origin.z - p1.z, p3.z - p1.z}});
+    gammaMat.setMatrix({{-r.direction.x, p2.x - p1.x, r.origin.x - p1.x},
+                        {-r.direction.y, p2.y - p1.y, r.origin.y - p1.y},
+                        {-r.direction.z, p2.z - p1.z, r.origin.z - p1.z}});
+    double t = tMat.determinant() / detA;
+    double beta = betaMat.determinant() / detA;
+    double gamma = gammaMat.determinant() / detA;
+    if (beta >= -1e-6 && gamma >= -1e-6 && beta + gamma <= 1 + 1e-6)
+        return t;
+    return -1.0;
+}
+
+int benchTriangles()
+{
+    mt19937 rng(410);
+    uniform_real_distribution<double> pos(-50.0, 50.0), dir(-1.0, 1.0);
+    vector<Triangle> triangles;
+    for (int i = 0; i < 1000; i++)
+    {
+        Point a(pos(rng), pos(rng), pos(rng));
+        triangles.push_back(Triangle(a, a + Vector(dir(rng), dir(rng), dir(rng)) * 20, a + Vector(dir(rng), dir(rng), dir(rng)) * 20));
+    }
+    vector<Ray> rays;
+    for (int i = 0; i < 1000; i++)
+    {
+        Point o(pos(rng), pos(rng), pos(rng));
+        rays.push_back(Ray(o, Point(pos(rng) / 5, pos(rng) / 5, pos(rng) / 5) - o));
+    }
+
+    // Both kernels have to agree before their speed means anything; float builds get a wider tolerance
+    double tolerance = max(1e-6, (double)numeric_limits<Real>::epsilon() * 1024);
+    int mismatches = 0;
+    for (int i = 0; i < 100; i++)
+    {
+        for (const Triangle &tri : triangles)
+        {
+            double a = matrixTriangleIntersect(tri, rays[i]), b = tri.intersect(rays[i]);
+            if ((a < 0) != (b < 0) || (a >= 0 && fabs(a - b) > tolerance * max(1.0, fabs(a))))
+                mismatches++;
+        }
+    }
+
+    double sink = 0.0;
+    long long before = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < 100; i++)
+    {
+        for (const Triangle &tri : triangles)
+            sink += matrixTriangleIntersect(tri, rays[i]);
+        before += triangles.size();
+    }
+    double beforeSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    size_t allocationsBefore = allocationCount;
+    long long after = 0;
+    start = chrono::steady_clock::now();
+    for (int repeat = 0; repeat < 10; repeat++)
+    {
+        for (const Ray &r : rays)
+        {
+            for (const Triangle &tri : triangles)
+                sink += tri.intersect(r);
+            after += triangles.size();
+        }
+    }
+    double afterSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    size_t hotAllocations = allocationCount - allocationsBefore;
+
+    cout << "Triangle::intersect benchmark (" << triangles.size() << " triangles)" << endl;
+    cout << "  matrix determinant: " << before / beforeSeconds / 1e6 << " M tests/s" << endl;
+    cout << "  Moller-Trumbore:    " << after / afterSeconds / 1e6 << " M tests/s" << endl;
+    cout << "  speedup:            " << (after / afterSeconds) / (before / beforeSeconds) << "x" << endl;
+    cout << "  mismatches:         " << mismatches << endl;
+    cout << "  hot path allocs:    " << hotAllocations << " (checksum " << sink << ")" << endl;
+    if (hotAllocations != 0 || mismatches != 0)
+    {
+        cerr << "FAILED: Triangle::intersect must agree with the matrix solve and not allocate" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Primary visibility only (no shading): single rays vs. 4/8/16-ray packets on a random sphere/triangle field
+int benchPackets()
+{
+    mt19937 rng(79);
+    uniform_real_distribution<double> pos(-200.0, 200.0), size(1.0, 6.0);
+    vector<Object *> scene;
+    for (int i = 0; i < 20000; i++)
+        scene.push_back(new Sphere(Point(pos(rng), pos(rng), size(rng)), size(rng)));
+    for (int i = 0; i < 5000; i++)
+    {
+        Point a(pos(rng), pos(rng), size(rng) * 3);
+        scene.push_back(new Triangle(a, a + Vector(size(rng), 0, 0), a + Vector(0, size(rng), size(rng))));
+    }
+    scene.push_back(new Floor(1000, 20));
+    BVH tree;
+    tree.build(scene);
+
+    const int width = 512, height = 512;
+    Point eye(150, -150, 80), center(0, 0, 0);
+    Vector look = (center - eye).normalize(), right = look.cross(Vector(0, 0, 1)).normalize(), up = right.cross(look);
+    auto primaryRay = [&](int i, int j)
+    {
+        Point pixel = eye + look * 300.0 + right * (i - width / 2.0) - up * (j - height / 2.0);
+        return Ray(eye, pixel - eye);
+    };
+
+    double tolerance = max(1e-9, (double)numeric_limits<Real>::epsilon() * 16);
+    vector<Object *> reference(width * height);
+    vector<double> referenceT(width * height);
+    auto start = chrono::steady_clock::now();
+    for (int j = 0; j < height; j++)
+    {
+        for (int i = 0; i < width; i++)
+        {
+            double tMin = 1e9;
+            reference[j * width + i] = tree.closestHit(primaryRay(i, j), tMin);
+            referenceT[j * width + i] = tMin;
+        }
+    }
+    double scalarSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Primary visibility benchmark (" << scene.size() << " objects, " << width << "x" << height << ")" << endl;
+    cout << "  single rays: " << width * height / scalarSeconds / 1e6 << " M rays/s" << endl;
+
+    int failures = 0;
+    for (int packetSize : {4, 8, 16})
+    {
+        int blockW = packetSize >= 8 ? 4 : 2, blockH = packetSize >= 16 ? 4 : 2;
+        int mismatches = 0;
+        RayPacket packet, parts[8];
+        start = chrono::steady_clock::now();
+        for (int bj = 0; bj < height; bj += blockH)
+        {
+            for (int bi = 0; bi < width; bi += blockW)
+            {
+                packet.clear();
+                for (int j = bj; j < bj + blockH; j++)
+                    for (int i = bi; i < bi + blockW; i++)
+                        packet.add(primaryRay(i, j), j * width + i);
+                packet.finalize();
+                int count = 1;
+                if (packet.coherent())
+                    parts[0] = packet;
+                else
+                    count = packet.split(parts);
+                for (int k = 0; k < count; k++)
+                {
+                    tree.closestHitPacket(parts[k]);
+                    for (int lane = 0; lane < parts[k].size; lane++)
+                    {
+                        int id = parts[k].id[lane];
+                        if (parts[k].hit[lane] != reference[id] || fabs(parts[k].tMin[lane] - referenceT[id]) > tolerance * max(1.0, referenceT[id]))
+                            mismatches++;
+                    }
+                }
+            }
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "  packets of " << packetSize << ": " << width * height / seconds / 1e6 << " M rays/s ("
+             << scalarSeconds / seconds << "x), " << mismatches << " mismatches" << endl;
+        if (mismatches > 0)
+            failures++;
+    }
+    for (Object *o : scene)
+        delete o;
+    if (failures > 0)
+    {
+        cerr << "FAILED: packet traversal must find the same hits as single rays" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// The row-major point sampling Floor::sampleTexture used before, kept as the baseline
+Color pointSampleRowMajor(const unsigned char *data, int width, int height, double u, double v)
+{
+    u = clamp(u, 0.0, 1.0);
+    v = clamp(v, 0.0, 1.0);
+    int x = clamp(static_cast<int>(u * (width - 1)), 0, width - 1);
+    int y = clamp(static_cast<int>((1.0 - v) * (height - 1)), 0, height - 1);
+    int index = (y * width + x) * 3;
+    return Color(data[index] / 255.0, data[index + 1] / 255.0, data[index + 2] / 255.0);
+}
+
+// Texture::bilinear on the source image, to tell the cost of the mip pyramid's bookkeeping from the cost of filtering
+Color bilinearRowMajor(const unsigned char *data, int width, int height, double u, double v)
+{
+    double x = clamp(u, 0.0, 1.0) * width - 0.5, y = (1.0 - clamp(v, 0.0, 1.0)) * height - 0.5;
+    int x0 = (int)(x + 1) - 1, y0 = (int)(y + 1) - 1;
+    double fx = x - x0, fy = y - y0;
+    int x1 = min(x0 + 1, width - 1), y1 = min(y0 + 1, height - 1);
+    x0 = max(x0, 0);
+    y0 = max(y0, 0);
+    const unsigned char *a = data + (y0 * width + x0) * 3, *b = data + (y0 * width + x1) * 3;
+    const unsigned char *c = data + (y1 * width + x0) * 3, *d = data + (y1 * width + x1) * 3;
+    double wa = (1 - fx) * (1 - fy) / 255.0, wb = fx * (1 - fy) / 255.0, wc = (1 - fx) * fy / 255.0, wd = fx * fy / 255.0;
+    auto channel = [&](int k) { return a[k] * wa + b[k] * wb + c[k] * wc + d[k] * wd; };
+    return Color(channel(0), channel(1), channel(2));
+}
+
+// Floor texture lookups as a 512x512 camera sees a receding textured plane, and at random
+int benchTexture()
+{
+    const int size = 1024;
+    mt19937 rng(2005);
+    vector<unsigned char> image(size * size * 3);
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++)
+            for (int k = 0; k < 3; k++)
+                image[(y * size + x) * 3 + k] = ((x / 4 + y / 4 + k) % 2) * 200 + rng() % 56; // fine checker plus noise
+    Texture texture;
+    texture.build(image.data(), size, size, 3);
+
+    // Camera 10 units above the plane z = 0 looking at the horizon; every 20 units the texture repeats.
+    // Pixels are visited in 16x16 tiles, the order the renderer traces them in.
+    const int width = 512, height = 512, screenTile = 16;
+    const double tileWidth = 20, spread = 1.0 / width;
+    vector<pair<int, int>> pixels;
+    for (int tj = 0; tj < height; tj += screenTile)
+        for (int ti = 0; ti < width; ti += screenTile)
+            for (int j = tj; j < tj + screenTile; j++)
+                for (int i = ti; i < ti + screenTile; i++)
+                    pixels.push_back({i, j});
+    auto direction = [&](double i, double j) { return Vector(i / width - 0.5, 1.0, -0.05 - 0.6 * j / height).normalize(); };
+    vector<double> us, vs, footprints;
+    for (auto [i, j] : pixels)
+    {
+        Vector d = direction(i + 0.5, j + 0.5);
+        double t = 10 / -d.z;
+        us.push_back(fmod(d.x * t + 1e4, tileWidth) / tileWidth);
+        vs.push_back(fmod(d.y * t, tileWidth) / tileWidth);
+        footprints.push_back(spread * t / -d.z / tileWidth);
+    }
+    int samples = width * height;
+
+    // Aliasing: distance of each filter from an 8x8 supersampled image of the same view
+    auto psnr = [&](const vector<Color> &a, const vector<Color> &b)
+    {
+        double error = 0;
+        for (int k = 0; k < samples; k++)
+        {
+            double dr = a[k].r - b[k].r, dg = a[k].g - b[k].g, db = a[k].b - b[k].b;
+            error += (dr * dr + dg * dg + db * db) / 3;
+        }
+        return 10 * log10(samples / max(error, 1e-12));
+    };
+    vector<Color> reference(samples), point(samples), trilinear(samples);
+    for (int k = 0; k < samples; k++)
+    {
+        Color sum(0, 0, 0);
+        for (int sj = 0; sj < 8; sj++)
+        {
+            for (int si = 0; si < 8; si++)
+            {
+                Vector d = direction(pixels[k].first + (si + 0.5) / 8, pixels[k].second + (sj + 0.5) / 8);
+                double t = 10 / -d.z;
+                sum = sum + pointSampleRowMajor(image.data(), size, size, fmod(d.x * t + 1e4, tileWidth) / tileWidth,
+                                                fmod(d.y * t, tileWidth) / tileWidth);
+            }
+        }
+        reference[k] = sum * (1.0 / 64);
+    }
+
+    double sink = 0;
+    auto timed = [&](auto sampleAt, vector<Color> *out)
+    {
+        auto start = chrono::steady_clock::now();
+        for (int repeat = 0; repeat < 4; repeat++)
+        {
+            for (int k = 0; k < samples; k++)
+            {
+                Color c = sampleAt(k);
+                sink += c.r + c.g + c.b;
+                if (out)
+                    (*out)[k] = c;
+            }
+        }
+        return 4.0 * samples / chrono::duration<double>(chrono::steady_clock::now() - start).count() / 1e6;
+    };
+    uniform_int_distribution<int> pick(0, samples - 1);
+    vector<int> shuffled(samples);
+    for (int &k : shuffled)
+        k = pick(rng);
+    size_t allocationsBefore = allocationCount;
+    double pointRate = timed([&](int k) { return pointSampleRowMajor(image.data(), size, size, us[k], vs[k]); }, &point);
+    double rowBilinearRate = timed([&](int k) { return bilinearRowMajor(image.data(), size, size, us[k], vs[k]); }, nullptr);
+    double bilinearRate = timed([&](int k) { return texture.bilinear(0, us[k], vs[k]); }, nullptr);
+    double trilinearRate = timed([&](int k) { return texture.sample(us[k], vs[k], footprints[k]); }, &trilinear);
+    double randomPointRate = timed([&](int k) { return pointSampleRowMajor(image.data(), size, size, us[shuffled[k]], vs[shuffled[k]]); }, nullptr);
+    double randomRowBilinearRate = timed([&](int k) { return bilinearRowMajor(image.data(), size, size, us[shuffled[k]], vs[shuffled[k]]); }, nullptr);
+    double randomBilinearRate = timed([&](int k) { return texture.bilinear(0, us[shuffled[k]], vs[shuffled[k]]); }, nullptr);
+    double randomTrilinearRate = timed([&](int k) { return texture.sample(us[shuffled[k]], vs[shuffled[k]], footprints[shuffled[k]]); }, nullptr);
+    size_t hotAllocations = allocationCount - allocationsBefore;
+    double pointPSNR = psnr(point, reference), trilinearPSNR = psnr(trilinear, reference);
+
+    cout << "Floor texture benchmark (" << size << "x" << size << ", " << texture.levels.size() << " levels, " << width << "x"
+         << height << " view)" << endl;
+    cout << "  row-major point:    " << pointRate << " M samples/s, " << randomPointRate << " in random order, "
+         << pointPSNR << " dB" << endl;
+    cout << "  row-major bilinear: " << rowBilinearRate << " M samples/s, " << randomRowBilinearRate << " in random order" << endl;
+    cout << "  mip bilinear:       " << bilinearRate << " M samples/s, " << randomBilinearRate << " in random order" << endl;
+    cout << "  mip trilinear:      " << trilinearRate << " M samples/s, " << randomTrilinearRate << " in random order, "
+         << trilinearPSNR << " dB" << endl;
+    cout << "  hot path allocs:    " << hotAllocations << " (checksum " << sink << ")" << endl;
+    if (hotAllocations != 0 || trilinearPSNR <= pointPSNR)
+    {
+        cerr << "FAILED: trilinear sampling must alias less than point sampling and not allocate" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// The full quadratic QuadraticSurface::intersect solved before, with the clip box checked after the roots, kept as
+// the baseline
+double legacyQuadricIntersect(const double *q, const double *clip, const Ray &r)
+{
+    double A = q[0], B = q[1], C = q[2], D = q[3], E = q[4], F = q[5], G = q[6], H = q[7], I = q[8], J = q[9];
+    const Point &o = r.origin;
+    const Vector &d = r.direction;
+    double a = A * d.x * d.x + B * d.y * d.y + C * d.z * d.z + D * d.x * d.y + E * d.x * d.z + F * d.y * d.z;
+    double b = 2 * A * o.x * d.x + 2 * B * o.y * d.y + 2 * C * o.z * d.z + D * (o.x * d.y + o.y * d.x) +
+               E * (o.x * d.z + o.z * d.x) + F * (o.y * d.z + o.z * d.y) + G * d.x + H * d.y + I * d.z;
+    double c = A * o.x * o.x + B * o.y * o.y + C * o.z * o.z + D * o.x * o.y + E * o.x * o.z + F * o.y * o.z +
+               G * o.x + H * o.y + I * o.z + J;
+    double discriminant = b * b - 4 * a * c;
+    if (discriminant < 0)
+        return -1;
+    double t = -1;
+    for (double candidate : {(-b - sqrt(discriminant)) / (2 * a), (-b + sqrt(discriminant)) / (2 * a)})
+    {
+        if (candidate < 1e-6)
+            continue;
+        Point p = o + d * candidate;
+        if (p.x < clip[0] || p.x > clip[1] || p.y < clip[2] || p.y > clip[3] || p.z < clip[4] || p.z > clip[5])
+            continue;
+        if (t < 0 || candidate < t)
+            t = candidate;
+    }
+    return t;
+}
+
+// sum Q_k (p_k - c_k)^2 + L_k (p_k - c_k) + K, clipped to c +- size (0 leaves the axis open)
+QuadraticSurface *axisQuadric(const Point &c, const double Q[3], const double L[3], double K, const Vector &size)
+{
+    double center[3] = {c.x, c.y, c.z}, linear[3], J = K;
+    for (int k = 0; k < 3; k++)
+    {
+        linear[k] = L[k] - 2 * Q[k] * center[k];
+        J += Q[k] * center[k] * center[k] - L[k] * center[k];
+    }
+    return new QuadraticSurface(c - size, 2 * size.z, 2 * size.y, 2 * size.x, Q[0], Q[1], Q[2], 0, 0, 0,
+                                linear[0], linear[1], linear[2], J);
+}
+
+// Closest hits on a field of clipped quadrics of every kind: the old kernel against CompiledScene's prefiltered,
+// specialised ones, plus the error of both where the old root formula cancels
+int benchQuadrics()
+{
+    mt19937 rng(2005);
+    uniform_real_distribution<double> pos(-100.0, 100.0), size(2.0, 8.0), unit(-1.0, 1.0);
+    vector<QuadraticSurface *> quadrics;
+    for (int i = 0; i < 400; i++)
+    {
+        Point c(pos(rng), pos(rng), pos(rng));
+        double s = size(rng);
+        int shape = i % 5;
+        if (shape == 0) // ellipsoid, clipped on all axes
+        {
+            double Q[3] = {1 / (s * s), 4 / (s * s), 2 / (s * s)}, L[3] = {0, 0, 0};
+            quadrics.push_back(axisQuadric(c, Q, L, -1, Vector(s, s, s)));
+        }
+        else if (shape == 1) // cylinder along x, y or z, clipped along its axis only
+        {
+            int axis = i % 3;
+            double Q[3] = {1, 1, 1}, L[3] = {0, 0, 0};
+            Q[axis] = 0;
+            Vector clip(0, 0, 0);
+            (axis == 0 ? clip.x : axis == 1 ? clip.y : clip.z) = 3 * s;
+            quadrics.push_back(axisQuadric(c, Q, L, -s * s / 4, clip));
+        }
+        else if (shape == 2) // cone along z
+        {
+            double Q[3] = {1, 1, -0.25}, L[3] = {0, 0, 0};
+            quadrics.push_back(axisQuadric(c, Q, L, 0, Vector(s, s, s)));
+        }
+        else if (shape == 3) // paraboloid opening along y
+        {
+            double Q[3] = {1, 0, 1}, L[3] = {0, -s, 0};
+            quadrics.push_back(axisQuadric(c, Q, L, 0, Vector(s, s, s)));
+        }
+        else // rotated ellipsoid: (p - c)^T M (p - c) = 1 with M = R diag R^T
+        {
+            Vector u = Vector(unit(rng), unit(rng), unit(rng)).normalize();
+            Vector v = u.cross(Vector(0.3, 0.5, 0.8)).normalize(), w = u.cross(v);
+            double axes[3] = {1 / (s * s), 4 / (s * s), 9 / (s * s)}, M[3][3], cc[3] = {c.x, c.y, c.z};
+            double rows[3][3] = {{u.x, u.y, u.z}, {v.x, v.y, v.z}, {w.x, w.y, w.z}};
+            for (int r = 0; r < 3; r++)
+                for (int k = 0; k < 3; k++)
+                {
+                    M[r][k] = 0;
+                    for (int n = 0; n < 3; n++)
+                        M[r][k] += rows[n][r] * axes[n] * rows[n][k];
+                }
+            double linear[3], J = -1;
+            for (int k = 0; k < 3; k++)
+            {
+                linear[k] = -2 * (M[k][0] * cc[0] + M[k][1] * cc[1] + M[k][2] * cc[2]);
+                for (int n = 0; n < 3; n++)
+                    J += cc[k] * M[k][n] * cc[n];
+            }
+            quadrics.push_back(new QuadraticSurface(c - Vector(s, s, s), 2 * s, 2 * s, 2 * s, M[0][0], M[1][1], M[2][2],
+                                                    2 * M[0][1], 2 * M[0][2], 2 * M[1][2], linear[0], linear[1], linear[2], J));
+        }
+    }
+    CompiledScene scene;
+    int counts[CompiledScene::TYPE_COUNT] = {0, 0, (int)quadrics.size(), 0};
+    scene.reserve(counts);
+    int kinds[QuadraticSurface::KIND_COUNT] = {};
+    for (QuadraticSurface *q : quadrics)
+        kinds[scene.quadricKinds[scene.add(q, CompiledScene::QUADRIC)]]++;
+    vector<Ray> rays;
+    for (int i = 0; i < 2000; i++)
+    {
+        Point o(pos(rng) * 1.5, pos(rng) * 1.5, pos(rng) * 1.5);
+        rays.push_back(Ray(o, Point(pos(rng) / 2, pos(rng) / 2, pos(rng) / 2) - o));
+    }
+    int n = quadrics.size();
+    // The old CompiledScene loop: gather every coefficient, then solve
+    auto legacyClosest = [&](const Ray &r)
+    {
+        Hit legacy;
+        for (int i = 0; i < n; i++)
+        {
+            double q[10], clip[6];
+            for (int k = 0; k < 10; k++)
+                q[k] = scene.quadricCoefficients[k][i];
+            for (int k = 0; k < 6; k++)
+                clip[k] = scene.quadricClip[k][i];
+            double t = legacyQuadricIntersect(q, clip, r);
+            if (t > 0 && t < legacy.t)
+                legacy = Hit(t, i);
+        }
+        return legacy;
+    };
+
+    // Closest hits must agree. Float builds store the coefficients as float, so both read those, but the old kernel
+    // also multiplied the float ray components in float; it is the less accurate one there, hence the wider tolerance.
+    double tolerance = max(1e-6, (double)numeric_limits<Real>::epsilon() * 1024);
+    int mismatches = 0, hits = 0;
+    for (const Ray &r : rays)
+    {
+        Hit legacy = legacyClosest(r), hit;
+        scene.intersectQuadrics(r, 0, n, hit);
+        hits += hit.id >= 0;
+        if (legacy.id != hit.id || (hit.id >= 0 && fabs(legacy.t - hit.t) > tolerance * max(1.0, legacy.t)))
+            mismatches++;
+    }
+
+    double sink = 0.0;
+    long long tests = 0;
+    auto start = chrono::steady_clock::now();
+    for (const Ray &r : rays)
+    {
+        sink += legacyClosest(r).t;
+        tests += n;
+    }
+    double legacySeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    size_t allocationsBefore = allocationCount;
+    start = chrono::steady_clock::now();
+    for (const Ray &r : rays)
+    {
+        Hit hit;
+        scene.intersectQuadrics(r, 0, n, hit);
+        sink += hit.t;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    size_t hotAllocations = allocationCount - allocationsBefore;
+
+    // Rays falling almost straight down into the paraboloid z = x^2 + y^2, where a = sin^2 of the tilt nearly
+    // vanishes: the old (-b + sqrt(disc)) / 2a loses the root to cancellation and divides by zero at no tilt.
+    // The reference solves the same a, b, c in long double.
+    double legacyError = 0.0, stableError = 0.0;
+    double paraboloid[10] = {1, 1, 0, 0, 0, 0, 0, 0, -1, 0}, open[6] = {-1e300, 1e300, -1e300, 1e300, -1e300, 1e300};
+    QuadraticSurface bowl(Point(0, 0, 0), 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, -1, 0);
+    for (double tilt : {1e-2, 1e-4, 1e-6, 1e-8, 0.0})
+    {
+        Ray r(Point(3, 0, 50), Vector(tilt, 0, -1));
+        long double dx = r.direction.x, dz = r.direction.z, ox = r.origin.x, oz = r.origin.z;
+        long double a = dx * dx, b = 2 * ox * dx - dz, c = ox * ox - oz;
+        long double exact = a == 0 ? -c / b : c / (-0.5L * (b + copysignl(sqrtl(b * b - 4 * a * c), b)));
+        double legacy = legacyQuadricIntersect(paraboloid, open, r), stable = bowl.intersect(r);
+        legacyError = isfinite(legacy) ? max(legacyError, (double)fabsl((legacy - exact) / exact)) : INFINITY;
+        stableError = isfinite(stable) ? max(stableError, (double)fabsl((stable - exact) / exact)) : INFINITY;
+    }
+
+    cout << "Quadric benchmark (" << n << " quadrics: " << kinds[QuadraticSurface::GENERAL] << " general, "
+         << kinds[QuadraticSurface::AXIS_ALIGNED] << " axis-aligned, "
+         << kinds[QuadraticSurface::CYLINDER_X] + kinds[QuadraticSurface::CYLINDER_Y] + kinds[QuadraticSurface::CYLINDER_Z]
+         << " cylinders; " << hits << " of " << rays.size() << " rays hit)" << endl;
+    cout << "  full quadratic:     " << tests / legacySeconds / 1e6 << " M tests/s" << endl;
+    cout << "  prefilter + kinds:  " << tests / seconds / 1e6 << " M tests/s" << endl;
+    cout << "  speedup:            " << legacySeconds / seconds << "x" << endl;
+    cout << "  near-axis rel. err: " << legacyError << " before, " << stableError << " now" << endl;
+    cout << "  mismatches:         " << mismatches << endl;
+    cout << "  hot path allocs:    " << hotAllocations << " (checksum " << sink << ")" << endl;
+    for (QuadraticSurface *q : quadrics)
+        delete q;
+    if (hotAllocations != 0 || mismatches != 0 || stableError > 1e-9)
+    {
+        cerr << "FAILED: quadric kernels must agree with the full solve, stay accurate and not allocate" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Primary visibility through per-tile frustum lists (--cull) against the full tree, for growing sphere counts
+int benchCulling()
+{
+    const int width = 512, height = 512, tile = 16;
+    Point eye(150, -150, 80), center(0, 0, 0);
+    Vector look = (center - eye).normalize(), right = look.cross(Vector(0, 0, 1)).normalize(), up = right.cross(look);
+    auto planePoint = [&](double x, double y) { return eye + look * 300.0 + right * (x - width / 2.0) - up * (y - height / 2.0); };
+    cout << "Tile frustum culling benchmark (" << width << "x" << height << ", " << tile << "x" << tile << " tiles)" << endl;
+    int mismatches = 0;
+    for (int count : {250, 1000, 4000, 16000, 64000})
+    {
+        mt19937 rng(count);
+        uniform_real_distribution<double> pos(-200.0, 200.0), size(1.0, 6.0);
+        vector<Object *> scene;
+        for (int i = 0; i < count; i++)
+            scene.push_back(new Sphere(Point(pos(rng), pos(rng), size(rng)), size(rng)));
+        scene.push_back(new Floor(1000, 20));
+        BVH tree;
+        tree.build(scene);
+        vector<Object *> reference(width * height);
+        auto start = chrono::steady_clock::now();
+        for (int j = 0; j < height; j++)
+            for (int i = 0; i < width; i++)
+            {
+                double tMin = 1e9;
+                reference[j * width + i] = tree.closestHit(Ray(eye, planePoint(i, j) - eye), tMin);
+            }
+        double treeSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        vector<int> leaves;
+        long long listed = 0;
+        start = chrono::steady_clock::now();
+        for (int ty = 0; ty < height; ty += tile)
+            for (int tx = 0; tx < width; tx += tile)
+            {
+                Vector corners[4] = {planePoint(tx - 0.5, ty - 0.5) - eye, planePoint(tx + tile - 0.5, ty - 0.5) - eye,
+                                     planePoint(tx + tile - 0.5, ty + tile - 0.5) - eye,
+                                     planePoint(tx - 0.5, ty + tile - 0.5) - eye};
+                tree.frustumLeaves(eye, corners, leaves);
+                listed += leaves.size();
+                for (int j = ty; j < ty + tile; j++)
+                    for (int i = tx; i < tx + tile; i++)
+                    {
+                        double tMin = 1e9;
+                        if (tree.closestHitLeaves(Ray(eye, planePoint(i, j) - eye), tMin, leaves) != reference[j * width + i])
+                            mismatches++;
+                    }
+            }
+        double cullSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "  " << setw(5) << count << " spheres: tree " << width * height / treeSeconds / 1e6 << " M rays/s, culled "
+             << width * height / cullSeconds / 1e6 << " M rays/s (" << treeSeconds / cullSeconds << "x, "
+             << (double)listed / ((width / tile) * (height / tile)) << " leaves per tile)" << endl;
+        for (Object *o : scene)
+            delete o;
+    }
+    cout << "  mismatches: " << mismatches << endl;
+    if (mismatches > 0)
+    {
+        cerr << "FAILED: tile frustum lists must find the same hits as the tree" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Scene suite: procedural scenes rendered by ./main and checked against golden images and a throughput baseline
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class SuiteScene
+{
+public:
+    string name;
+    int level = 3;
+    string eye, center, up = "0,0,1";
+    bool heavy = false; // skipped with --quick
+    function<int(ostream &, mt19937 &)> objects; // writes the object records, returns their count
+    int pointLights = 2, spotLights = 1;
+};
+
+class SuiteResult
+{
+public:
+    double loadMs = 0, traceMs = 0, raysPerSecond = 0, peakRssMb = 0;
+    bool ok = false;
+};
+
+// mt19937 is the same everywhere, its distributions are not: scale the raw output so scenes match across libraries
+static double uniform(mt19937 &rng, double lo, double hi) { return lo + (hi - lo) * (rng() / 4294967296.0); }
+
+static void writeMaterial(ostream &out, mt19937 &rng)
+{
+    out << uniform(rng, 0.15, 1) << " " << uniform(rng, 0.15, 1) << " " << uniform(rng, 0.15, 1)
+        << "\n0.2 0.4 0.2 0.3\n20\n";
+}
+
+// n spheres scattered through the 200 x 200 x 100 box above the floor, sized so they fill about the same volume
+static int writeSpheres(ostream &out, mt19937 &rng, int n)
+{
+    double radius = 0.25 * cbrt(4e6 / n);
+    for (int i = 0; i < n; i++)
+    {
+        double r = radius * uniform(rng, 0.5, 1.5), x = uniform(rng, -100, 100), y = uniform(rng, -100, 100);
+        out << "sphere\n" << x << " " << y << " " << uniform(rng, 0, 100) + r << " " << r << "\n";
+        writeMaterial(out, rng);
+    }
+    return n;
+}
+
+static int writeTriangles(ostream &out, mt19937 &rng, int n)
+{
+    double size = 0.8 * cbrt(4e6 / n);
+    for (int i = 0; i < n; i++)
+    {
+        double c[3] = {uniform(rng, -100, 100), uniform(rng, -100, 100), uniform(rng, 0, 100) + size};
+        out << "triangle\n";
+        for (int v = 0; v < 3; v++)
+            for (int k = 0; k < 3; k++)
+                out << c[k] + size * uniform(rng, -1, 1) << (v == 2 && k == 2 ? "\n" : " ");
+        writeMaterial(out, rng);
+    }
+    return n;
+}
+
+// A grid of clipped quadrics cycling through ellipsoids, cylinders, cones, paraboloids and rotated ellipsoids
+static int writeQuadrics(ostream &out, mt19937 &rng, int side)
+{
+    double pitch = 200.0 / side;
+    for (int i = 0; i < side * side; i++)
+    {
+        double s = pitch * 0.4 * uniform(rng, 0.6, 1);
+        double c[3] = {-100 + pitch * (i % side + 0.5), -100 + pitch * (i / side + 0.5), 1.25 * s}; // clear of the floor
+        // Local coefficients A..J about the origin, then the clip box size
+        double q[10] = {}, box[3] = {2 * s, 2 * s, 2 * s};
+        switch (i % 5)
+        {
+        case 0: // ellipsoid
+            q[0] = 1 / (s * s), q[1] = 4 / (s * s), q[2] = 1 / (s * s), q[9] = -1;
+            break;
+        case 1: // upright cylinder, clipped in z
+            q[0] = q[1] = 1 / (s * s), q[9] = -1;
+            break;
+        case 2: // double cone, clipped to the box
+            q[0] = q[1] = 1, q[2] = -1;
+            break;
+        case 3: // paraboloid opening upwards from the box's bottom
+            q[0] = q[1] = 1 / s, q[8] = -1, q[9] = -s;
+            break;
+        default: // ellipsoid rotated about z by a random angle: cross terms
+        {
+            double angle = M_PI * uniform(rng, -1, 1), cs = cos(angle), sn = sin(angle), a = 1 / (s * s), b = 6 / (s * s);
+            q[0] = a * cs * cs + b * sn * sn, q[1] = a * sn * sn + b * cs * cs, q[2] = 2 / (s * s);
+            q[3] = 2 * (a - b) * cs * sn, q[9] = -1;
+        }
+        }
+        // Substitute p - c for p
+        double A = q[0], B = q[1], C = q[2], D = q[3], E = q[4], F = q[5], G = q[6], H = q[7], I = q[8], J = q[9];
+        double x = c[0], y = c[1], z = c[2];
+        out << "general\n"
+            << A << " " << B << " " << C << " " << D << " " << E << " " << F << " "
+            << G - 2 * A * x - D * y - E * z << " " << H - 2 * B * y - D * x - F * z << " "
+            << I - 2 * C * z - E * x - F * y << " "
+            << J + A * x * x + B * y * y + C * z * z + D * x * y + E * x * z + F * y * z - G * x - H * y - I * z << "\n"
+            << x - s << " " << y - s << " " << z - s << "\n"
+            << box[0] << " " << box[1] << " " << box[2] << "\n";
+        writeMaterial(out, rng);
+    }
+    return side * side;
+}
+
+static vector<SuiteScene> suiteScenes()
+{
+    vector<SuiteScene> scenes(6);
+    scenes[0].name = "spheres_1k";
+    scenes[0].objects = [](ostream &out, mt19937 &rng) { return writeSpheres(out, rng, 1000); };
+    scenes[1].name = "spheres_100k";
+    scenes[1].level = 2;
+    scenes[1].objects = [](ostream &out, mt19937 &rng) { return writeSpheres(out, rng, 100000); };
+    scenes[2].name = "spheres_1m";
+    scenes[2].level = 1;
+    scenes[2].heavy = true;
+    scenes[2].objects = [](ostream &out, mt19937 &rng) { return writeSpheres(out, rng, 1000000); };
+    scenes[3].name = "triangles_100k";
+    scenes[3].level = 2;
+    scenes[3].objects = [](ostream &out, mt19937 &rng) { return writeTriangles(out, rng, 100000); };
+    scenes[4].name = "quadrics";
+    scenes[4].objects = [](ostream &out, mt19937 &rng) { return writeQuadrics(out, rng, 20); };
+    scenes[5].name = "lights";
+    scenes[5].objects = [](ostream &out, mt19937 &rng) { return writeSpheres(out, rng, 300); };
+    scenes[5].pointLights = 48;
+    scenes[5].spotLights = 16;
+    for (SuiteScene &scene : scenes)
+    {
+        scene.eye = "160,-200,170";
+        scene.center = "0,0,30";
+    }
+    scenes[4].eye = "0,-170,140";
+    scenes[4].center = "0,-10,0";
+    return scenes;
+}
+
+// Writes the scene once; the generator is seeded by name, so the file never changes between runs or machines
+static bool writeSuiteScene(const SuiteScene &scene, const string &path)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0)
+        return true;
+    uint32_t seed = 2166136261u; // FNV-1a of the name
+    for (char c : scene.name)
+        seed = (seed ^ (unsigned char)c) * 16777619u;
+    mt19937 rng(seed);
+    stringstream objects;
+    objects << setprecision(6);
+    int count = scene.objects(objects, rng);
+    ofstream out(path + ".tmp");
+    out << setprecision(6) << scene.level << " 768\n" << count << "\n" << objects.rdbuf();
+    // Point lights share a fixed total brightness, so adding lights adds work, not exposure
+    double share = 2.0 / scene.pointLights;
+    out << scene.pointLights << "\n";
+    for (int i = 0; i < scene.pointLights; i++)
+    {
+        double x = uniform(rng, -120, 120), y = uniform(rng, -120, 120), z = uniform(rng, 80, 200);
+        out << x << " " << y << " " << z << "\n";
+        for (int k = 0; k < 3; k++)
+            out << uniform(rng, 0.3, 1) * share << (k < 2 ? " " : "\n");
+    }
+    out << scene.spotLights << "\n";
+    for (int i = 0; i < scene.spotLights; i++)
+    {
+        double x = uniform(rng, -120, 120), y = uniform(rng, -120, 120), z = uniform(rng, 80, 200);
+        out << x << " " << y << " " << z << "\n";
+        for (int k = 0; k < 3; k++)
+            out << uniform(rng, 0.3, 1) << (k < 2 ? " " : "\n");
+        out << -x / 2 << " " << -y / 2 << " " << -z << "\n" << uniform(rng, 20, 40) << "\n";
+    }
+    out.close();
+    if (!out || rename((path + ".tmp").c_str(), path.c_str()) != 0)
+    {
+        cerr << "Error: cannot write " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+// Pulls a number out of the --stats=json line, e.g. "trace" or "perSecond"
+static double jsonNumber(const string &json, const string &key)
+{
+    size_t at = json.find("\"" + key + "\":");
+    return at == string::npos ? 0.0 : atof(json.c_str() + at + key.size() + 3);
+}
+
+static SuiteResult renderSuiteScene(const string &mainPath, const vector<string> &args, const string &logPath)
+{
+    SuiteResult result;
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return result;
+    }
+    if (pid == 0)
+    {
+        int log = open(logPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log >= 0)
+        {
+            dup2(log, 1);
+            dup2(log, 2);
+        }
+        vector<char *> argv = {(char *)mainPath.c_str()};
+        for (const string &arg : args)
+            argv.push_back((char *)arg.c_str());
+        argv.push_back(nullptr);
+        execv(mainPath.c_str(), argv.data());
+        perror("execv");
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        cerr << "Error: " << mainPath << " failed, see " << logPath << endl;
+        return result;
+    }
+#ifdef __APPLE__
+    result.peakRssMb = usage.ru_maxrss / 1048576.0; // bytes on macOS
+#else
+    result.peakRssMb = usage.ru_maxrss / 1024.0; // kilobytes on Linux
+#endif
+    ifstream log(logPath);
+    string line, json;
+    while (getline(log, line))
+        if (!line.empty() && line[0] == '{')
+            json = line;
+    result.loadMs = jsonNumber(json, "load");
+    result.traceMs = jsonNumber(json, "trace");
+    result.raysPerSecond = jsonNumber(json, "perSecond");
+    result.ok = !json.empty();
+    if (!result.ok)
+        cerr << "Error: no --stats=json line in " << logPath << endl;
+    return result;
+}
+
+// ./bench --suite [--quick] [--update] [--only name] [--runs n] [--psnr dB] [--tolerance fraction] [--main path]
+int benchSuite(int argc, char **argv)
+{
+    bool quick = false, update = false;
+    int runs = 3;
+    double minPsnr = 40.0, tolerance = 0.15;
+    string mainPath = "./main", only, directory = "bench_suite", goldens = "golden";
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i], value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--suite")
+            continue;
+        else if (arg == "--quick")
+            quick = true;
+        else if (arg == "--update")
+            update = true;
+        else if (value.empty())
+        {
+            cerr << "Error: " << arg << " needs a value" << endl;
+            return 1;
+        }
+        else if (arg == "--only")
+            only = value, i++;
+        else if (arg == "--runs")
+            runs = max(1, atoi(value.c_str())), i++;
+        else if (arg == "--psnr")
+            minPsnr = atof(value.c_str()), i++;
+        else if (arg == "--tolerance")
+            tolerance = atof(value.c_str()), i++;
+        else if (arg == "--main")
+            mainPath = value, i++;
+        else
+        {
+            cerr << "Error: unknown option " << arg << endl;
+            return 1;
+        }
+    }
+    mkdir(directory.c_str(), 0755);
+    mkdir(goldens.c_str(), 0755);
+
+    // Throughput baseline, per machine: name, ms/frame, rays/s
+    string baselinePath = directory + "/baseline.txt";
+    map<string, pair<double, double>> baseline;
+    {
+        ifstream in(baselinePath);
+        string name;
+        double ms, rays;
+        while (in >> name >> ms >> rays)
+            baseline[name] = {ms, rays};
+    }
+
+    cout << "Scene suite (" << runs << " runs each, best trace time; PSNR >= " << minPsnr << " dB, throughput within "
+         << tolerance * 100 << "%)" << endl;
+    cout << left << setw(16) << "  scene" << right << setw(10) << "load ms" << setw(11) << "ms/frame" << setw(13)
+         << "Mrays/s" << setw(10) << "RSS MB" << setw(10) << "PSNR" << setw(10) << "vs base" << "  result" << endl;
+    int failed = 0;
+    bool baselineChanged = false;
+    for (const SuiteScene &scene : suiteScenes())
+    {
+        if (only.empty() ? scene.heavy && quick : scene.name != only)
+            continue;
+        string scenePath = directory + "/" + scene.name + ".txt", output = directory + "/" + scene.name + ".bmp";
+        string golden = goldens + "/" + scene.name + ".bmp";
+        if (!writeSuiteScene(scene, scenePath))
+            return 1;
+        vector<string> args = {"--headless", "--no-cache", "--stats=json", "--scene", scenePath, "--output", output,
+                               "--width", "192", "--height", "144", "--eye", scene.eye, "--center", scene.center,
+                               "--up", scene.up};
+        SuiteResult best;
+        for (int run = 0; run < runs; run++)
+        {
+            SuiteResult result = renderSuiteScene(mainPath, args, directory + "/" + scene.name + ".log");
+            if (!result.ok)
+            {
+                best.ok = false;
+                break;
+            }
+            if (!best.ok || result.traceMs < best.traceMs)
+            {
+                double peak = max(best.peakRssMb, result.peakRssMb);
+                best = result;
+                best.peakRssMb = peak;
+            }
+            else
+                best.peakRssMb = max(best.peakRssMb, result.peakRssMb);
+        }
+
+        string verdict = "ok";
+        double psnr = 0.0, change = 0.0;
+        if (!best.ok)
+            verdict = "FAILED: render";
+        else
+        {
+            if (update)
+            {
+                ifstream in(output, ios::binary);
+                ofstream out(golden, ios::binary);
+                out << in.rdbuf();
+                baseline[scene.name] = {best.traceMs, best.raysPerSecond};
+                baselineChanged = true;
+            }
+            struct stat info;
+            if (stat(golden.c_str(), &info) != 0)
+                verdict = "FAILED: no golden image (run with --update)";
+            else if ((psnr = bitmap_image(output).psnr(bitmap_image(golden))) < minPsnr)
+                verdict = "FAILED: image differs";
+            // Rays/s when the counters are compiled in, frames/s otherwise
+            auto it = baseline.find(scene.name);
+            if (it == baseline.end())
+            {
+                baseline[scene.name] = {best.traceMs, best.raysPerSecond};
+                baselineChanged = true;
+            }
+            else
+            {
+                bool rays = best.raysPerSecond > 0 && it->second.second > 0;
+                change = rays ? best.raysPerSecond / it->second.second - 1 : it->second.first / best.traceMs - 1;
+                if (change < -tolerance && verdict == "ok")
+                    verdict = "FAILED: slower than baseline";
+            }
+        }
+        failed += verdict != "ok";
+        cout << "  " << left << setw(14) << scene.name << right << fixed << setprecision(1) << setw(10) << best.loadMs
+             << setw(11) << best.traceMs << setprecision(3) << setw(13) << best.raysPerSecond / 1e6 << setprecision(1)
+             << setw(10) << best.peakRssMb << setw(10) << min(psnr, 999.9) << setw(9) << change * 100 << "%  "
+             << verdict << defaultfloat << endl;
+    }
+    if (baselineChanged)
+    {
+        ofstream out(baselinePath);
+        for (auto &entry : baseline)
+            out << entry.first << " " << entry.second.first << " " << entry.second.second << "\n";
+    }
+    if (failed)
+        cerr << "FAILED: " << failed << " suite scene(s)" << endl;
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && string(argv[1]) == "--suite")
+        return benchSuite(argc, argv);
+    int failed = benchTriangles();
+    failed += benchPackets();
+    failed += benchTexture();
+    failed += benchQuadrics();
+    failed += benchCulling();
+    return failed ? 1 : 0;
+}
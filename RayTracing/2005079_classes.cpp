@@ -2,155 +2,42 @@
 #define GL_SILENCE_DEPRECATION
 #include <GLUT/glut.h> // Use GLUT framework on macOS
 #else
+#define GL_GLEXT_PROTOTYPES // glGenBuffers and friends for the preview meshes
 #include <GL/glut.h> // Use standard GLUT location on Linux/Windows
 #endif
 #include <iostream>
+#include <cstdlib>
 #include <stdexcept>
 #include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <random>
+#include <unordered_map>
+#include <typeinfo>
+#include <functional>
+#include <cstring>
+#include <sstream>
+#include <fstream>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 #include "2005079_classes.hpp"
+#include "2005079_simd.hpp"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 using namespace std;
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-//                                                  Point                                                         //
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-Vector Point::operator-(const Point &p) const { return Vector(x - p.x, y - p.y, z - p.z); }
-Point Point::operator+(const Vector &v) const { return Point(x + v.x, y + v.y, z + v.z); }
-Point Point::operator-(const Vector &v) const { return Point(x - v.x, y - v.y, z - v.z); }
-Point Point::operator+=(const Vector &v)
-{
-    x += v.x;
-    y += v.y;
-    z += v.z;
-    return *this;
-}
-Point Point::operator-=(const Vector &v)
-{
-    x -= v.x;
-    y -= v.y;
-    z -= v.z;
-    return *this;
-}
-double Point::distance(const Point &p) const
-{
-    return sqrt((x - p.x) * (x - p.x) +
-                (y - p.y) * (y - p.y) +
-                (z - p.z) * (z - p.z));
-}
-void Point::print() const { cout << "Point(" << x << ", " << y << ", " << z << ")" << endl; }
-Vector Point::toVector() const { return Vector(x, y, z); }
-
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-//                                                  Vector                                                        //
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-Vector Vector::operator=(const Vector &v)
-{
-    if (this != &v)
-    {
-        x = v.x;
-        y = v.y;
-        z = v.z;
-    }
-    return *this;
-}
-Vector Vector::operator+(const Vector &v) const { return Vector(x + v.x, y + v.y, z + v.z); }
-Vector Vector::operator-(const Vector &v) const { return Vector(x - v.x, y - v.y, z - v.z); }
-Vector Vector::operator*(const double &d) const { return Vector(x * d, y * d, z * d); }
-Vector Vector::operator/(const double &d) const
-{
-    if (d == 0)
-        throw invalid_argument("Division by zero is not allowed.");
-    return Vector(x / d, y / d, z / d);
-}
-Vector Vector::operator+=(const Vector &v)
-{
-    x += v.x;
-    y += v.y;
-    z += v.z;
-    return *this;
-}
-Vector Vector::operator+=(const double &d)
-{
-    x += d;
-    y += d;
-    z += d;
-    return *this;
-}
-Vector Vector::operator-=(const double &d)
-{
-    x -= d;
-    y -= d;
-    z -= d;
-    return *this;
-}
-Vector Vector::operator-=(const Vector &v)
-{
-    x -= v.x;
-    y -= v.y;
-    z -= v.z;
-    return *this;
-}
-Vector Vector::operator*=(const double &d)
-{
-    x *= d;
-    y *= d;
-    z *= d;
-    return *this;
-}
-Vector Vector::operator/=(const double &d)
-{
-    if (d == 0)
-        throw invalid_argument("Division by zero is not allowed.");
-    x /= d;
-    y /= d;
-    z /= d;
-    return *this;
-}
-double Vector::dot(const Vector &v) const { return x * v.x + y * v.y + z * v.z; }
-Vector Vector::cross(const Vector &v) const
-{
-    return Vector(
-        y * v.z - z * v.y,
-        z * v.x - x * v.z,
-        x * v.y - y * v.x);
-}
-Vector Vector::normalize() const
-{
-    double len = norm();
-    if (len == 0)
-        return Vector(0, 0, 0);
-    return Vector(x / len, y / len, z / len);
-}
-Vector Vector::rotate(const Vector &axis, double angle) const
-{
-    double cosTheta = cos(angle);
-    double sinTheta = sin(angle);
-    Vector normalizedAxis = axis.normalize();
-    return *this * cosTheta +
-           (normalizedAxis.cross(*this)) * sinTheta +
-           normalizedAxis * (normalizedAxis.dot(*this)) * (1 - cosTheta);
-}
-Vector Vector::rotateAroundAxis(const Vector &axis, double angle)
-{
-    double cosTheta = cos(angle);
-    double sinTheta = sin(angle);
-    Vector normalizedAxis = axis.normalize();
-    *this = *this * cosTheta +
-            (normalizedAxis.cross(*this)) * sinTheta +
-            normalizedAxis * (normalizedAxis.dot(*this)) * (1 - cosTheta);
-    return *this;
-}
-double Vector::norm() const { return sqrt(x * x + y * y + z * z); }
-Vector Vector::reflect(const Plane &plane) const
-{
-    Vector normal = plane.normal.normalize();
-    return *this - normal * (2 * this->dot(normal));
-}
-Vector Vector::reflect(const Vector &normal) const { return *this - normal * (2 * this->dot(normal)); }
-void Vector::print() const { printf("Vector: (%.2f, %.2f, %.2f)\n", x, y, z); }
-
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //                                                  Plane                                                         //
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -300,18 +187,167 @@ void Camera::moveDown_wo_refPoint()
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-//                                                  Color                                                         //
+//                                              CameraPath                                                        //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename T>
+static T catmullRom(const T &p0, const T &p1, const T &p2, const T &p3, double t)
+{
+    double t2 = t * t, t3 = t2 * t;
+    return (p1 * 2.0 + (p2 - p0) * t + (p0 * 2.0 - p1 * 5.0 + p2 * 4.0 - p3) * t2 + (p1 * 3.0 - p0 - p2 * 3.0 + p3) * t3) * 0.5;
+}
+bool CameraPath::load(const string &path)
+{
+    ifstream input(path);
+    int count = 0;
+    if (!(input >> count) || count < 1)
+    {
+        cerr << "Error: cannot read camera keyframes from " << path << endl;
+        return false;
+    }
+    eyes.clear();
+    centers.clear();
+    ups.clear();
+    for (int i = 0; i < count; i++)
+    {
+        double v[9];
+        for (double &value : v)
+            input >> value;
+        if (!input)
+        {
+            cerr << "Error: " << path << " ends before keyframe " << i + 1 << " of " << count << endl;
+            return false;
+        }
+        eyes.push_back(Point(v[0], v[1], v[2]));
+        centers.push_back(Point(v[3], v[4], v[5]));
+        ups.push_back(Vector(v[6], v[7], v[8]));
+    }
+    auto same = [](const Vector &a, const Vector &b) { return a.norm() <= 1e-9 * max<double>(1.0, b.norm()); };
+    closed = count > 2 && same(eyes[0] - eyes.back(), eyes[0] - Point()) && same(centers[0] - centers.back(), centers[0] - Point()) &&
+             same(ups[0] - ups.back(), ups[0]);
+    if (closed)
+    {
+        eyes.pop_back(); // the wrap-around supplies it
+        centers.pop_back();
+        ups.pop_back();
+    }
+    return true;
+}
+void CameraPath::at(int frame, int frames, Camera &camera) const
+{
+    int n = eyes.size();
+    if (n == 1)
+    {
+        camera.setView(eyes[0], centers[0], ups[0]);
+        return;
+    }
+    // Position along the keys: closed paths cover n segments and leave out the frame that would repeat the first
+    double s = closed ? (double)frame * n / frames : frames > 1 ? (double)frame * (n - 1) / (frames - 1) : 0.0;
+    int i = min((int)s, closed ? n - 1 : n - 2);
+    double t = s - i;
+    auto key = [&](int k) { return closed ? (k % n + n) % n : clamp(k, 0, n - 1); };
+    int k0 = key(i - 1), k1 = key(i), k2 = key(i + 1), k3 = key(i + 2);
+    Point origin;
+    Vector eye = catmullRom(eyes[k0] - origin, eyes[k1] - origin, eyes[k2] - origin, eyes[k3] - origin, t);
+    Vector center = catmullRom(centers[k0] - origin, centers[k1] - origin, centers[k2] - origin, centers[k3] - origin, t);
+    Vector up = catmullRom(ups[k0], ups[k1], ups[k2], ups[k3], t);
+    // At t = 0 the spline returns the key exactly, so a frame on a key renders like --eye/--center/--up would
+    camera.setView(origin + eye, origin + center, up);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                              PreviewMesh                                                       //
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-Color Color::operator+(const Color &c) const { return Color(r + c.r, g + c.g, b + c.b); }
-Color Color::operator*(const double &d) const { return Color(r * d, g * d, b * d); }
-Color Color::operator*(const Color &c) const { return Color(r * c.r, g * c.g, b * c.b); }
-void Color::clamp()
+bool PreviewMesh::ready() const { return buffer != 0 || list != 0; }
+void PreviewMesh::upload()
+{
+    count = vertices.size() / 3;
+    textured = !texCoords.empty();
+    const char *version = (const char *)glGetString(GL_VERSION);
+    if (version != nullptr && atof(version) >= 1.5)
+    {
+        // Positions first, texture coordinates after them in the same buffer
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        glBufferData(GL_ARRAY_BUFFER, (vertices.size() + texCoords.size()) * sizeof(GLfloat), nullptr, GL_STATIC_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, vertices.size() * sizeof(GLfloat), vertices.data());
+        glBufferSubData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), texCoords.size() * sizeof(GLfloat), texCoords.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    else
+    {
+        // The display list keeps its own copy of the client arrays
+        list = glGenLists(1);
+        glNewList(list, GL_COMPILE);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(3, GL_FLOAT, 0, vertices.data());
+        if (textured)
+        {
+            glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+            glTexCoordPointer(2, GL_FLOAT, 0, texCoords.data());
+        }
+        glDrawArrays(mode, 0, count);
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glEndList();
+    }
+    vector<GLfloat>().swap(vertices);
+    vector<GLfloat>().swap(texCoords);
+}
+void PreviewMesh::draw() const
+{
+    if (list != 0)
+    {
+        glCallList(list);
+        return;
+    }
+    if (buffer == 0)
+        return;
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, (const GLvoid *)0);
+    if (textured)
+    {
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glTexCoordPointer(2, GL_FLOAT, 0, (const GLvoid *)(3 * count * sizeof(GLfloat)));
+    }
+    glDrawArrays(mode, 0, count);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+void PreviewMesh::release()
+{
+    if (buffer != 0)
+        glDeleteBuffers(1, &buffer);
+    if (list != 0)
+        glDeleteLists(list, 1);
+    buffer = list = 0;
+    count = 0;
+}
+PreviewMesh &PreviewMesh::unitSphere()
 {
-    r = max(0.0, min(1.0, r));
-    g = max(0.0, min(1.0, g));
-    b = max(0.0, min(1.0, b));
+    // Same 50 x 50 tessellation glutSolidSphere used, built once as plain triangles
+    static PreviewMesh mesh;
+    if (!mesh.ready())
+    {
+        const int slices = 50, stacks = 50;
+        auto vertex = [&](int slice, int stack)
+        {
+            double theta = 2 * M_PI * slice / slices, phi = M_PI * stack / stacks;
+            mesh.vertices.insert(mesh.vertices.end(), {(GLfloat)(sin(phi) * cos(theta)), (GLfloat)(sin(phi) * sin(theta)), (GLfloat)cos(phi)});
+        };
+        for (int stack = 0; stack < stacks; stack++)
+        {
+            for (int slice = 0; slice < slices; slice++)
+            {
+                vertex(slice, stack), vertex(slice, stack + 1), vertex(slice + 1, stack + 1);
+                vertex(slice, stack), vertex(slice + 1, stack + 1), vertex(slice + 1, stack);
+            }
+        }
+        mesh.upload();
+    }
+    return mesh;
 }
-void Color::print() const { cout << "Color(" << r << ", " << g << ", " << b << ")\n"; }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //                                                  Object                                                        //
@@ -326,30 +362,17 @@ void Object::setCoefficients(double ambient, double diffuse, double specular, do
     this->reflectionCoefficient = reflectionCoefficient;
     this->shine = shine;
 }
-// void Object::traceRay(const Ray &r, Color &color, int level) const
-void Object::traceRay(const Ray &r, Color &c, int level, const vector<PointLight *> &pointLights,
-                      const vector<SpotLight *> &spotLights) const
+// Ambient, diffuse and specular light at a hit point; reflection is added by traceRay
+Color Object::shade(const Ray &r, const Point &intersection, const Vector &normal, const vector<PointLight *> &pointLights,
+                    const vector<SpotLight *> &spotLights, OcclusionCache *shadowCache, double footprint) const
 {
-    // std::cout << "Spotlights: " << spotLights.size() << ", PointLights: " << pointLights.size() << std::endl;
-    double t = intersect(r);
-    // Use a minimum threshold for intersection distance to avoid numerical issues
-    if (level == 0 || t < 1e-6)
-        return;
-    Point intersection = r.origin + r.direction * t;
-    // cout << "Intersection Point: ";
-    // intersection.print();
-    Color localColor = getColor(intersection);
-    // localColor.print();
-    // this->color.print();
-    // cout << "Ambient: " << ambient << "\n";
-    c = localColor * ambient;
-    // color.print();
-    Vector normal = getNormal(intersection);
-    if (r.direction.dot(normal) > 0)
-        normal = normal * (-1);
-    // cout << "here...\n";
-    for (SpotLight *s : spotLights)
+    Color localColor = colorAt(intersection, footprint);
+    Color c = localColor * ambient;
+    double epsilon = surfaceEpsilon(intersection, intersection.distance(r.origin));
+    // Shadow caches index spot lights first, then point lights
+    for (int k = 0; k < (int)spotLights.size(); k++)
     {
+        SpotLight *s = spotLights[k];
         Ray lightRay(s->position, intersection - s->position);
         double beta;
         double dot = lightRay.direction.dot(s->direction);
@@ -360,89 +383,149 @@ void Object::traceRay(const Ray &r, Color &c, int level, const vector<PointLight
         double t_cur = (intersection - s->position).norm();
         if (t_cur < 1e-6)
             continue;
-        bool obscured = false;
-        for (Object *obj : objects)
-        {
-            double t = obj->intersect(lightRay);
-            if (t > 1e-6 && t + 1e-6 < t_cur)
-            {
-                obscured = true;
-                break;
-            }
-        }
-        if (obscured)
-            continue;
-        double lambert_value = max(0.0, normal.dot(lightRay.direction * (-1)));
+        double lambert_value = max<double>(0.0, normal.dot(lightRay.direction * (-1)));
         if (lambert_value < 1e-6)
             continue;
-        double epsilon = 2;
-        c = c + s->color * diffuse * lambert_value * localColor * pow(cos(beta), epsilon);
+        if (bvh.occluded(intersection, s->position, k, shadowCache, epsilon))
+            continue;
+        double spotExponent = 2; // falloff towards the edge of the cone
+        c = c + s->color * diffuse * lambert_value * localColor * pow(cos(beta), spotExponent);
         Ray reflected_ray(intersection, lightRay.direction.reflect(normal));
-        double phongVal = max(0.0, reflected_ray.direction.dot(r.direction * (-1)));
-        c = c + s->color * specular * pow(phongVal, shine) * localColor * pow(cos(beta), epsilon);
+        double phongVal = max<double>(0.0, reflected_ray.direction.dot(r.direction * (-1)));
+        c = c + s->color * specular * pow(phongVal, shine) * localColor * pow(cos(beta), spotExponent);
     }
-    for (Light *p : pointLights)
+    for (int k = 0; k < (int)pointLights.size(); k++)
     {
+        Light *p = pointLights[k];
         Ray lightRay(p->position, (intersection - p->position).normalize());
-        // lightRay.origin.print();
-        // lightRay.direction.print();
         double t_cur = (intersection - p->position).norm();
         if (t_cur < 1e-6)
             continue;
-        bool obscured = false;
-        for (Object *obj : objects)
-        {
-            double t = obj->intersect(lightRay);
-            if (t > 1e-6 && t + 1e-6 < t_cur)
-            {
-                obscured = true;
-                break;
-            }
-        }
-        if (obscured)
-            continue;
-        double lambert_value = max(0.0, normal.dot(lightRay.direction * (-1)));
+        double lambert_value = max<double>(0.0, normal.dot(lightRay.direction * (-1)));
         if (lambert_value < 1e-6)
             continue;
+        if (bvh.occluded(intersection, p->position, spotLights.size() + k, shadowCache, epsilon))
+            continue;
         c = c + p->color * diffuse * lambert_value * localColor;
         Ray reflected_ray(intersection, lightRay.direction.reflect(normal));
-        double phongVal = max(0.0, reflected_ray.direction.dot(r.direction * (-1)));
+        double phongVal = max<double>(0.0, reflected_ray.direction.dot(r.direction * (-1)));
         c = c + p->color * specular * pow(phongVal, shine) * localColor;
     }
-    if (level == 0)
-        return;
-    Ray reflectedRay(intersection, r.direction.reflect(normal));
-    // reflectedRay.origin.print();
-    // reflectedRay.direction.print();
-    reflectedRay.origin += reflectedRay.direction * 1e-6; // Offset to avoid self-intersection
-    Object *nextObject = nextReflectionObject(reflectedRay);
-    if (nextObject == nullptr)
-        return;
-    // else
-    //     nextObject->color.print();
-    Color reflectedColor(0.0, 0.0, 0.0);
-    nextObject->traceRay(reflectedRay, reflectedColor, level - 1, pointLights, spotLights);
-    c = c + reflectedColor * reflectionCoefficient;
-    return;
+    return c;
 }
-Color Object::getColor(const Point &p) const { return this->color; }
-Object *Object::nextReflectionObject(const Ray &r) const
+int Object::rouletteDepth = 0;
+double Object::pixelSpread = 0.0;
+double Object::radianceBound = 1e30; // no bound until setRadianceBound: paths run to the recursion level
+double Object::reflectionBound = 1.0;
+void Object::setRadianceBound(const vector<Material> &materials, const vector<PointLight *> &pointLights,
+                              const vector<SpotLight *> &spotLights)
 {
-    int nearest = -1;
-    double tMin = 1e9;
-    for (int i = 0; i < objects.size(); i++)
+    // shade() = colour * (ambient + sum over lights of light * (diffuse * lambert + specular * phong^shine) * falloff),
+    // where lambert, phong and the spot falloff are at most 1
+    double lights = 0.0;
+    for (const PointLight *p : pointLights)
+        lights += max<double>(p->color.r, max<double>(p->color.g, p->color.b));
+    for (const SpotLight *s : spotLights)
+        lights += max<double>(s->color.r, max<double>(s->color.g, s->color.b));
+    radianceBound = 0.0;
+    reflectionBound = 0.0;
+    for (const Material &m : materials)
+    {
+        // Textures are at most 1 per channel; plain colours can be brighter
+        double color = max(1.0, max<double>(m.color.r, max<double>(m.color.g, m.color.b)));
+        double terms = fabs(m.ambient) + (fabs(m.diffuse) + fabs(m.specular)) * lights;
+        radianceBound = max(radianceBound, color * terms);
+        reflectionBound = max(reflectionBound, fabs(m.reflectionCoefficient));
+    }
+}
+// Follows the reflection path iteratively: each bounce's hit comes from the previous closestHit,
+// so no intersection is recomputed. t is the hit distance along r when the caller already knows it, and normal the
+// surface normal there (facing r), e.g. from a GBuffer.
+void Object::traceRay(const Ray &r, Color &c, int level, const vector<PointLight *> &pointLights,
+                      const vector<SpotLight *> &spotLights, OcclusionCache *shadowCache, double t,
+                      const Vector *firstNormal) const
+{
+    if (t < 0)
+        t = intersect(r);
+    if (FrameDependencies::recording)
+        DependencyRecorder::local.hit(this, r.origin + r.direction * t);
+    // Use a minimum threshold for intersection distance to avoid numerical issues
+    if (level == 0 || t < 1e-6)
+        return;
+    static thread_local minstd_rand rouletteRng(2005079);
+    const Object *object = this;
+    Ray ray = r;
+    double throughput = 1.0; // product of the reflection coefficients so far
+    double distance = 0.0;   // path length to the current hit; the ray cone grows with it (as if mirrors were flat)
+    c = Color(0.0, 0.0, 0.0);
+    for (int depth = 0; depth < level; depth++)
     {
-        Object *o = objects[i];
-        double t = o->intersect(r);
-        if (t > 0 && t < tMin)
+        Point intersection = ray.origin + ray.direction * t;
+        Vector normal = depth == 0 && firstNormal ? *firstNormal : object->normalAt(ray, intersection);
+        if (ray.direction.dot(normal) > 0)
+            normal = normal * (-1);
+        distance += t;
+        // The cone's cross-section stretched over the surface it lands on
+        double footprint = pixelSpread * distance / max<double>(fabs(ray.direction.dot(normal)), 1e-3);
+        c = c + object->shade(ray, intersection, normal, pointLights, spotLights, shadowCache, footprint) * throughput;
+        throughput *= object->reflectionCoefficient;
+        // Stop once the rest of the path can add less than one 8-bit step: each further bounce adds at most
+        // radianceBound, scaled by at most reflectionBound per bounce. It can still tip a channel over a rounding edge.
+        int remaining = level - depth - 1;
+        if (remaining == 0)
+            return;
+        double tail = reflectionBound < 1.0 ? (1.0 - pow(reflectionBound, remaining)) / (1.0 - reflectionBound) : remaining;
+        if (throughput * radianceBound * tail < 1.0 / 255)
+            return;
+        if (rouletteDepth > 0 && depth + 1 >= rouletteDepth)
         {
-            tMin = t;
-            nearest = i;
+            double survive = min(1.0, max(0.1, throughput));
+            if (uniform_real_distribution<double>(0.0, 1.0)(rouletteRng) >= survive)
+                return;
+            throughput /= survive;
         }
+        Ray reflectedRay(intersection, ray.direction.reflect(normal));
+        double epsilon = surfaceEpsilon(intersection, t);
+        reflectedRay.origin += reflectedRay.direction * epsilon; // Offset to avoid self-intersection
+        double tNext = 1e9;
+        RT_COUNT(reflectionRays, 1);
+        Object *nextObject = bvh.closestHit(reflectedRay, tNext);
+        bool missed = nextObject == nullptr || tNext < epsilon;
+        if (FrameDependencies::recording)
+        {
+            // Where the ray escapes, its whole line inside the world box counts
+            DependencyRecorder::local.reflection(reflectedRay.origin,
+                                                 reflectedRay.origin + reflectedRay.direction * (missed ? 1e9 : tNext));
+            if (!missed)
+                DependencyRecorder::local.hit(nextObject, reflectedRay.origin + reflectedRay.direction * tNext);
+        }
+        if (missed)
+            return;
+        object = nextObject;
+        ray = reflectedRay;
+        t = tNext;
     }
-    if (nearest == -1)
-        return nullptr;
-    return objects[nearest];
+}
+Color Object::getColor(const Point &p) const { return this->color; }
+Color Object::colorAt(const Point &p, double footprint) const { return getColor(p); }
+Object *Object::nextReflectionObject(const Ray &r) const
+{
+    double tMin = 1e9;
+    return bvh.closestHit(r, tMin);
+}
+bool Object::getBoundingBox(AABB &box) const { return false; }
+void Object::intersectPacket(const RayPacket &packet, Real *t) const
+{
+    for (int i = 0; i < packet.size; i++)
+        t[i] = intersect(packet.ray(i));
+    for (int i = packet.size; i < packet.lanes; i++)
+        t[i] = t[0];
+}
+Vector Object::normalAt(const Ray &r, const Point &point) const { return getNormal(point); }
+bool Object::occludes(const Ray &r, double tMax, double epsilon) const
+{
+    double t = intersect(r);
+    return t > epsilon && t + epsilon < tMax;
 }
 void Object::setReferencePoint(const Point &p) { referencePoint = p; }
 
@@ -470,45 +553,61 @@ void Triangle::print() const
     p3.print();
 }
 Vector Triangle::getNormal(const Point &point) const { return (p2 - p1).cross(p3 - p1).normalize(); }
-double Triangle::intersect(const Ray &r) const
-{
-    // Plane plane = Plane(p1, p2, p3);
-    // double t = plane.intersect(r);
-    Matrix A = Matrix(3, 3);
-    Matrix betaMat = Matrix(3, 3);
-    Matrix gammaMat = Matrix(3, 3);
-    Matrix tMat = Matrix(3, 3);
-    A.setMatrix({{-r.direction.x, p2.x - p1.x, p3.x - p1.x},
-                 {-r.direction.y, p2.y - p1.y, p3.y - p1.y},
-                 {-r.direction.z, p2.z - p1.z, p3.z - p1.z}});
-    double detA = A.determinant();
-    // cout << "Determinant of A: " << detA << endl;
-    if (fabs(detA) < 1e-6)
-    {
-        cout << "Ray is parallel to triangle, no intersection." << endl;
+// Moller-Trumbore: same Cramer's rule solve as [-d, e1, e2] * (t, beta, gamma) = o - p1,
+// written with the cached edges so nothing is allocated per call
+static double triangleIntersect(const Point &p1, const Vector &edge1, const Vector &edge2, const Ray &r,
+                                double minDet = 1e-6)
+{
+    Vector pvec = r.direction.cross(edge2);
+    double det = edge1.dot(pvec);
+    if (fabs(det) < minDet)
+        return -1.0; // Ray is parallel to triangle
+    double invDet = 1.0 / det;
+    Vector tvec = r.origin - p1;
+    double beta = tvec.dot(pvec) * invDet;
+    if (beta < -1e-6)
         return -1.0;
+    Vector qvec = tvec.cross(edge1);
+    double gamma = r.direction.dot(qvec) * invDet;
+    if (gamma < -1e-6 || beta + gamma > 1 + 1e-6)
+        return -1.0;
+    return edge2.dot(qvec) * invDet;
+}
+// Same steps as triangleIntersect(), SimdReal::WIDTH rays at a time
+static void trianglePacket(const Point &p1, const Vector &edge1, const Vector &edge2, const RayPacket &packet, Real *t)
+{
+    SimdReal e1x(edge1.x), e1y(edge1.y), e1z(edge1.z);
+    SimdReal e2x(edge2.x), e2y(edge2.y), e2z(edge2.z);
+    SimdReal px(p1.x), py(p1.y), pz(p1.z);
+    SimdReal eps(1e-6), one(1.0), none(-1.0);
+    for (int i = 0; i < packet.lanes; i += SimdReal::WIDTH)
+    {
+        SimdReal dx = SimdReal::load(packet.dx + i), dy = SimdReal::load(packet.dy + i), dz = SimdReal::load(packet.dz + i);
+        SimdReal pvx = dy * e2z - dz * e2y, pvy = dz * e2x - dx * e2z, pvz = dx * e2y - dy * e2x;
+        SimdReal det = e1x * pvx + e1y * pvy + e1z * pvz;
+        SimdReal invDet = one / det;
+        SimdReal tx = SimdReal::load(packet.ox + i) - px, ty = SimdReal::load(packet.oy + i) - py,
+                   tz = SimdReal::load(packet.oz + i) - pz;
+        SimdReal beta = (tx * pvx + ty * pvy + tz * pvz) * invDet;
+        SimdReal qx = ty * e1z - tz * e1y, qy = tz * e1x - tx * e1z, qz = tx * e1y - ty * e1x;
+        SimdReal gamma = (dx * qx + dy * qy + dz * qz) * invDet;
+        SimdReal hitT = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+        SimdRealMask valid = (abs(det) >= eps) & (beta >= SimdReal(-1e-6)) & (gamma >= SimdReal(-1e-6)) &
+                         (beta + gamma <= SimdReal(1 + 1e-6));
+        select(valid, hitT, none).store(t + i);
     }
-    tMat.setMatrix({{r.origin.x - p1.x, p2.x - p1.x, p3.x - p1.x},
-                    {r.origin.y - p1.y, p2.y - p1.y, p3.y - p1.y},
-                    {r.origin.z - p1.z, p2.z - p1.z, p3.z - p1.z}});
-    betaMat.setMatrix({{-r.direction.x, r.origin.x - p1.x, p3.x - p1.x},
-                       {-r.direction.y, r.origin.y - p1.y, p3.y - p1.y},
-                       {-r.direction.z, r.origin.z - p1.z, p3.z - p1.z}});
-    gammaMat.setMatrix({{-r.direction.x, p2.x - p1.x, r.origin.x - p1.x},
-                        {-r.direction.y, p2.y - p1.y, r.origin.y - p1.y},
-                        {-r.direction.z, p2.z - p1.z, r.origin.z - p1.z}});
-    double t = tMat.determinant() / detA;
-    // cout << "Intersection t: " << t << endl;
-    double beta = betaMat.determinant() / detA;
-    double gamma = gammaMat.determinant() / detA;
-    // cout << "Beta: " << beta << ", Gamma: " << gamma << endl;
-    if (beta >= -1e-6 && gamma >= -1e-6 && beta + gamma <= 1 + 1e-6)
-    {
-        // cout << "Intersect detected with triangle." << endl;
-        return t;
-    }
-    return -1.0;
 }
+double Triangle::intersect(const Ray &r) const { return triangleIntersect(p1, edge1, edge2, r); }
+bool Triangle::getBoundingBox(AABB &box) const
+{
+    box = AABB();
+    box.expand(p1);
+    box.expand(p2);
+    box.expand(p3);
+    box.pad(1e-4); // flat triangles still get a box with volume
+    return true;
+}
+void Triangle::intersectPacket(const RayPacket &packet, Real *t) const { trianglePacket(p1, edge1, edge2, packet, t); }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //                                                  Sphere                                                        //
@@ -521,7 +620,8 @@ void Sphere::draw() const
     glPushMatrix();
     {
         glTranslatef(center.x, center.y, center.z);
-        glutSolidSphere(radius, 50, 50);
+        glScalef(radius, radius, radius);
+        PreviewMesh::unitSphere().draw();
     }
     glPopMatrix();
 }
@@ -535,31 +635,59 @@ void Sphere::print() const
     color.print();
 }
 Vector Sphere::getNormal(const Point &point) const { return (point - center).normalize(); }
-double Sphere::intersect(const Ray &r) const
+// Solves a t^2 + 2 b t + c = 0 without the two cancellations of the textbook formula: the discriminant comes from
+// the distance between the center and the ray, and the smaller-magnitude root from c / q. Float builds need both.
+static double sphereIntersect(const Point &center, double radius, const Ray &r)
 {
-    // cout << "Checking intersection with Sphere at " << center.x << ", " << center.y << ", " << center.z
-    //      << " with radius " << radius << endl;
-    // cout << "Sphere intersection ray origin: " << r.origin.x << ", " << r.origin.y << ", " << r.origin.z
-    //      << " direction: " << r.direction.x << ", " << r.direction.y << ", " << r.direction.z << endl;
-    Vector shiftedOrigin = r.origin - referencePoint;
+    Vector shiftedOrigin = r.origin - center;
     double a = r.direction.dot(r.direction);
-    double b = 2 * r.direction.dot(shiftedOrigin);
-    double c = shiftedOrigin.dot(shiftedOrigin) - radius * radius;
-    // cout << "Sphere intersection coefficients: a = " << a << ", b = " << b << ", c = " << c << endl;
-    double discriminant = b * b - 4 * a * c;
-    // cout << "Sphere intersection discriminant: " << discriminant << endl;
+    double b = r.direction.dot(shiftedOrigin);
+    Vector closest = shiftedOrigin - r.direction * (b / a);
+    double discriminant = a * (radius * radius - closest.dot(closest));
     if (discriminant < 0)
         return -1.0;
-    double t1 = (-b - sqrt(discriminant)) / (2 * a);
-    double t2 = (-b + sqrt(discriminant)) / (2 * a);
-    // cout << "Sphere intersection t1: " << t1 << ", t2: " << t2 << endl;
-    if (t1 < 0 && t2 < 0)
+    double c = shiftedOrigin.dot(shiftedOrigin) - radius * radius;
+    double q = -(b + copysign(sqrt(discriminant), b));
+    if (q == 0)
         return -1.0;
-    if (t1 < 0)
-        return t2;
-    if (t2 < 0)
+    double t1 = min(c / q, q / a);
+    double t2 = max(c / q, q / a);
+    if (t1 >= 0)
         return t1;
-    return min(t1, t2);
+    return t2 >= 0 ? t2 : -1.0;
+}
+// Same steps as sphereIntersect(), SimdReal::WIDTH rays at a time
+static void spherePacket(const Point &center, Real radius, const RayPacket &packet, Real *t)
+{
+    SimdReal cx(center.x), cy(center.y), cz(center.z), rr(radius * radius);
+    SimdReal zero(0.0), none(-1.0);
+    for (int i = 0; i < packet.lanes; i += SimdReal::WIDTH)
+    {
+        SimdReal dx = SimdReal::load(packet.dx + i), dy = SimdReal::load(packet.dy + i), dz = SimdReal::load(packet.dz + i);
+        SimdReal sx = SimdReal::load(packet.ox + i) - cx, sy = SimdReal::load(packet.oy + i) - cy,
+                 sz = SimdReal::load(packet.oz + i) - cz;
+        SimdReal a = dx * dx + dy * dy + dz * dz;
+        SimdReal b = dx * sx + dy * sy + dz * sz;
+        SimdReal k = b / a;
+        SimdReal fx = sx - dx * k, fy = sy - dy * k, fz = sz - dz * k;
+        SimdReal discriminant = a * (rr - (fx * fx + fy * fy + fz * fz));
+        SimdReal c = sx * sx + sy * sy + sz * sz - rr;
+        SimdReal root = sqrt(max(discriminant, zero));
+        SimdReal q = zero - select(b >= zero, b + root, b - root);
+        SimdReal r1 = c / q, r2 = q / a;
+        SimdReal t1 = min(r1, r2), t2 = max(r1, r2);
+        SimdReal hitT = select(t1 >= zero, t1, select(t2 >= zero, t2, none));
+        select(discriminant < zero, none, hitT).store(t + i);
+    }
+}
+double Sphere::intersect(const Ray &r) const { return sphereIntersect(referencePoint, radius, r); }
+void Sphere::intersectPacket(const RayPacket &packet, Real *t) const { spherePacket(referencePoint, radius, packet, t); }
+bool Sphere::getBoundingBox(AABB &box) const
+{
+    Vector r(radius, radius, radius);
+    box = AABB(referencePoint - r, referencePoint + r);
+    box.pad(1e-4);
+    return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -625,69 +753,246 @@ Vector QuadraticSurface::getNormal(const Point &point) const
 //     // cout << "Intersection point: (" << intersect.x << ", " << intersect.y << ", " << intersect.z << ")\n";
 //     return t;
 // }
-double QuadraticSurface::intersect(const Ray &r) const
+int QuadraticSurface::classify(const double q[10])
 {
-    Point origin = r.origin;
-    Vector dir = r.direction;
-
-    double a = A * dir.x * dir.x + B * dir.y * dir.y + C * dir.z * dir.z +
-               D * dir.x * dir.y + E * dir.x * dir.z + F * dir.y * dir.z;
-
-    double b = 2 * A * origin.x * dir.x + 2 * B * origin.y * dir.y + 2 * C * origin.z * dir.z +
-               D * (origin.x * dir.y + origin.y * dir.x) +
-               E * (origin.x * dir.z + origin.z * dir.x) +
-               F * (origin.y * dir.z + origin.z * dir.y) +
-               G * dir.x + H * dir.y + I * dir.z;
-
-    double c = A * origin.x * origin.x + B * origin.y * origin.y + C * origin.z * origin.z +
-               D * origin.x * origin.y + E * origin.x * origin.z + F * origin.y * origin.z +
-               G * origin.x + H * origin.y + I * origin.z + J;
-
-    double discriminant = b * b - 4 * a * c;
-    if (discriminant < 0)
-        return -1;
-
-    double sqrt_disc = sqrt(discriminant);
-    double t1 = (-b - sqrt_disc) / (2 * a);
-    double t2 = (-b + sqrt_disc) / (2 * a);
-
-    // Try both t1 and t2 — nearest valid one wins
-    double t = -1;
-    for (double candidate : {t1, t2})
+    if (q[3] != 0 || q[4] != 0 || q[5] != 0)
+        return GENERAL;
+    for (int axis = 0; axis < 3; axis++)
+        if (q[axis] == 0 && q[6 + axis] == 0)
+            return CYLINDER_X + axis;
+    return AXIS_ALIGNED;
+}
+// Slab test of a ray against a quadric's clip box: clip holds the x, y and z [lo, hi] ranges already widened by 1e-6
+// (<= -1e299 where the axis is not clipped, which in float builds is -inf). A root only counts when it lies in
+// [tEnter, tExit], so this runs before the quadric is even loaded and rejects most rays.
+template <typename T>
+static inline bool quadricRange(const T *clip, const Ray &r, double &tEnter, double &tExit)
+{
+    double o[3] = {r.origin.x, r.origin.y, r.origin.z}, d[3] = {r.direction.x, r.direction.y, r.direction.z};
+    tEnter = 1e-6;
+    tExit = 1e300;
+    for (int axis = 0; axis < 3; axis++)
     {
-        if (candidate < 1e-6)
+        double lo = clip[2 * axis], hi = clip[2 * axis + 1];
+        if (lo <= -1e299)
             continue;
-        Point intersect = origin + dir * candidate;
+        if (fabs(d[axis]) < 1e-12)
+        {
+            if (o[axis] < lo || o[axis] > hi)
+                return false;
+            continue;
+        }
+        double t0 = (lo - o[axis]) / d[axis], t1 = (hi - o[axis]) / d[axis];
+        if (t0 > t1)
+            swap(t0, t1);
+        tEnter = max(tEnter, t0);
+        tExit = min(tExit, t1);
+        if (tEnter > tExit)
+            return false;
+    }
+    return true;
+}
+// Nearest root in [tEnter, tExit] of the quadric q (A..J) of the given QuadraticSurface::Kind, or -1
+static double quadricRoot(const double *q, int kind, const Ray &r, double tEnter, double tExit)
+{
+    double o[3] = {r.origin.x, r.origin.y, r.origin.z}, d[3] = {r.direction.x, r.direction.y, r.direction.z};
+    // a t^2 + b t + c along the ray; the specialised kinds skip the terms they know are zero
+    double A = q[0], B = q[1], C = q[2], G = q[6], H = q[7], I = q[8], J = q[9];
+    double a, b, c;
+    if (kind == QuadraticSurface::GENERAL)
+    {
+        double D = q[3], E = q[4], F = q[5];
+        a = A * d[0] * d[0] + B * d[1] * d[1] + C * d[2] * d[2] + D * d[0] * d[1] + E * d[0] * d[2] + F * d[1] * d[2];
+        b = 2 * (A * o[0] * d[0] + B * o[1] * d[1] + C * o[2] * d[2]) + D * (o[0] * d[1] + o[1] * d[0]) +
+            E * (o[0] * d[2] + o[2] * d[0]) + F * (o[1] * d[2] + o[2] * d[1]) + G * d[0] + H * d[1] + I * d[2];
+        c = A * o[0] * o[0] + B * o[1] * o[1] + C * o[2] * o[2] + D * o[0] * o[1] + E * o[0] * o[2] + F * o[1] * o[2] +
+            G * o[0] + H * o[1] + I * o[2] + J;
+    }
+    else if (kind == QuadraticSurface::AXIS_ALIGNED)
+    {
+        a = A * d[0] * d[0] + B * d[1] * d[1] + C * d[2] * d[2];
+        b = 2 * (A * o[0] * d[0] + B * o[1] * d[1] + C * o[2] * d[2]) + G * d[0] + H * d[1] + I * d[2];
+        c = (A * o[0] + G) * o[0] + (B * o[1] + H) * o[1] + (C * o[2] + I) * o[2] + J;
+    }
+    else
+    {
+        // Only the two axes other than the missing one take part
+        int u = kind == QuadraticSurface::CYLINDER_X ? 1 : 0, v = kind == QuadraticSurface::CYLINDER_Z ? 1 : 2;
+        double Qu = q[u], Qv = q[v], Lu = q[6 + u], Lv = q[6 + v];
+        a = Qu * d[u] * d[u] + Qv * d[v] * d[v];
+        b = 2 * (Qu * o[u] * d[u] + Qv * o[v] * d[v]) + Lu * d[u] + Lv * d[v];
+        c = (Qu * o[u] + Lu) * o[u] + (Qv * o[v] + Lv) * o[v] + J;
+    }
+
+    // q = -(b + sign(b) sqrt(disc)) / 2 gives both roots without subtracting nearly equal numbers
+    double t1, t2;
+    if (a == 0)
+    {
+        if (b == 0)
+            return -1;
+        t1 = t2 = -c / b; // the ray runs parallel to the surface's axis: one crossing
+    }
+    else
+    {
+        double discriminant = b * b - 4 * a * c;
+        if (discriminant < 0)
+            return -1;
+        double root = -0.5 * (b + copysign(sqrt(discriminant), b));
+        t1 = root / a;
+        t2 = root != 0 ? c / root : t1;
+    }
+    if (t1 > t2)
+        swap(t1, t2);
+    if (t1 >= tEnter && t1 <= tExit)
+        return t1;
+    if (t2 >= tEnter && t2 <= tExit)
+        return t2;
+    return -1;
+}
+static double quadricIntersect(const double *q, const double *clip, int kind, const Ray &r)
+{
+    double tEnter, tExit;
+    return quadricRange(clip, r, tEnter, tExit) ? quadricRoot(q, kind, r, tEnter, tExit) : -1;
+}
+void QuadraticSurface::getClip(double clip[6]) const
+{
+    // Bounding box check with proper min/max handling; a zero dimension leaves that axis open
+    double dims[3] = {length, width, height};
+    double ref[3] = {referencePoint.x, referencePoint.y, referencePoint.z};
+    for (int axis = 0; axis < 3; axis++)
+    {
+        clip[2 * axis] = -1e300;
+        clip[2 * axis + 1] = 1e300;
+        if (fabs(dims[axis]) > 1e-6)
+        {
+            clip[2 * axis] = std::min(ref[axis], ref[axis] + dims[axis]) - 1e-6;
+            clip[2 * axis + 1] = std::max(ref[axis], ref[axis] + dims[axis]) + 1e-6;
+        }
+    }
+}
+double QuadraticSurface::intersect(const Ray &r) const
+{
+    double q[10] = {A, B, C, D, E, F, G, H, I, J}, clip[6];
+    getClip(clip);
+    return quadricIntersect(q, clip, classify(q), r);
+}
+bool QuadraticSurface::getBoundingBox(AABB &box) const
+{
+    // A zero dimension means the surface is not clipped along that axis
+    if (fabs(length) <= 1e-6 || fabs(width) <= 1e-6 || fabs(height) <= 1e-6)
+        return false;
+    box = AABB();
+    box.expand(referencePoint);
+    box.expand(referencePoint + Vector(length, width, height));
+    box.pad(1e-4);
+    return true;
+}
 
-        // Bounding box check with proper min/max handling
-        if (fabs(length) > 1e-6)
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                               Texture                                                          //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+size_t Texture::index(const Level &level, int x, int y) const
+{
+    return (level.offset + (size_t)y * level.width + x) * TEXEL;
+}
+void Texture::clear()
+{
+    levels.clear();
+    texels.clear();
+}
+void Texture::build(const unsigned char *data, int width, int height, int channels)
+{
+    clear();
+    if (!data || width <= 0 || height <= 0 || channels <= 0)
+        return;
+    // Level sizes halve (rounding down, as OpenGL does) until 1x1
+    size_t total = 0;
+    for (int w = width, h = height;; w = max(1, w / 2), h = max(1, h / 2))
+    {
+        levels.push_back({w, h, total});
+        total += (size_t)w * h;
+        if (w == 1 && h == 1)
+            break;
+    }
+    texels.assign(total * TEXEL, 0);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
         {
-            double x_min = std::min(referencePoint.x, referencePoint.x + length);
-            double x_max = std::max(referencePoint.x, referencePoint.x + length);
-            if (intersect.x < x_min - 1e-6 || intersect.x > x_max + 1e-6)
-                continue;
+            const unsigned char *p = data + ((size_t)y * width + x) * channels;
+            unsigned char *t = &texels[index(levels[0], x, y)];
+            for (int k = 0; k < 3; k++)
+                t[k] = p[channels >= 3 ? k : 0];
         }
-        if (fabs(width) > 1e-6)
+    }
+    // Box filter: each texel averages the 2x2 block under it, clamped at the edge of odd-sized levels
+    for (size_t l = 1; l < levels.size(); l++)
+    {
+        const Level &src = levels[l - 1], &dst = levels[l];
+        for (int y = 0; y < dst.height; y++)
         {
-            double y_min = std::min(referencePoint.y, referencePoint.y + width);
-            double y_max = std::max(referencePoint.y, referencePoint.y + width);
-            if (intersect.y < y_min - 1e-6 || intersect.y > y_max + 1e-6)
-                continue;
+            int y0 = min(2 * y, src.height - 1), y1 = min(2 * y + 1, src.height - 1);
+            for (int x = 0; x < dst.width; x++)
+            {
+                int x0 = min(2 * x, src.width - 1), x1 = min(2 * x + 1, src.width - 1);
+                const unsigned char *a = &texels[index(src, x0, y0)], *b = &texels[index(src, x1, y0)];
+                const unsigned char *c = &texels[index(src, x0, y1)], *d = &texels[index(src, x1, y1)];
+                unsigned char *t = &texels[index(dst, x, y)];
+                for (int k = 0; k < 3; k++)
+                    t[k] = (a[k] + b[k] + c[k] + d[k] + 2) / 4;
+            }
         }
-        if (fabs(height) > 1e-6)
+    }
+}
+Color Texture::texel(int level, int x, int y) const
+{
+    const Level &l = levels[level];
+    const unsigned char *t = &texels[index(l, clamp(x, 0, l.width - 1), clamp(y, 0, l.height - 1))];
+    return Color(t[0] / 255.0, t[1] / 255.0, t[2] / 255.0);
+}
+Color Texture::bilinear(int level, double u, double v) const
+{
+    const Level &l = levels[level];
+    double x = clamp(u, 0.0, 1.0) * l.width - 0.5, y = (1.0 - clamp(v, 0.0, 1.0)) * l.height - 0.5;
+    int x0 = (int)(x + 1) - 1, y0 = (int)(y + 1) - 1; // floor, since x and y are at least -0.5
+    double fx = x - x0, fy = y - y0;
+    int x1 = min(x0 + 1, l.width - 1), y1 = min(y0 + 1, l.height - 1);
+    x0 = max(x0, 0);
+    y0 = max(y0, 0);
+    const unsigned char *a = &texels[index(l, x0, y0)], *b = &texels[index(l, x1, y0)];
+    const unsigned char *c = &texels[index(l, x0, y1)], *d = &texels[index(l, x1, y1)];
+    // The weights carry the 1/255, so each channel is four multiply-adds
+    double wa = (1 - fx) * (1 - fy) / 255.0, wb = fx * (1 - fy) / 255.0, wc = (1 - fx) * fy / 255.0, wd = fx * fy / 255.0;
+    auto channel = [&](int k) { return a[k] * wa + b[k] * wb + c[k] * wc + d[k] * wd; };
+    return Color(channel(0), channel(1), channel(2));
+}
+Color Texture::sample(double u, double v, double footprint) const
+{
+    if (empty())
+        return Color(0.5, 0.5, 0.5);
+    // The level whose texels are as wide as the footprint, blended with the next one down
+    double lod = log2(max(footprint * max(levels[0].width, levels[0].height), 1.0));
+    int last = (int)levels.size() - 1;
+    if (lod >= last)
+        return bilinear(last, u, v);
+    int level = (int)lod;
+    double blend = lod - level;
+    if (blend < 1e-3)
+        return bilinear(level, u, v);
+    return bilinear(level, u, v) * (1 - blend) + bilinear(level + 1, u, v) * blend;
+}
+void Texture::levelRGB(int level, vector<unsigned char> &rgb) const
+{
+    const Level &l = levels[level];
+    rgb.resize((size_t)l.width * l.height * 3);
+    for (int y = 0; y < l.height; y++)
+    {
+        for (int x = 0; x < l.width; x++)
         {
-            double z_min = std::min(referencePoint.z, referencePoint.z + height);
-            double z_max = std::max(referencePoint.z, referencePoint.z + height);
-            if (intersect.z < z_min - 1e-6 || intersect.z > z_max + 1e-6)
-                continue;
+            const unsigned char *t = &texels[index(l, x, y)];
+            copy(t, t + 3, &rgb[((size_t)y * l.width + x) * 3]);
         }
-
-        // Valid t found
-        if (t < 0 || candidate < t)
-            t = candidate;
     }
-
-    return t;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -732,46 +1037,69 @@ void Floor::setGLTextureID(GLuint id) { glTextureID = id; }
 // }
 void Floor::draw() const
 {
-    int halfGrid = floorWidth / 2;
-    double tileSize = tileWidth;
-
-    for (int i = -halfGrid; i < halfGrid; i++)
+    // Built once: a 4x4 grid of large quads with texture coordinates in tile units, so GL_REPEAT lays out the tiles
+    if (!previewMesh.ready())
     {
-        for (int j = -halfGrid; j < halfGrid; j++)
+        const int pieces = 4;
+        double extent = floorWidth / 2 * tileWidth, step = 2 * extent / pieces;
+        previewMesh.mode = GL_QUADS;
+        for (int i = 0; i < pieces; i++)
         {
-            bool isBlack = (i + j) % 2 == 0;
-            if (useTexture && glTextureID != 0)
+            for (int j = 0; j < pieces; j++)
             {
-                glEnable(GL_TEXTURE_2D);
-                glBindTexture(GL_TEXTURE_2D, glTextureID);
-                glColor3f(1, 1, 1);
+                double x0 = -extent + i * step, y0 = -extent + j * step;
+                double corners[4][2] = {{x0, y0}, {x0 + step, y0}, {x0 + step, y0 + step}, {x0, y0 + step}};
+                for (auto &c : corners)
+                {
+                    previewMesh.vertices.insert(previewMesh.vertices.end(), {(GLfloat)c[0], (GLfloat)c[1], 0.0f});
+                    previewMesh.texCoords.insert(previewMesh.texCoords.end(), {(GLfloat)(c[0] / tileWidth), (GLfloat)(c[1] / tileWidth)});
+                }
             }
-            else
-            {
-                glDisable(GL_TEXTURE_2D);
-                if (isBlack)
-                    glColor3f(0, 0, 0);
-                else
-                    glColor3f(1, 1, 1);
-            }
-            glBegin(GL_QUADS);
-            if (useTexture && glTextureID != 0)
-                glTexCoord2f(0, 0);
-            glVertex3f(i * tileSize, j * tileSize, 0);
-            if (useTexture && glTextureID != 0)
-                glTexCoord2f(1, 0);
-            glVertex3f((i + 1) * tileSize, j * tileSize, 0);
-            if (useTexture && glTextureID != 0)
-                glTexCoord2f(1, 1);
-            glVertex3f((i + 1) * tileSize, (j + 1) * tileSize, 0);
-            if (useTexture && glTextureID != 0)
-                glTexCoord2f(0, 1);
-            glVertex3f(i * tileSize, (j + 1) * tileSize, 0);
-            glEnd();
         }
+        previewMesh.upload();
+    }
+    if (checkerTextureID == 0)
+    {
+        // Texel (0,0) black like tile (0,0); mipmaps fade distant tiles to grey instead of aliasing
+        const unsigned char checker[12] = {0, 0, 0, 255, 255, 255, 255, 255, 255, 0, 0, 0};
+        glGenTextures(1, &checkerTextureID);
+        glBindTexture(GL_TEXTURE_2D, checkerTextureID);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        gluBuild2DMipmaps(GL_TEXTURE_2D, GL_RGB, 2, 2, GL_RGB, GL_UNSIGNED_BYTE, checker);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     }
+    bool textured = useTexture && glTextureID != 0;
+    glEnable(GL_TEXTURE_2D);
+    glColor3f(1, 1, 1);
+    glBindTexture(GL_TEXTURE_2D, textured ? glTextureID : checkerTextureID);
+    if (!textured)
+    {
+        // The checker texture spans two tiles
+        glMatrixMode(GL_TEXTURE);
+        glPushMatrix();
+        glLoadIdentity();
+        glScalef(0.5f, 0.5f, 1.0f);
+        glMatrixMode(GL_MODELVIEW);
+    }
+    previewMesh.draw();
+    if (!textured)
+    {
+        glMatrixMode(GL_TEXTURE);
+        glPopMatrix();
+        glMatrixMode(GL_MODELVIEW);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
     glDisable(GL_TEXTURE_2D); // Always disable after drawing
 }
+Floor::~Floor()
+{
+    previewMesh.release();
+    if (checkerTextureID != 0)
+        glDeleteTextures(1, &checkerTextureID);
+}
 double Floor::intersect(const Ray &r) const
 {
     double t = plane.intersect(r);
@@ -785,6 +1113,24 @@ double Floor::intersect(const Ray &r) const
     // cout << "Intersection point: (" << intersection.x << ", " << intersection.y << ", " << intersection.z << ")\n";
     return t;
 }
+void Floor::intersectPacket(const RayPacket &packet, Real *t) const
+{
+    SimdReal nx(plane.normal.x), ny(plane.normal.y), nz(plane.normal.z);
+    SimdReal px(plane.point.x), py(plane.point.y), pz(plane.point.z);
+    SimdReal eps(1e-6), zero(0.0), none(-1.0);
+    SimdReal xMin(referencePoint.x - 1e-6), xMax(referencePoint.x + floorWidth + 1e-6);
+    SimdReal yMin(referencePoint.y - 1e-6), yMax(referencePoint.y + floorWidth + 1e-6);
+    for (int i = 0; i < packet.lanes; i += SimdReal::WIDTH)
+    {
+        SimdReal dx = SimdReal::load(packet.dx + i), dy = SimdReal::load(packet.dy + i), dz = SimdReal::load(packet.dz + i);
+        SimdReal ox = SimdReal::load(packet.ox + i), oy = SimdReal::load(packet.oy + i), oz = SimdReal::load(packet.oz + i);
+        SimdReal denom = nx * dx + ny * dy + nz * dz;
+        SimdReal hitT = (zero - (nx * (ox - px) + ny * (oy - py) + nz * (oz - pz))) / denom;
+        SimdReal hx = ox + dx * hitT, hy = oy + dy * hitT;
+        SimdRealMask valid = (abs(denom) >= eps) & (hitT >= eps) & (hx >= xMin) & (hx <= xMax) & (hy >= yMin) & (hy <= yMax);
+        select(valid, hitT, none).store(t + i);
+    }
+}
 Color Floor::getColor(const Point &p) const
 {
     if (!useTexture)
@@ -799,20 +1145,23 @@ Color Floor::getColor(const Point &p) const
             return Color(1.0, 1.0, 1.0);
     }
     else
-    {
-        int i = static_cast<int>((p.x - referencePoint.x) / tileWidth);
-        int j = static_cast<int>((p.y - referencePoint.y) / tileWidth);
-        double u = fmod(p.x - referencePoint.x, tileWidth) / tileWidth;
-        double v = fmod(p.y - referencePoint.y, tileWidth) / tileWidth;
-        u = clamp(u, 0.0, 1.0);
-        v = clamp(v, 0.0, 1.0);
-        return sampleTexture(u, v);
-    }
+        return colorAt(p, 0.0);
 }
-void Floor::loadTexture(const string &path)
+Color Floor::colorAt(const Point &p, double footprint) const
 {
-    textureData = stbi_load(path.c_str(), &textureWidth, &textureHeight, &textureChannels, 0);
-    if (!textureData)
+    if (!useTexture)
+        return getColor(p);
+    // Every tile shows the whole texture
+    double u = fmod(p.x - referencePoint.x, tileWidth) / tileWidth;
+    double v = fmod(p.y - referencePoint.y, tileWidth) / tileWidth;
+    u = clamp(u, 0.0, 1.0);
+    v = clamp(v, 0.0, 1.0);
+    return sampleTexture(u, v, footprint / tileWidth);
+}
+void Floor::loadTexture(const string &path)
+{
+    textureData = stbi_load(path.c_str(), &textureWidth, &textureHeight, &textureChannels, 0);
+    if (!textureData)
     {
         cerr << "Failed to load texture: " << path << endl;
         useTexture = false;
@@ -820,28 +1169,13 @@ void Floor::loadTexture(const string &path)
     else
     {
         useTexture = true;
+        texture.build(textureData, textureWidth, textureHeight, textureChannels);
         cout << "Loaded texture: " << path << " (" << textureWidth << "x" << textureHeight << ")\n";
     }
 }
-Color Floor::sampleTexture(double u, double v) const
+Color Floor::sampleTexture(double u, double v, double footprint) const
 {
-    if (!textureData || textureWidth <= 0 || textureHeight <= 0)
-        return Color(0.5, 0.5, 0.5);
-    u = clamp(u, 0.0, 1.0);
-    v = clamp(v, 0.0, 1.0);
-    int pixel_x = static_cast<int>(u * (textureWidth - 1));
-    int pixel_y = static_cast<int>((1.0 - v) * (textureHeight - 1));
-    pixel_x = clamp(pixel_x, 0, textureWidth - 1);
-    pixel_y = clamp(pixel_y, 0, textureHeight - 1);
-    int index = (pixel_y * textureWidth + pixel_x) * textureChannels;
-    int max_index = textureWidth * textureHeight * textureChannels;
-    if (index < 0 || index + 2 >= max_index)
-        return Color(1.0, 0.0, 1.0);
-    Color c;
-    c.r = textureData[index] / 255.0;
-    c.g = textureChannels >= 2 ? textureData[index + 1] / 255.0 : c.r;
-    c.b = textureChannels >= 3 ? textureData[index + 2] / 255.0 : c.r;
-    return c;
+    return texture.sample(u, v, footprint);
 }
 // void Floor::setTexture(unsigned char *data, int width, int height, int channels)
 // {
@@ -858,14 +1192,27 @@ void Floor::setTexture(unsigned char *data, int width, int height, int channels)
     textureHeight = height;
     textureChannels = channels;
     useTexture = false;
+    texture.build(data, width, height, channels);
+}
+void Floor::uploadTexture()
+{
+    if (!textureData || textureWidth <= 0 || textureHeight <= 0)
+        return;
     if (glTextureID == 0)
     {
         glGenTextures(1, &glTextureID);
     }
     glBindTexture(GL_TEXTURE_2D, glTextureID);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0,
-                 GL_RGB, GL_UNSIGNED_BYTE, data);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // rows of odd-sized levels are not 4-byte aligned
+    // The preview uses the same pyramid as the ray tracer
+    vector<unsigned char> rgb;
+    for (int level = 0; level < (int)texture.levels.size(); level++)
+    {
+        texture.levelRGB(level, rgb);
+        glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, texture.levels[level].width, texture.levels[level].height, 0,
+                     GL_RGB, GL_UNSIGNED_BYTE, rgb.data());
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
@@ -876,6 +1223,68 @@ void Floor::setTexture(unsigned char *data, int width, int height, int channels)
 //                                                  Ray                                                           //
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                               RayPacket                                                        //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void RayPacket::clear() { size = lanes = 0; }
+void RayPacket::add(const Ray &r, int id)
+{
+    ox[size] = r.origin.x;
+    oy[size] = r.origin.y;
+    oz[size] = r.origin.z;
+    dx[size] = r.direction.x;
+    dy[size] = r.direction.y;
+    dz[size] = r.direction.z;
+    this->id[size] = id;
+    size++;
+}
+void RayPacket::finalize()
+{
+    lanes = (size + SimdReal::WIDTH - 1) / SimdReal::WIDTH * SimdReal::WIDTH;
+    for (int i = size; i < lanes; i++)
+    {
+        ox[i] = ox[0], oy[i] = oy[0], oz[i] = oz[0];
+        dx[i] = dx[0], dy[i] = dy[0], dz[i] = dz[0];
+        id[i] = -1;
+    }
+    for (int i = 0; i < lanes; i++)
+    {
+        ix[i] = 1.0 / (fabs(dx[i]) > 1e-12 ? dx[i] : copysign(1e-12, dx[i]));
+        iy[i] = 1.0 / (fabs(dy[i]) > 1e-12 ? dy[i] : copysign(1e-12, dy[i]));
+        iz[i] = 1.0 / (fabs(dz[i]) > 1e-12 ? dz[i] : copysign(1e-12, dz[i]));
+        tMin[i] = 1e9;
+        hit[i] = nullptr;
+        hitId[i] = -1;
+    }
+}
+int RayPacket::octant(int lane) const { return (dx[lane] < 0) | (dy[lane] < 0) << 1 | (dz[lane] < 0) << 2; }
+bool RayPacket::coherent() const
+{
+    for (int i = 1; i < size; i++)
+        if (octant(i) != octant(0))
+            return false;
+    return true;
+}
+int RayPacket::split(RayPacket parts[8]) const
+{
+    int slot[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+    int count = 0;
+    for (int i = 0; i < size; i++)
+    {
+        int o = octant(i);
+        if (slot[o] == -1)
+        {
+            slot[o] = count++;
+            parts[slot[o]].clear();
+        }
+        parts[slot[o]].add(ray(i), id[i]);
+    }
+    for (int i = 0; i < count; i++)
+        parts[i].finalize();
+    return count;
+}
+Ray RayPacket::ray(int lane) const { return Ray(Point(ox[lane], oy[lane], oz[lane]), Vector(dx[lane], dy[lane], dz[lane])); }
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //                                                Light                                                           //
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -888,7 +1297,8 @@ void PointLight::draw() const
     glColor3f(1.0, 1.0, 1.0);
     glPushMatrix();
     glTranslatef(position.x, position.y, position.z);
-    glutSolidSphere(0.4, 50, 50);
+    glScalef(0.4f, 0.4f, 0.4f);
+    PreviewMesh::unitSphere().draw();
     glPopMatrix();
 }
 void PointLight::print() const
@@ -908,7 +1318,8 @@ void SpotLight::draw() const
     glColor3f(1.0, 1.0, 1.0);
     glPushMatrix();
     glTranslatef(position.x, position.y, position.z);
-    glutSolidSphere(0.2, 50, 50);
+    glScalef(0.2f, 0.2f, 0.2f);
+    PreviewMesh::unitSphere().draw();
     glPopMatrix();
 }
 void SpotLight::print() const
@@ -923,6 +1334,2650 @@ void SpotLight::print() const
     color.print();
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                  AABB                                                          //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void AABB::expand(const Point &p)
+{
+    minPoint.x = min(minPoint.x, p.x);
+    minPoint.y = min(minPoint.y, p.y);
+    minPoint.z = min(minPoint.z, p.z);
+    maxPoint.x = max(maxPoint.x, p.x);
+    maxPoint.y = max(maxPoint.y, p.y);
+    maxPoint.z = max(maxPoint.z, p.z);
+}
+void AABB::expand(const AABB &b)
+{
+    expand(b.minPoint);
+    expand(b.maxPoint);
+}
+void AABB::pad(double d)
+{
+    minPoint -= Vector(d, d, d);
+    maxPoint += Vector(d, d, d);
+}
+Point AABB::centroid() const
+{
+    return Point((minPoint.x + maxPoint.x) / 2.0, (minPoint.y + maxPoint.y) / 2.0, (minPoint.z + maxPoint.z) / 2.0);
+}
+double AABB::extent(int axis) const
+{
+    if (axis == 0)
+        return maxPoint.x - minPoint.x;
+    if (axis == 1)
+        return maxPoint.y - minPoint.y;
+    return maxPoint.z - minPoint.z;
+}
+double AABB::surfaceArea() const
+{
+    double dx = extent(0), dy = extent(1), dz = extent(2);
+    if (dx < 0 || dy < 0 || dz < 0)
+        return 0.0;
+    return 2.0 * (dx * dy + dy * dz + dz * dx);
+}
+bool AABB::intersect(const Point &origin, const Vector &invDir, double tMax) const
+{
+    // Slab test, clipped to [0, tMax]
+    double t0 = 0.0, t1 = tMax;
+    double tNear = (minPoint.x - origin.x) * invDir.x, tFar = (maxPoint.x - origin.x) * invDir.x;
+    if (tNear > tFar)
+        swap(tNear, tFar);
+    t0 = max(t0, tNear);
+    t1 = min(t1, tFar);
+    if (t0 > t1)
+        return false;
+    tNear = (minPoint.y - origin.y) * invDir.y, tFar = (maxPoint.y - origin.y) * invDir.y;
+    if (tNear > tFar)
+        swap(tNear, tFar);
+    t0 = max(t0, tNear);
+    t1 = min(t1, tFar);
+    if (t0 > t1)
+        return false;
+    tNear = (minPoint.z - origin.z) * invDir.z, tFar = (maxPoint.z - origin.z) * invDir.z;
+    if (tNear > tFar)
+        swap(tNear, tFar);
+    t0 = max(t0, tNear);
+    t1 = min(t1, tFar);
+    return t0 <= t1;
+}
+bool AABB::overlaps(const AABB &b) const
+{
+    return minPoint.x <= b.maxPoint.x && b.minPoint.x <= maxPoint.x && minPoint.y <= b.maxPoint.y &&
+           b.minPoint.y <= maxPoint.y && minPoint.z <= b.maxPoint.z && b.minPoint.z <= maxPoint.z;
+}
+bool AABB::contains(const AABB &b) const
+{
+    return minPoint.x <= b.minPoint.x && minPoint.y <= b.minPoint.y && minPoint.z <= b.minPoint.z &&
+           b.maxPoint.x <= maxPoint.x && b.maxPoint.y <= maxPoint.y && b.maxPoint.z <= maxPoint.z;
+}
+// Liang-Barsky: the part of the segment from -> to inside the box
+bool AABB::clip(const Point &from, const Point &to, Point &clippedFrom, Point &clippedTo) const
+{
+    double t0 = 0.0, t1 = 1.0;
+    double o[3] = {from.x, from.y, from.z}, d[3] = {to.x - from.x, to.y - from.y, to.z - from.z};
+    double lo[3] = {minPoint.x, minPoint.y, minPoint.z}, hi[3] = {maxPoint.x, maxPoint.y, maxPoint.z};
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (d[axis] == 0)
+        {
+            if (o[axis] < lo[axis] || o[axis] > hi[axis])
+                return false;
+            continue;
+        }
+        double a = (lo[axis] - o[axis]) / d[axis], b = (hi[axis] - o[axis]) / d[axis];
+        t0 = max(t0, min(a, b));
+        t1 = min(t1, max(a, b));
+        if (t0 > t1)
+            return false;
+    }
+    Vector direction = to - from;
+    clippedFrom = from + direction * t0;
+    clippedTo = from + direction * t1;
+    return true;
+}
+void AABB::print() const
+{
+    cout << "AABB: \n";
+    minPoint.print();
+    maxPoint.print();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                             CompiledScene                                                      //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void CompiledScene::clear()
+{
+    for (vector<Real> *v : {&sphereX, &sphereY, &sphereZ, &sphereRadius, &triangleX, &triangleY, &triangleZ,
+                              &edge1X, &edge1Y, &edge1Z, &edge2X, &edge2Y, &edge2Z})
+        v->clear();
+    for (vector<Real> &v : quadricCoefficients)
+        v.clear();
+    for (vector<Real> &v : quadricClip)
+        v.clear();
+    quadricKinds.clear();
+    otherObjects.clear();
+    for (vector<int> &v : materialIds)
+        v.clear();
+    materials.clear();
+    materialLookup.clear();
+    sources.clear();
+    for (int type = 0; type < TYPE_COUNT; type++)
+        base[type] = 0;
+}
+void CompiledScene::reserve(const int counts[TYPE_COUNT])
+{
+    int total = 0;
+    for (int type = 0; type < TYPE_COUNT; type++)
+    {
+        base[type] = total;
+        total += counts[type];
+        materialIds[type].reserve(counts[type]);
+    }
+    sources.assign(total, nullptr);
+    for (vector<Real> *v : {&sphereX, &sphereY, &sphereZ, &sphereRadius})
+        v->reserve(counts[SPHERE]);
+    for (vector<Real> *v : {&triangleX, &triangleY, &triangleZ, &edge1X, &edge1Y, &edge1Z, &edge2X, &edge2Y, &edge2Z})
+        v->reserve(counts[TRIANGLE]);
+    for (vector<Real> &v : quadricCoefficients)
+        v.reserve(counts[QUADRIC]);
+    for (vector<Real> &v : quadricClip)
+        v.reserve(counts[QUADRIC]);
+    quadricKinds.reserve(counts[QUADRIC]);
+    otherObjects.reserve(counts[OBJECT]);
+}
+void CompiledScene::classifyQuadrics()
+{
+    quadricKinds.clear();
+    for (int i = 0; i < count(QUADRIC); i++)
+    {
+        double q[10];
+        for (int k = 0; k < 10; k++)
+            q[k] = quadricCoefficients[k][i];
+        quadricKinds.push_back(QuadraticSurface::classify(q));
+    }
+}
+int CompiledScene::typeOf(const Object *o)
+{
+    if (dynamic_cast<const Sphere *>(o))
+        return SPHERE;
+    if (dynamic_cast<const Triangle *>(o))
+        return TRIANGLE;
+    if (dynamic_cast<const QuadraticSurface *>(o))
+        return QUADRIC;
+    return OBJECT;
+}
+int CompiledScene::count(int type) const { return materialIds[type].size(); }
+int CompiledScene::materialOf(int id) const
+{
+    for (int type = TYPE_COUNT - 1; type >= 0; type--)
+        if (id >= base[type])
+            return materialIds[type][id - base[type]];
+    return -1;
+}
+int CompiledScene::add(Object *o, int type)
+{
+    int index = count(type);
+    if (type == SPHERE)
+    {
+        const Sphere *s = static_cast<const Sphere *>(o);
+        sphereX.push_back(s->referencePoint.x);
+        sphereY.push_back(s->referencePoint.y);
+        sphereZ.push_back(s->referencePoint.z);
+        sphereRadius.push_back(s->radius);
+    }
+    else if (type == TRIANGLE)
+    {
+        const Triangle *t = static_cast<const Triangle *>(o);
+        triangleX.push_back(t->p1.x);
+        triangleY.push_back(t->p1.y);
+        triangleZ.push_back(t->p1.z);
+        edge1X.push_back(t->edge1.x);
+        edge1Y.push_back(t->edge1.y);
+        edge1Z.push_back(t->edge1.z);
+        edge2X.push_back(t->edge2.x);
+        edge2Y.push_back(t->edge2.y);
+        edge2Z.push_back(t->edge2.z);
+    }
+    else if (type == QUADRIC)
+    {
+        const QuadraticSurface *q = static_cast<const QuadraticSurface *>(o);
+        double coefficients[10] = {q->A, q->B, q->C, q->D, q->E, q->F, q->G, q->H, q->I, q->J}, clip[6];
+        q->getClip(clip);
+        for (int k = 0; k < 10; k++)
+            quadricCoefficients[k].push_back(coefficients[k]);
+        for (int k = 0; k < 6; k++)
+            quadricClip[k].push_back(clip[k]);
+        quadricKinds.push_back(QuadraticSurface::classify(coefficients));
+    }
+    else
+        otherObjects.push_back(o);
+
+    vector<double> key = {o->color.r, o->color.g, o->color.b, o->ambient, o->diffuse, o->specular,
+                          o->reflectionCoefficient, (double)o->shine};
+    auto found = materialLookup.find(key);
+    if (found == materialLookup.end())
+    {
+        Material m;
+        m.color = o->color;
+        m.ambient = o->ambient;
+        m.diffuse = o->diffuse;
+        m.specular = o->specular;
+        m.reflectionCoefficient = o->reflectionCoefficient;
+        m.shine = o->shine;
+        found = materialLookup.insert({key, (int)materials.size()}).first;
+        materials.push_back(m);
+    }
+    materialIds[type].push_back(found->second);
+    sources[base[type] + index] = o;
+    return index;
+}
+double CompiledScene::primitiveT(int type, int i, const Ray &r) const
+{
+    if (type == SPHERE)
+        return sphereIntersect(Point(sphereX[i], sphereY[i], sphereZ[i]), sphereRadius[i], r);
+    if (type == TRIANGLE)
+        return triangleIntersect(Point(triangleX[i], triangleY[i], triangleZ[i]), Vector(edge1X[i], edge1Y[i], edge1Z[i]),
+                                 Vector(edge2X[i], edge2Y[i], edge2Z[i]), r);
+    if (type == QUADRIC)
+    {
+        // The clip box first: the ten coefficients are only gathered for rays that pass it
+        Real clip[6];
+        for (int k = 0; k < 6; k++)
+            clip[k] = quadricClip[k][i];
+        double tEnter, tExit, q[10];
+        if (!quadricRange(clip, r, tEnter, tExit))
+            return -1;
+        for (int k = 0; k < 10; k++)
+            q[k] = quadricCoefficients[k][i];
+        return quadricRoot(q, quadricKinds[i], r, tEnter, tExit);
+    }
+    return otherObjects[i]->intersect(r);
+}
+void CompiledScene::intersectSpheres(const Ray &r, int first, int count, Hit &hit) const
+{
+    RT_COUNT(tests[SPHERE], count);
+    for (int i = first; i < first + count; i++)
+    {
+        double t = sphereIntersect(Point(sphereX[i], sphereY[i], sphereZ[i]), sphereRadius[i], r);
+        if (t > 0 && t < hit.t)
+            hit = Hit(t, base[SPHERE] + i);
+    }
+}
+void CompiledScene::intersectTriangles(const Ray &r, int first, int count, Hit &hit) const
+{
+    RT_COUNT(tests[TRIANGLE], count);
+    for (int i = first; i < first + count; i++)
+    {
+        double t = triangleIntersect(Point(triangleX[i], triangleY[i], triangleZ[i]), Vector(edge1X[i], edge1Y[i], edge1Z[i]),
+                                     Vector(edge2X[i], edge2Y[i], edge2Z[i]), r);
+        if (t > 0 && t < hit.t)
+            hit = Hit(t, base[TRIANGLE] + i);
+    }
+}
+void CompiledScene::intersectQuadrics(const Ray &r, int first, int count, Hit &hit) const
+{
+    RT_COUNT(tests[QUADRIC], count);
+    for (int i = first; i < first + count; i++)
+    {
+        double t = primitiveT(QUADRIC, i, r);
+        if (t > 0 && t < hit.t)
+            hit = Hit(t, base[QUADRIC] + i);
+    }
+}
+void CompiledScene::intersectObjects(const Ray &r, int first, int count, Hit &hit) const
+{
+    RT_COUNT(tests[OBJECT], count);
+    for (int i = first; i < first + count; i++)
+    {
+        double t = otherObjects[i]->intersect(r);
+        if (t > 0 && t < hit.t)
+            hit = Hit(t, base[OBJECT] + i);
+    }
+}
+void CompiledScene::intersect(int type, const Ray &r, int first, int count, Hit &hit) const
+{
+    if (type == SPHERE)
+        intersectSpheres(r, first, count, hit);
+    else if (type == TRIANGLE)
+        intersectTriangles(r, first, count, hit);
+    else if (type == QUADRIC)
+        intersectQuadrics(r, first, count, hit);
+    else
+        intersectObjects(r, first, count, hit);
+}
+int CompiledScene::anyHit(int type, const Ray &r, int first, int count, double tMax, double epsilon) const
+{
+    for (int i = first; i < first + count; i++)
+    {
+        bool blocked;
+        if (type == OBJECT)
+            blocked = otherObjects[i]->occludes(r, tMax, epsilon); // meshes stop at their first blocking triangle
+        else
+        {
+            double t = primitiveT(type, i, r);
+            blocked = t > epsilon && t + epsilon < tMax;
+        }
+        if (blocked)
+        {
+            RT_COUNT(tests[type], i - first + 1);
+            return base[type] + i;
+        }
+    }
+    RT_COUNT(tests[type], count);
+    return -1;
+}
+bool CompiledScene::occludes(int id, const Ray &r, double tMax, double epsilon) const
+{
+    for (int type = TYPE_COUNT - 1; type >= 0; type--)
+        if (id >= base[type])
+            return anyHit(type, r, id - base[type], 1, tMax, epsilon) >= 0;
+    return false;
+}
+void CompiledScene::intersectPacket(int type, RayPacket &packet, int first, int count) const
+{
+    alignas(32) Real t[RayPacket::MAX_SIZE];
+    RT_COUNT(tests[type], (long long)count * packet.size);
+    for (int i = first; i < first + count; i++)
+    {
+        if (type == SPHERE)
+            spherePacket(Point(sphereX[i], sphereY[i], sphereZ[i]), sphereRadius[i], packet, t);
+        else if (type == TRIANGLE)
+            trianglePacket(Point(triangleX[i], triangleY[i], triangleZ[i]), Vector(edge1X[i], edge1Y[i], edge1Z[i]),
+                           Vector(edge2X[i], edge2Y[i], edge2Z[i]), packet, t);
+        else if (type == OBJECT)
+            otherObjects[i]->intersectPacket(packet, t);
+        else
+        {
+            for (int lane = 0; lane < packet.size; lane++)
+                t[lane] = primitiveT(type, i, packet.ray(lane));
+            for (int lane = packet.size; lane < packet.lanes; lane++)
+                t[lane] = t[0];
+        }
+        int id = base[type] + i;
+        for (int lane = 0; lane < packet.lanes; lane++)
+        {
+            if (t[lane] > 0 && t[lane] < packet.tMin[lane])
+            {
+                packet.tMin[lane] = t[lane];
+                packet.hitId[lane] = id;
+                packet.hit[lane] = sources[id];
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                  BVH                                                           //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+static const int BVH_BINS = 16;
+static const int BVH_MAX_LEAF = 4;
+static const int BVH_MAX_DEPTH = 64;
+
+static double axisOf(const Point &p, int axis) { return axis == 0 ? p.x : (axis == 1 ? p.y : p.z); }
+static double axisOf(const Vector &v, int axis) { return axis == 0 ? v.x : (axis == 1 ? v.y : v.z); }
+static Vector inverseDirection(const Vector &d)
+{
+    // Keep the slab test free of 0 * inf
+    return Vector(1.0 / (fabs(d.x) > 1e-12 ? d.x : copysign(1e-12, d.x)),
+                  1.0 / (fabs(d.y) > 1e-12 ? d.y : copysign(1e-12, d.y)),
+                  1.0 / (fabs(d.z) > 1e-12 ? d.z : copysign(1e-12, d.z)));
+}
+
+void BVH::clear()
+{
+    nodes.clear();
+    scene.clear();
+    for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+        unboundedFirst[type] = unboundedSize[type] = 0;
+    buildTime = 0.0;
+}
+int BVH::nodeCount() const { return nodes.size(); }
+int BVH::unboundedCount() const
+{
+    int n = 0;
+    for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+        n += unboundedSize[type];
+    return n;
+}
+void BVH::build(const vector<Object *> &objects)
+{
+    auto start = chrono::steady_clock::now();
+    clear();
+    vector<AABB> boxes;
+    vector<Point> centroids;
+    vector<Object *> bounded, open;
+    int counts[CompiledScene::TYPE_COUNT] = {0, 0, 0, 0};
+    for (Object *o : objects)
+    {
+        counts[CompiledScene::typeOf(o)]++;
+        AABB box;
+        if (!o->getBoundingBox(box))
+        {
+            open.push_back(o);
+            continue;
+        }
+        bounded.push_back(o);
+        boxes.push_back(box);
+        centroids.push_back(box.centroid());
+    }
+    scene.reserve(counts);
+    if (!bounded.empty())
+    {
+        vector<int> order(bounded.size());
+        for (int i = 0; i < (int)order.size(); i++)
+            order[i] = i;
+        nodes.reserve(2 * bounded.size());
+        buildNode(order, 0, order.size(), boxes, centroids, bounded, 0);
+    }
+    for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+        unboundedFirst[type] = scene.count(type);
+    for (Object *o : open)
+        scene.add(o, CompiledScene::typeOf(o));
+    for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+        unboundedSize[type] = scene.count(type) - unboundedFirst[type];
+    auto end = chrono::steady_clock::now();
+    buildTime = chrono::duration<double, milli>(end - start).count();
+}
+int BVH::makeLeaf(int index, vector<int> &order, int begin, int end, const vector<Object *> &bounded)
+{
+    // Group the leaf by type so each type is one contiguous run in its compiled arrays
+    stable_sort(order.begin() + begin, order.begin() + end, [&](int a, int b)
+                { return CompiledScene::typeOf(bounded[a]) < CompiledScene::typeOf(bounded[b]); });
+    BVHNode &node = nodes[index];
+    node.count = end - begin;
+    for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+        node.first[type] = scene.count(type);
+    for (int i = begin; i < end; i++)
+    {
+        int type = CompiledScene::typeOf(bounded[order[i]]);
+        scene.add(bounded[order[i]], type);
+        node.size[type]++;
+    }
+    return index;
+}
+// Binned SAH split of order[begin, end): returns the split position (axis in splitAxis), or -1 when a leaf is cheaper.
+// cost(split) = 1 + (A_left * N_left + A_right * N_right) / A_node, cost(leaf) = N
+static int splitSAH(vector<int> &order, int begin, int end, const vector<AABB> &boxes, const vector<Point> &centroids,
+                    const AABB &box, const AABB &centroidBox, int depth, int maxLeaf, int &splitAxis)
+{
+    int count = end - begin;
+    int bestAxis = -1, bestSplit = -1;
+    double bestCost = 1e30;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double lo = axisOf(centroidBox.minPoint, axis), extent = centroidBox.extent(axis);
+        if (extent <= 1e-12)
+            continue;
+        AABB binBoxes[BVH_BINS];
+        int binCounts[BVH_BINS] = {0};
+        for (int i = begin; i < end; i++)
+        {
+            int b = min(BVH_BINS - 1, (int)(BVH_BINS * (axisOf(centroids[order[i]], axis) - lo) / extent));
+            binCounts[b]++;
+            binBoxes[b].expand(boxes[order[i]]);
+        }
+        double rightArea[BVH_BINS];
+        int rightCount[BVH_BINS];
+        AABB acc;
+        int n = 0;
+        for (int b = BVH_BINS - 1; b > 0; b--)
+        {
+            acc.expand(binBoxes[b]);
+            n += binCounts[b];
+            rightArea[b] = acc.surfaceArea();
+            rightCount[b] = n;
+        }
+        acc = AABB();
+        n = 0;
+        for (int b = 0; b < BVH_BINS - 1; b++)
+        {
+            acc.expand(binBoxes[b]);
+            n += binCounts[b];
+            if (n == 0 || rightCount[b + 1] == 0)
+                continue;
+            double cost = acc.surfaceArea() * n + rightArea[b + 1] * rightCount[b + 1];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
+    }
+    double area = box.surfaceArea();
+    if (bestAxis != -1 && area > 0)
+        bestCost = 1.0 + bestCost / area;
+
+    if (bestAxis == -1 || depth >= BVH_MAX_DEPTH / 2)
+    {
+        // All centroids coincide, or the tree got too deep: fall back to an object-median split
+        if (count <= maxLeaf && bestAxis == -1)
+            return -1;
+        int axis = 0;
+        if (centroidBox.extent(1) > centroidBox.extent(axis))
+            axis = 1;
+        if (centroidBox.extent(2) > centroidBox.extent(axis))
+            axis = 2;
+        int mid = (begin + end) / 2;
+        nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int a, int b)
+                    { return axisOf(centroids[a], axis) < axisOf(centroids[b], axis); });
+        splitAxis = axis;
+        return mid;
+    }
+    if (count <= maxLeaf && bestCost >= count)
+        return -1;
+    double lo = axisOf(centroidBox.minPoint, bestAxis), extent = centroidBox.extent(bestAxis);
+    auto it = partition(order.begin() + begin, order.begin() + end, [&](int i)
+                        { return min(BVH_BINS - 1, (int)(BVH_BINS * (axisOf(centroids[i], bestAxis) - lo) / extent)) <= bestSplit; });
+    splitAxis = bestAxis;
+    return it - order.begin();
+}
+int BVH::buildNode(vector<int> &order, int begin, int end, const vector<AABB> &boxes,
+                   const vector<Point> &centroids, const vector<Object *> &bounded, int depth)
+{
+    int index = nodes.size();
+    nodes.push_back(BVHNode());
+    AABB box, centroidBox;
+    for (int i = begin; i < end; i++)
+    {
+        box.expand(boxes[order[i]]);
+        centroidBox.expand(centroids[order[i]]);
+    }
+    nodes[index].box = box;
+    if (end - begin <= 2)
+        return makeLeaf(index, order, begin, end, bounded);
+    int axis = 0;
+    int mid = splitSAH(order, begin, end, boxes, centroids, box, centroidBox, depth, BVH_MAX_LEAF, axis);
+    if (mid < 0)
+        return makeLeaf(index, order, begin, end, bounded);
+    nodes[index].axis = axis;
+    int left = buildNode(order, begin, mid, boxes, centroids, bounded, depth + 1);
+    int right = buildNode(order, mid, end, boxes, centroids, bounded, depth + 1);
+    nodes[index].left = left;
+    nodes[index].right = right;
+    return index;
+}
+Hit BVH::intersect(const Ray &r, double tMax) const
+{
+    Hit hit(tMax);
+    for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+        if (unboundedSize[type] > 0)
+            scene.intersect(type, r, unboundedFirst[type], unboundedSize[type], hit);
+    if (nodes.empty())
+        return hit;
+    Vector invDir = inverseDirection(r.direction);
+    int stack[BVH_MAX_DEPTH];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const BVHNode &node = nodes[stack[--top]];
+        RT_COUNT(nodesVisited, 1);
+        if (!node.box.intersect(r.origin, invDir, hit.t))
+            continue;
+        if (node.count > 0)
+        {
+            for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+                if (node.size[type] > 0)
+                    scene.intersect(type, r, node.first[type], node.size[type], hit);
+            continue;
+        }
+        // Push the far child first so the near one is popped next
+        bool negative = axisOf(r.direction, node.axis) < 0;
+        stack[top++] = negative ? node.left : node.right;
+        stack[top++] = negative ? node.right : node.left;
+    }
+    return hit;
+}
+Object *BVH::closestHit(const Ray &r, double &tMin) const
+{
+    Hit hit = intersect(r, tMin);
+    if (hit.id < 0)
+        return nullptr;
+    tMin = hit.t;
+    return scene.sources[hit.id];
+}
+bool BVH::frustumLeaves(const Point &origin, const Vector corners[4], vector<int> &leaves, int limit) const
+{
+    leaves.clear();
+    if (nodes.empty())
+        return true;
+    // Side planes through origin, facing inwards
+    Vector middle = corners[0] + corners[1] + corners[2] + corners[3];
+    Vector normals[4];
+    for (int i = 0; i < 4; i++)
+    {
+        normals[i] = corners[i].cross(corners[(i + 1) % 4]);
+        if (normals[i].dot(middle) < 0)
+            normals[i] = normals[i] * (-1);
+    }
+    vector<pair<double, int>> found; // distance from origin to the leaf box, leaf
+    int stack[BVH_MAX_DEPTH];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        int index = stack[--top];
+        const AABB &box = nodes[index].box;
+        // Outside when even the corner furthest along a plane's normal is behind it
+        bool outside = false;
+        for (int i = 0; i < 4 && !outside; i++)
+        {
+            Point far(normals[i].x >= 0 ? box.maxPoint.x : box.minPoint.x, normals[i].y >= 0 ? box.maxPoint.y : box.minPoint.y,
+                      normals[i].z >= 0 ? box.maxPoint.z : box.minPoint.z);
+            outside = normals[i].dot(far - origin) < 0;
+        }
+        if (outside)
+            continue;
+        if (nodes[index].count > 0)
+        {
+            Point nearest(max(box.minPoint.x, min(origin.x, box.maxPoint.x)), max(box.minPoint.y, min(origin.y, box.maxPoint.y)),
+                          max(box.minPoint.z, min(origin.z, box.maxPoint.z)));
+            found.push_back({origin.distance(nearest), index});
+            if ((int)found.size() > limit)
+                return false;
+            continue;
+        }
+        stack[top++] = nodes[index].left;
+        stack[top++] = nodes[index].right;
+    }
+    // Near leaves first, so a hit there lets the box test skip the ones behind it
+    sort(found.begin(), found.end());
+    for (const auto &leaf : found)
+        leaves.push_back(leaf.second);
+    return true;
+}
+Object *BVH::closestHitLeaves(const Ray &r, double &tMin, const vector<int> &leaves) const
+{
+    Hit hit(tMin);
+    for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+        if (unboundedSize[type] > 0)
+            scene.intersect(type, r, unboundedFirst[type], unboundedSize[type], hit);
+    Vector invDir = inverseDirection(r.direction);
+    for (int index : leaves)
+    {
+        const BVHNode &node = nodes[index];
+        RT_COUNT(nodesVisited, 1);
+        if (!node.box.intersect(r.origin, invDir, hit.t))
+            continue;
+        for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+            if (node.size[type] > 0)
+                scene.intersect(type, r, node.first[type], node.size[type], hit);
+    }
+    if (hit.id < 0)
+        return nullptr;
+    tMin = hit.t;
+    return scene.sources[hit.id];
+}
+bool BVH::anyHit(const Ray &r, double tMax, double epsilon) const { return occluder(r, tMax, epsilon) >= 0; }
+int BVH::occluder(const Ray &r, double tMax, double epsilon) const
+{
+    for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+    {
+        if (unboundedSize[type] == 0)
+            continue;
+        int id = scene.anyHit(type, r, unboundedFirst[type], unboundedSize[type], tMax, epsilon);
+        if (id >= 0)
+            return id;
+    }
+    if (nodes.empty())
+        return -1;
+    Vector invDir = inverseDirection(r.direction);
+    int stack[BVH_MAX_DEPTH];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const BVHNode &node = nodes[stack[--top]];
+        RT_COUNT(nodesVisited, 1);
+        if (!node.box.intersect(r.origin, invDir, tMax))
+            continue;
+        if (node.count > 0)
+        {
+            for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+            {
+                if (node.size[type] == 0)
+                    continue;
+                int id = scene.anyHit(type, r, node.first[type], node.size[type], tMax, epsilon);
+                if (id >= 0)
+                    return id;
+            }
+            continue;
+        }
+        stack[top++] = node.right;
+        stack[top++] = node.left;
+    }
+    return -1;
+}
+bool BVH::occluded(const Point &origin, const Point &target, int light, OcclusionCache *cache, double epsilon) const
+{
+    Vector toTarget = target - origin;
+    double distance = toTarget.norm();
+    if (distance < 1e-6)
+        return false;
+    RT_COUNT(shadowRays, 1);
+    Ray r(origin, toTarget);
+    if (cache == nullptr)
+    {
+        int id = occluder(r, distance, epsilon);
+        if (id >= 0 && FrameDependencies::recording)
+            DependencyRecorder::local.touched.push_back(scene.sources[id]);
+        return id >= 0;
+    }
+    if ((int)cache->lastOccluder.size() <= light)
+        cache->lastOccluder.resize(light + 1, -1);
+    cache->queries++;
+    // Neighbouring shading points are usually blocked by the same primitive
+    int &last = cache->lastOccluder[light];
+    if (last >= 0 && scene.occludes(last, r, distance, epsilon))
+    {
+        cache->cacheHits++;
+        if (FrameDependencies::recording)
+            DependencyRecorder::local.touched.push_back(scene.sources[last]);
+        return true;
+    }
+    int id = occluder(r, distance, epsilon);
+    if (id >= 0)
+        last = id;
+    if (id >= 0 && FrameDependencies::recording)
+        DependencyRecorder::local.touched.push_back(scene.sources[id]);
+    return id >= 0;
+}
+static bool boxHitsPacket(const AABB &box, const RayPacket &packet)
+{
+    SimdReal minX(box.minPoint.x), minY(box.minPoint.y), minZ(box.minPoint.z);
+    SimdReal maxX(box.maxPoint.x), maxY(box.maxPoint.y), maxZ(box.maxPoint.z);
+    for (int i = 0; i < packet.lanes; i += SimdReal::WIDTH)
+    {
+        SimdReal ox = SimdReal::load(packet.ox + i), ix = SimdReal::load(packet.ix + i);
+        SimdReal a = (minX - ox) * ix, b = (maxX - ox) * ix;
+        SimdReal t0 = max(SimdReal(0.0), min(a, b)), t1 = min(SimdReal::load(packet.tMin + i), max(a, b));
+        SimdReal oy = SimdReal::load(packet.oy + i), iy = SimdReal::load(packet.iy + i);
+        a = (minY - oy) * iy, b = (maxY - oy) * iy;
+        t0 = max(t0, min(a, b)), t1 = min(t1, max(a, b));
+        SimdReal oz = SimdReal::load(packet.oz + i), iz = SimdReal::load(packet.iz + i);
+        a = (minZ - oz) * iz, b = (maxZ - oz) * iz;
+        t0 = max(t0, min(a, b)), t1 = min(t1, max(a, b));
+        if ((t0 <= t1).any())
+            return true;
+    }
+    return false;
+}
+void BVH::closestHitPacket(RayPacket &packet) const
+{
+    for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+        if (unboundedSize[type] > 0)
+            scene.intersectPacket(type, packet, unboundedFirst[type], unboundedSize[type]);
+    if (nodes.empty())
+        return;
+    // A coherent packet shares direction signs, so lane 0 decides the near child for all lanes
+    bool negative[3] = {packet.dx[0] < 0, packet.dy[0] < 0, packet.dz[0] < 0};
+    int stack[BVH_MAX_DEPTH];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const BVHNode &node = nodes[stack[--top]];
+        RT_COUNT(nodesVisited, 1);
+        if (!boxHitsPacket(node.box, packet))
+            continue;
+        if (node.count > 0)
+        {
+            for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+                if (node.size[type] > 0)
+                    scene.intersectPacket(type, packet, node.first[type], node.size[type]);
+            continue;
+        }
+        stack[top++] = negative[node.axis] ? node.left : node.right;
+        stack[top++] = negative[node.axis] ? node.right : node.left;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                  Mesh                                                          //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+static const int MESH_MAX_LEAF = 8;
+// Model triangles can be far smaller than the scene's, so only (almost) exactly parallel rays are skipped
+static const double MESH_MIN_DET = 1e-30;
+
+static bool readWholeFile(const string &path, vector<char> &data)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data.resize(max(0L, size));
+    bool ok = size >= 0 && fread(data.data(), 1, data.size(), f) == data.size();
+    fclose(f);
+    return ok;
+}
+
+enum PlyType
+{
+    PLY_INT8,
+    PLY_UINT8,
+    PLY_INT16,
+    PLY_UINT16,
+    PLY_INT32,
+    PLY_UINT32,
+    PLY_FLOAT32,
+    PLY_FLOAT64,
+    PLY_UNKNOWN
+};
+class PlyProperty
+{
+public:
+    std::string name;
+    int type = PLY_UNKNOWN;
+    int countType = -1; // list length type, -1 for scalar properties
+};
+class PlyElement
+{
+public:
+    std::string name;
+    long count = 0;
+    std::vector<PlyProperty> properties;
+};
+static int plyType(const string &name)
+{
+    const char *names[][2] = {{"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"}, {"ushort", "uint16"},
+                              {"int", "int32"}, {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}};
+    for (int type = 0; type < PLY_UNKNOWN; type++)
+        if (name == names[type][0] || name == names[type][1])
+            return type;
+    return PLY_UNKNOWN;
+}
+static int plySize(int type)
+{
+    static const int sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+    return sizes[type];
+}
+// Reads one value and advances p; swap when the file's byte order differs from ours
+static double plyValue(const char *&p, int type, bool swap)
+{
+    char bytes[8];
+    int size = plySize(type);
+    for (int i = 0; i < size; i++)
+        bytes[i] = p[swap ? size - 1 - i : i];
+    p += size;
+    switch (type)
+    {
+    case PLY_INT8:
+        return (int8_t)bytes[0];
+    case PLY_UINT8:
+        return (uint8_t)bytes[0];
+    case PLY_INT16:
+    {
+        int16_t v;
+        memcpy(&v, bytes, 2);
+        return v;
+    }
+    case PLY_UINT16:
+    {
+        uint16_t v;
+        memcpy(&v, bytes, 2);
+        return v;
+    }
+    case PLY_INT32:
+    {
+        int32_t v;
+        memcpy(&v, bytes, 4);
+        return v;
+    }
+    case PLY_UINT32:
+    {
+        uint32_t v;
+        memcpy(&v, bytes, 4);
+        return v;
+    }
+    case PLY_FLOAT32:
+    {
+        float v;
+        memcpy(&v, bytes, 4);
+        return v;
+    }
+    default:
+    {
+        double v;
+        memcpy(&v, bytes, 8);
+        return v;
+    }
+    }
+}
+
+bool Mesh::load(const string &path)
+{
+    this->path = path;
+    vertices.clear();
+    indices.clear();
+    nodes.clear();
+    string extension = path.substr(path.find_last_of('.') + 1);
+    transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    bool ok;
+    if (extension == "obj")
+        ok = loadOBJ(path);
+    else if (extension == "ply")
+        ok = loadPLY(path);
+    else
+    {
+        cerr << "Error: " << path << " is neither .obj nor .ply" << endl;
+        return false;
+    }
+    if (!ok)
+        return false;
+    if (indices.empty() || vertices.size() > numeric_limits<uint32_t>::max())
+    {
+        cerr << "Error: " << path << (indices.empty() ? " has no faces" : " has too many vertices for 32-bit indices") << endl;
+        return false;
+    }
+    for (uint32_t index : indices)
+    {
+        if (index >= vertices.size())
+        {
+            cerr << "Error: " << path << " has a face with a vertex index out of range" << endl;
+            return false;
+        }
+    }
+    build();
+    return true;
+}
+// Only v and f records are used; faces may be polygons (fanned into triangles), use v/vt/vn forms or negative indices
+bool Mesh::loadOBJ(const string &path)
+{
+    vector<char> text;
+    if (!readWholeFile(path, text))
+    {
+        cerr << "Error: cannot read " << path << endl;
+        return false;
+    }
+    text.push_back('\0');
+    vector<long> polygon;
+    const char *p = text.data();
+    while (*p)
+    {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            char *next;
+            double x = strtod(p + 1, &next);
+            double y = strtod(next, &next);
+            double z = strtod(next, &next);
+            vertices.push_back(Point(x, y, z));
+            p = next;
+        }
+        else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            p++;
+            polygon.clear();
+            while (true)
+            {
+                while (*p == ' ' || *p == '\t')
+                    p++;
+                if (*p == '\0' || *p == '\n' || *p == '\r' || *p == '#')
+                    break;
+                char *next;
+                long index = strtol(p, &next, 10);
+                if (next == p || index == 0)
+                {
+                    cerr << "Error: bad face in " << path << endl;
+                    return false;
+                }
+                polygon.push_back(index < 0 ? (long)vertices.size() + index : index - 1);
+                p = next;
+                while (*p && !isspace((unsigned char)*p)) // texture and normal indices
+                    p++;
+            }
+            for (size_t k = 2; k < polygon.size(); k++)
+                for (long index : {polygon[0], polygon[k - 1], polygon[k]})
+                    indices.push_back(index < 0 ? numeric_limits<uint32_t>::max() : (uint32_t)index);
+        }
+        while (*p && *p != '\n')
+            p++;
+        if (*p)
+            p++;
+    }
+    return true;
+}
+// Binary PLY in either byte order: x, y, z of the vertex element and the vertex_indices list of the face element
+bool Mesh::loadPLY(const string &path)
+{
+    vector<char> data;
+    if (!readWholeFile(path, data))
+    {
+        cerr << "Error: cannot read " << path << endl;
+        return false;
+    }
+    string header(data.data(), min(data.size(), (size_t)65536));
+    size_t headerEnd = header.find("end_header");
+    if (header.compare(0, 3, "ply") != 0 || headerEnd == string::npos)
+    {
+        cerr << "Error: " << path << " is not a PLY file" << endl;
+        return false;
+    }
+    headerEnd = header.find('\n', headerEnd);
+    istringstream lines(header.substr(0, headerEnd));
+    vector<PlyElement> elements;
+    bool bigEndian = false, binary = false;
+    string line;
+    while (getline(lines, line))
+    {
+        istringstream words(line);
+        string keyword;
+        words >> keyword;
+        if (keyword == "format")
+        {
+            string format;
+            words >> format;
+            binary = format == "binary_little_endian" || format == "binary_big_endian";
+            bigEndian = format == "binary_big_endian";
+        }
+        else if (keyword == "element")
+        {
+            elements.push_back(PlyElement());
+            words >> elements.back().name >> elements.back().count;
+        }
+        else if (keyword == "property" && !elements.empty())
+        {
+            PlyProperty property;
+            string type;
+            words >> type;
+            if (type == "list")
+            {
+                string countType;
+                words >> countType >> type;
+                property.countType = plyType(countType);
+            }
+            property.type = plyType(type);
+            words >> property.name;
+            if (property.type == PLY_UNKNOWN || property.countType == PLY_UNKNOWN)
+            {
+                cerr << "Error: " << path << " has a property of unknown type" << endl;
+                return false;
+            }
+            elements.back().properties.push_back(property);
+        }
+    }
+    if (!binary || headerEnd == string::npos)
+    {
+        cerr << "Error: " << path << " is not a binary PLY file" << endl;
+        return false;
+    }
+    uint16_t one = 1;
+    bool swap = bigEndian == (*reinterpret_cast<char *>(&one) == 1);
+    const char *p = data.data() + headerEnd + 1, *end = data.data() + data.size();
+    vector<long> polygon;
+    for (const PlyElement &element : elements)
+    {
+        bool isVertex = element.name == "vertex", isFace = element.name == "face";
+        if (isVertex)
+            vertices.reserve(element.count);
+        if (isFace)
+            indices.reserve(3 * element.count);
+        for (long item = 0; item < element.count; item++)
+        {
+            double xyz[3] = {0, 0, 0};
+            for (const PlyProperty &property : element.properties)
+            {
+                long n = 1;
+                bool truncated = property.countType >= 0 && end - p < plySize(property.countType);
+                if (property.countType >= 0 && !truncated)
+                    n = (long)plyValue(p, property.countType, swap);
+                if (truncated || n < 0 || end - p < n * plySize(property.type))
+                {
+                    cerr << "Error: " << path << " is truncated" << endl;
+                    return false;
+                }
+                bool faceIndices = isFace && property.countType >= 0 &&
+                                   (property.name == "vertex_indices" || property.name == "vertex_index");
+                polygon.clear();
+                for (long k = 0; k < n; k++)
+                {
+                    double value = plyValue(p, property.type, swap);
+                    if (faceIndices)
+                        polygon.push_back((long)value);
+                    else if (isVertex && property.countType < 0 && property.name.size() == 1 && property.name[0] >= 'x' &&
+                             property.name[0] <= 'z')
+                        xyz[property.name[0] - 'x'] = value;
+                }
+                for (size_t k = 2; k < polygon.size(); k++)
+                    for (long index : {polygon[0], polygon[k - 1], polygon[k]})
+                        indices.push_back(index < 0 ? numeric_limits<uint32_t>::max() : (uint32_t)index);
+            }
+            if (isVertex)
+                vertices.push_back(Point(xyz[0], xyz[1], xyz[2]));
+        }
+    }
+    if (vertices.size() == 0 || p > end)
+    {
+        cerr << "Error: " << path << " is truncated" << endl;
+        return false;
+    }
+    return true;
+}
+void Mesh::build()
+{
+    nodes.clear();
+    int n = triangleCount();
+    if (n == 0)
+        return;
+    AABB bounds;
+    for (const Point &v : vertices)
+        bounds.expand(v);
+    // Flat triangles still get a box with volume, scaled to the model rather than the scene
+    double pad = 1e-7 * max<double>(1.0, (bounds.maxPoint - bounds.minPoint).norm());
+    vector<AABB> boxes(n);
+    vector<Point> centroids(n);
+    vector<int> order(n);
+    for (int i = 0; i < n; i++)
+    {
+        for (int k = 0; k < 3; k++)
+            boxes[i].expand(vertices[indices[3 * i + k]]);
+        boxes[i].pad(pad);
+        centroids[i] = boxes[i].centroid();
+        order[i] = i;
+    }
+    nodes.reserve(2 * n / MESH_MAX_LEAF + 1);
+    buildNode(order, 0, n, boxes, centroids, 0);
+    // Store the triangles in leaf order so a leaf's range indexes them directly
+    vector<uint32_t> sorted(indices.size());
+    for (int i = 0; i < n; i++)
+        for (int k = 0; k < 3; k++)
+            sorted[3 * i + k] = indices[3 * order[i] + k];
+    indices.swap(sorted);
+    nodes.shrink_to_fit();
+}
+int Mesh::buildNode(vector<int> &order, int begin, int end, const vector<AABB> &boxes, const vector<Point> &centroids,
+                    int depth)
+{
+    int index = nodes.size();
+    nodes.push_back(MeshNode());
+    AABB box, centroidBox;
+    for (int i = begin; i < end; i++)
+    {
+        box.expand(boxes[order[i]]);
+        centroidBox.expand(centroids[order[i]]);
+    }
+    nodes[index].box = box;
+    int axis = 0;
+    int mid = end - begin <= 2 ? -1 : splitSAH(order, begin, end, boxes, centroids, box, centroidBox, depth, MESH_MAX_LEAF, axis);
+    if (mid < 0)
+    {
+        nodes[index].first = begin;
+        nodes[index].count = end - begin;
+        return index;
+    }
+    nodes[index].axis = axis;
+    buildNode(order, begin, mid, boxes, centroids, depth + 1); // lands at index + 1
+    int right = buildNode(order, mid, end, boxes, centroids, depth + 1);
+    nodes[index].first = right;
+    return index;
+}
+int Mesh::triangleCount() const { return indices.size() / 3; }
+double Mesh::triangleT(int triangle, const Ray &r) const
+{
+    const Point &a = vertices[indices[3 * triangle]];
+    return triangleIntersect(a, vertices[indices[3 * triangle + 1]] - a, vertices[indices[3 * triangle + 2]] - a, r,
+                             MESH_MIN_DET);
+}
+Vector Mesh::faceNormal(int triangle) const
+{
+    const Point &a = vertices[indices[3 * triangle]];
+    return (vertices[indices[3 * triangle + 1]] - a).cross(vertices[indices[3 * triangle + 2]] - a).normalize();
+}
+// Triangles of this thread's latest mesh hits, keyed on the ray (instances share one Mesh), so normalAt() for the ray
+// that found a hit looks its face up instead of walking the mesh again. Enough slots for a packet's lanes.
+class MeshHit
+{
+public:
+    const Mesh *mesh = nullptr;
+    Point origin;
+    Vector direction;
+    int triangle = -1;
+};
+static const int MESH_HIT_SLOTS = 32;
+static thread_local MeshHit meshHits[MESH_HIT_SLOTS];
+static thread_local int nextMeshHit = 0;
+static bool sameRay(const MeshHit &hit, const Ray &r)
+{
+    return hit.origin.x == r.origin.x && hit.origin.y == r.origin.y && hit.origin.z == r.origin.z &&
+           hit.direction.x == r.direction.x && hit.direction.y == r.direction.y && hit.direction.z == r.direction.z;
+}
+
+int Mesh::closestTriangle(const Ray &r, double &tMin) const
+{
+    if (nodes.empty())
+        return -1;
+    Vector invDir = inverseDirection(r.direction);
+    int stack[BVH_MAX_DEPTH];
+    int top = 0, best = -1;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        int index = stack[--top];
+        const MeshNode &node = nodes[index];
+        RT_COUNT(nodesVisited, 1);
+        if (!node.box.intersect(r.origin, invDir, tMin))
+            continue;
+        if (node.count > 0)
+        {
+            RT_COUNT(tests[CompiledScene::TRIANGLE], node.count);
+            for (int i = node.first; i < node.first + node.count; i++)
+            {
+                double t = triangleT(i, r);
+                if (t > 0 && t < tMin)
+                {
+                    tMin = t;
+                    best = i;
+                }
+            }
+            continue;
+        }
+        // Far child first, as in BVH::intersect
+        bool negative = axisOf(r.direction, node.axis) < 0;
+        stack[top++] = negative ? index + 1 : node.first;
+        stack[top++] = negative ? node.first : index + 1;
+    }
+    return best;
+}
+double Mesh::intersect(const Ray &r) const
+{
+    double t = 1e9;
+    int triangle = closestTriangle(r, t);
+    if (triangle < 0)
+        return -1.0;
+    MeshHit &hit = meshHits[nextMeshHit];
+    nextMeshHit = (nextMeshHit + 1) % MESH_HIT_SLOTS;
+    hit.mesh = this;
+    hit.origin = r.origin;
+    hit.direction = r.direction;
+    hit.triangle = triangle;
+    return t;
+}
+bool Mesh::occludes(const Ray &r, double tMax, double epsilon) const
+{
+    if (nodes.empty())
+        return false;
+    Vector invDir = inverseDirection(r.direction);
+    int stack[BVH_MAX_DEPTH];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        int index = stack[--top];
+        const MeshNode &node = nodes[index];
+        RT_COUNT(nodesVisited, 1);
+        if (!node.box.intersect(r.origin, invDir, tMax))
+            continue;
+        if (node.count > 0)
+        {
+            for (int i = node.first; i < node.first + node.count; i++)
+            {
+                double t = triangleT(i, r);
+                if (t > epsilon && t + epsilon < tMax)
+                {
+                    RT_COUNT(tests[CompiledScene::TRIANGLE], i - node.first + 1);
+                    return true;
+                }
+            }
+            RT_COUNT(tests[CompiledScene::TRIANGLE], node.count);
+            continue;
+        }
+        stack[top++] = index + 1;
+        stack[top++] = node.first;
+    }
+    return false;
+}
+Vector Mesh::normalAt(const Ray &r, const Point &point) const
+{
+    // Newest first: the shaded hit is normally the last one this ray found in this mesh
+    for (int k = 1; k <= MESH_HIT_SLOTS; k++)
+    {
+        const MeshHit &hit = meshHits[(nextMeshHit - k + MESH_HIT_SLOTS) % MESH_HIT_SLOTS];
+        if (hit.mesh == this && sameRay(hit, r))
+            return faceNormal(hit.triangle);
+    }
+    // Evicted, or not found by intersect() on this thread: walk the mesh again
+    double t = 1e9;
+    int triangle = closestTriangle(r, t);
+    return triangle >= 0 ? faceNormal(triangle) : getNormal(point);
+}
+Vector Mesh::getNormal(const Point &point) const
+{
+    // No ray to follow: among the triangles under point, take the one whose plane passes closest to it
+    double tolerance = 1e-6 * max<double>(1.0, max(fabs(point.x), max(fabs(point.y), fabs(point.z))));
+    int best = -1;
+    double bestDistance = 1e30;
+    int stack[BVH_MAX_DEPTH];
+    int top = 0;
+    if (!nodes.empty())
+        stack[top++] = 0;
+    while (top > 0)
+    {
+        int index = stack[--top];
+        const MeshNode &node = nodes[index];
+        const Point &lo = node.box.minPoint, &hi = node.box.maxPoint;
+        if (point.x < lo.x - tolerance || point.y < lo.y - tolerance || point.z < lo.z - tolerance ||
+            point.x > hi.x + tolerance || point.y > hi.y + tolerance || point.z > hi.z + tolerance)
+            continue;
+        if (node.count == 0)
+        {
+            stack[top++] = index + 1;
+            stack[top++] = node.first;
+            continue;
+        }
+        for (int i = node.first; i < node.first + node.count; i++)
+        {
+            const Point &a = vertices[indices[3 * i]];
+            Vector e1 = vertices[indices[3 * i + 1]] - a, e2 = vertices[indices[3 * i + 2]] - a, w = point - a;
+            Vector n = e1.cross(e2);
+            double area2 = n.dot(n);
+            if (area2 <= 0)
+                continue;
+            double beta = w.cross(e2).dot(n) / area2, gamma = e1.cross(w).dot(n) / area2;
+            double distance = fabs(w.dot(n)) / sqrt(area2);
+            if (beta >= -1e-4 && gamma >= -1e-4 && beta + gamma <= 1 + 1e-4 && distance < bestDistance)
+            {
+                bestDistance = distance;
+                best = i;
+            }
+        }
+    }
+    return best >= 0 ? faceNormal(best) : Vector(0.0, 0.0, 1.0);
+}
+bool Mesh::getBoundingBox(AABB &box) const
+{
+    if (nodes.empty())
+        return false;
+    box = nodes[0].box;
+    return true;
+}
+void Mesh::draw() const
+{
+    if (!previewMesh.ready())
+    {
+        previewMesh.vertices.reserve(indices.size() * 3);
+        for (uint32_t index : indices)
+            previewMesh.vertices.insert(previewMesh.vertices.end(),
+                                        {(GLfloat)vertices[index].x, (GLfloat)vertices[index].y, (GLfloat)vertices[index].z});
+        previewMesh.upload();
+    }
+    glColor3f(color.r, color.g, color.b);
+    previewMesh.draw();
+}
+void Mesh::print() const
+{
+    cout << "Mesh: " << path << ", " << vertices.size() << " vertices, " << triangleCount() << " triangles, "
+         << nodes.size() << " BVH nodes" << endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                               Transform                                                        //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+Transform::Transform()
+{
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 4; j++)
+            m[i][j] = i == j ? 1.0 : 0.0;
+}
+bool Transform::setRows(const double rows[16])
+{
+    if (fabs(rows[12]) > 1e-9 || fabs(rows[13]) > 1e-9 || fabs(rows[14]) > 1e-9 || fabs(rows[15] - 1.0) > 1e-9)
+        return false;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 4; j++)
+            m[i][j] = rows[4 * i + j];
+    return true;
+}
+Point Transform::apply(const Point &p) const
+{
+    return Point(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                 m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                 m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+}
+Vector Transform::applyVector(const Vector &v) const
+{
+    return Vector(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                  m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                  m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+}
+Vector Transform::applyTransposed(const Vector &v) const
+{
+    return Vector(m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+                  m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+                  m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+}
+double Transform::determinant() const
+{
+    return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+           m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+           m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+}
+Transform Transform::inverse() const
+{
+    // Inverse of the linear part by cofactors, then the translation moved back through it
+    Transform result;
+    double invDet = 1.0 / determinant();
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            int r0 = (j + 1) % 3, r1 = (j + 2) % 3, c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+            result.m[i][j] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) * invDet;
+        }
+    }
+    for (int i = 0; i < 3; i++)
+        result.m[i][3] = -(result.m[i][0] * m[0][3] + result.m[i][1] * m[1][3] + result.m[i][2] * m[2][3]);
+    return result;
+}
+void Transform::toGL(double columnMajor[16]) const
+{
+    for (int j = 0; j < 4; j++)
+    {
+        for (int i = 0; i < 3; i++)
+            columnMajor[4 * j + i] = m[i][j];
+        columnMajor[4 * j + 3] = j == 3 ? 1.0 : 0.0;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                               Instance                                                         //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+Instance::Instance(const Object *prototype, const Transform &toWorld)
+    : Object(*prototype), prototype(prototype), toWorld(toWorld), toObject(toWorld.inverse())
+{
+    referencePoint = toWorld.apply(prototype->referencePoint);
+    AABB box;
+    bounded = prototype->getBoundingBox(box);
+    if (!bounded)
+        return;
+    for (int corner = 0; corner < 8; corner++)
+        bounds.expand(toWorld.apply(Point(corner & 1 ? box.maxPoint.x : box.minPoint.x,
+                                          corner & 2 ? box.maxPoint.y : box.minPoint.y,
+                                          corner & 4 ? box.maxPoint.z : box.minPoint.z)));
+}
+Ray Instance::objectRay(const Ray &r, double &scale) const
+{
+    Vector direction = toObject.applyVector(r.direction);
+    scale = direction.norm();
+    return Ray(toObject.apply(r.origin), direction);
+}
+Vector Instance::worldNormal(const Vector &normal) const { return toObject.applyTransposed(normal).normalize(); }
+double Instance::intersect(const Ray &r) const
+{
+    double scale;
+    Ray local = objectRay(r, scale);
+    double t = prototype->intersect(local);
+    return t > 0 ? t / scale : t;
+}
+bool Instance::occludes(const Ray &r, double tMax, double epsilon) const
+{
+    double scale;
+    Ray local = objectRay(r, scale);
+    return prototype->occludes(local, tMax * scale, epsilon * scale);
+}
+Vector Instance::normalAt(const Ray &r, const Point &point) const
+{
+    double scale;
+    Ray local = objectRay(r, scale);
+    return worldNormal(prototype->normalAt(local, toObject.apply(point)));
+}
+Vector Instance::getNormal(const Point &point) const { return worldNormal(prototype->getNormal(toObject.apply(point))); }
+bool Instance::getBoundingBox(AABB &box) const
+{
+    box = bounds;
+    return bounded;
+}
+void Instance::draw() const
+{
+    double matrix[16];
+    toWorld.toGL(matrix);
+    glPushMatrix();
+    glMultMatrixd(matrix);
+    prototype->draw();
+    glPopMatrix();
+}
+void Instance::print() const
+{
+    cout << "Instance of ";
+    prototype->print();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                               SceneCache                                                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+static const char SCENE_CACHE_MAGIC[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+enum SceneRecord // object kinds in the cache, each stored as a fixed number of doubles
+{
+    RECORD_SPHERE,
+    RECORD_TRIANGLE,
+    RECORD_QUADRIC,
+    RECORD_FLOOR,
+    RECORD_MESH,     // vertex, index and node counts; the arrays themselves are their own sections
+    RECORD_INSTANCE, // record index of the prototype, then the top three rows of the transform
+    RECORD_COUNT
+};
+static const int RECORD_PARAMETERS[RECORD_COUNT] = {4, 9, 16, 2, 3, 13};
+// Prototypes are records without a primitive (-1); their material follows the parameters since the BVH has none
+static const int PROTOTYPE_MATERIAL_PARAMETERS = 8;
+
+static bool sourceInfo(const string &path, uint64_t &size, int64_t &mtime)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+    size = st.st_size;
+#ifdef __APPLE__
+    mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+// Every Real array of the compiled scene, in file order
+template <typename Scene>
+static auto realArrays(Scene &s) -> vector<decltype(&s.sphereX)>
+{
+    vector<decltype(&s.sphereX)> arrays = {&s.sphereX, &s.sphereY, &s.sphereZ, &s.sphereRadius, &s.triangleX, &s.triangleY,
+                                           &s.triangleZ, &s.edge1X, &s.edge1Y, &s.edge1Z, &s.edge2X, &s.edge2Y, &s.edge2Z};
+    for (auto &v : s.quadricCoefficients)
+        arrays.push_back(&v);
+    for (auto &v : s.quadricClip)
+        arrays.push_back(&v);
+    return arrays;
+}
+// A section is a uint64 element count followed by the elements as they sit in memory, padded to 8 bytes
+template <typename T>
+static void writeSection(FILE *f, const T *data, uint64_t count)
+{
+    static_assert(is_trivially_copyable<T>::value, "only plain data can be cached");
+    static const char zeros[8] = {};
+    fwrite(&count, sizeof(count), 1, f);
+    if (count > 0)
+        fwrite(data, sizeof(T), count, f);
+    fwrite(zeros, 1, (8 - sizeof(T) * count % 8) % 8, f);
+}
+template <typename T>
+static void writeSection(FILE *f, const vector<T> &v) { writeSection(f, v.data(), v.size()); }
+
+class MappedFile // read-only mmap of a whole file, unmapped when it goes out of scope
+{
+public:
+    const char *data = nullptr;
+    size_t size = 0;
+    size_t offset = 0; // read position of take()
+
+    bool open(const string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                data = static_cast<const char *>(p);
+                size = st.st_size;
+            }
+        }
+        close(fd);
+        return data != nullptr;
+    }
+    ~MappedFile()
+    {
+        if (data)
+            munmap(const_cast<char *>(data), size);
+    }
+    // Points at the next section in place, nullptr when it runs past the end of the file; valid while the file is mapped
+    template <typename T>
+    const T *take(uint64_t &count)
+    {
+        if (size - offset < sizeof(uint64_t))
+            return nullptr;
+        memcpy(&count, data + offset, sizeof(uint64_t));
+        offset += sizeof(uint64_t);
+        if (count > (size - offset) / sizeof(T))
+            return nullptr;
+        const T *items = reinterpret_cast<const T *>(data + offset);
+        offset = min(size, offset + (sizeof(T) * count + 7) / 8 * 8);
+        return items;
+    }
+    template <typename T>
+    bool take(vector<T> &v) // copies the section, so v outlives the mapping
+    {
+        uint64_t count;
+        const T *items = take<T>(count);
+        if (items)
+            v.assign(items, items + count);
+        return items != nullptr;
+    }
+    template <typename T>
+    bool take(T *fixed, uint64_t expected)
+    {
+        uint64_t count;
+        const T *items = take<T>(count);
+        if (!items || count != expected)
+            return false;
+        memcpy(fixed, items, sizeof(T) * count);
+        return true;
+    }
+};
+
+bool SceneCache::loaded() const
+{
+    return !spheres.empty() || !triangles.empty() || !quadrics.empty() || !floors.empty() || !meshes.empty() ||
+           !instances.empty();
+}
+void SceneCache::release()
+{
+    spheres.clear();
+    triangles.clear();
+    quadrics.clear();
+    floors.clear();
+    instances.clear(); // before the prototypes they point to go
+    meshes.clear();
+}
+uint64_t SceneCache::hashFile(const string &path)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return 0;
+    vector<unsigned char> buffer(1 << 20);
+    size_t n;
+    while ((n = fread(buffer.data(), 1, buffer.size(), f)) > 0)
+        for (size_t i = 0; i < n; i++)
+            hash = (hash ^ buffer[i]) * 1099511628211ULL;
+    fclose(f);
+    return hash;
+}
+bool SceneCache::write(const string &path, const string &source, int level, const vector<Object *> &objects,
+                       const vector<PointLight *> &pointLights, const vector<SpotLight *> &spotLights, const BVH &bvh)
+{
+    const CompiledScene &scene = bvh.scene;
+    Header header = {};
+    memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = VERSION;
+    header.realSize = sizeof(Real);
+    header.level = level;
+    if (!sourceInfo(source, header.sourceSize, header.sourceMtime))
+    {
+        cerr << "Error: cannot stat " << source << endl;
+        return false;
+    }
+    header.sourceHash = hashFile(source);
+
+    // Objects are stored as their constructor arguments plus the primitive id the BVH gave them
+    unordered_map<const Object *, int> ids;
+    for (int id = 0; id < (int)scene.sources.size(); id++)
+        ids[scene.sources[id]] = id;
+    vector<int> types, primitives;
+    vector<double> parameters;
+    vector<Point> meshVertices;
+    vector<uint32_t> meshIndices;
+    vector<MeshNode> meshNodes;
+    // Mesh files are dependencies too: '\0'-separated paths, then size, mtime and hash of each
+    vector<char> dependencyPaths;
+    vector<uint64_t> dependencies;
+    // A prototype is written once, as a record without a primitive, just before the first instance that uses it
+    unordered_map<const Object *, int> prototypeRecords;
+    function<int(const Object *, int)> record = [&](const Object *o, int primitive)
+    {
+        int type;
+        if (const Sphere *sp = dynamic_cast<const Sphere *>(o))
+        {
+            type = RECORD_SPHERE;
+            parameters.insert(parameters.end(), {sp->center.x, sp->center.y, sp->center.z, sp->radius});
+        }
+        else if (const Triangle *t = dynamic_cast<const Triangle *>(o))
+        {
+            type = RECORD_TRIANGLE;
+            parameters.insert(parameters.end(), {t->p1.x, t->p1.y, t->p1.z, t->p2.x, t->p2.y, t->p2.z, t->p3.x, t->p3.y, t->p3.z});
+        }
+        else if (const QuadraticSurface *q = dynamic_cast<const QuadraticSurface *>(o))
+        {
+            type = RECORD_QUADRIC;
+            parameters.insert(parameters.end(), {q->referencePoint.x, q->referencePoint.y, q->referencePoint.z, q->height,
+                                                 q->width, q->length, q->A, q->B, q->C, q->D, q->E, q->F, q->G, q->H,
+                                                 q->I, q->J});
+        }
+        else if (const Floor *fl = dynamic_cast<const Floor *>(o))
+        {
+            type = RECORD_FLOOR;
+            parameters.insert(parameters.end(), {fl->floorWidth, fl->tileWidth});
+        }
+        else if (const Mesh *m = dynamic_cast<const Mesh *>(o))
+        {
+            type = RECORD_MESH;
+            parameters.insert(parameters.end(), {(double)m->vertices.size(), (double)m->indices.size(), (double)m->nodes.size()});
+            meshVertices.insert(meshVertices.end(), m->vertices.begin(), m->vertices.end());
+            meshIndices.insert(meshIndices.end(), m->indices.begin(), m->indices.end());
+            meshNodes.insert(meshNodes.end(), m->nodes.begin(), m->nodes.end());
+            uint64_t size;
+            int64_t mtime;
+            if (!sourceInfo(m->path, size, mtime))
+            {
+                cerr << "Error: cannot stat " << m->path << endl;
+                return -1;
+            }
+            dependencyPaths.insert(dependencyPaths.end(), m->path.begin(), m->path.end());
+            dependencyPaths.push_back('\0');
+            dependencies.insert(dependencies.end(), {size, (uint64_t)mtime, hashFile(m->path)});
+        }
+        else if (const Instance *in = dynamic_cast<const Instance *>(o))
+        {
+            auto known = prototypeRecords.find(in->prototype);
+            int prototype = known != prototypeRecords.end() ? known->second : record(in->prototype, -1);
+            if (prototype < 0)
+                return -1;
+            prototypeRecords[in->prototype] = prototype;
+            type = RECORD_INSTANCE;
+            parameters.push_back(prototype);
+            for (int row = 0; row < 3; row++)
+                parameters.insert(parameters.end(), in->toWorld.m[row], in->toWorld.m[row] + 4);
+        }
+        else
+        {
+            cerr << "Error: scene cache cannot store this object type" << endl;
+            return -1;
+        }
+        if (primitive < 0)
+            parameters.insert(parameters.end(), {o->color.r, o->color.g, o->color.b, o->ambient, o->diffuse, o->specular,
+                                                 o->reflectionCoefficient, (double)o->shine});
+        types.push_back(type);
+        primitives.push_back(primitive);
+        return (int)types.size() - 1;
+    };
+    for (const Object *o : objects)
+    {
+        auto found = ids.find(o);
+        if (found == ids.end())
+        {
+            cerr << "Error: the BVH was not built over these objects" << endl;
+            return false;
+        }
+        if (record(o, found->second) < 0)
+            return false;
+    }
+    vector<double> pointLightData, spotLightData;
+    for (const PointLight *pl : pointLights)
+        pointLightData.insert(pointLightData.end(), {pl->position.x, pl->position.y, pl->position.z,
+                                                     pl->color.r, pl->color.g, pl->color.b});
+    for (const SpotLight *sl : spotLights)
+        spotLightData.insert(spotLightData.end(), {sl->position.x, sl->position.y, sl->position.z, sl->color.r, sl->color.g,
+                                                   sl->color.b, sl->direction.x, sl->direction.y, sl->direction.z,
+                                                   sl->cutoffAngle});
+
+    // Written under a temporary name so a crash never leaves a half-written cache behind
+    string temporary = path + ".tmp";
+    FILE *f = fopen(temporary.c_str(), "wb");
+    if (!f)
+    {
+        cerr << "Error: cannot write " << temporary << endl;
+        return false;
+    }
+    fwrite(&header, sizeof(header), 1, f);
+    writeSection(f, types);
+    writeSection(f, primitives);
+    writeSection(f, parameters);
+    writeSection(f, pointLightData);
+    writeSection(f, spotLightData);
+    writeSection(f, dependencyPaths);
+    writeSection(f, dependencies);
+    writeSection(f, meshVertices);
+    writeSection(f, meshIndices);
+    writeSection(f, meshNodes);
+    for (const vector<Real> *v : realArrays(scene))
+        writeSection(f, *v);
+    for (const vector<int> &v : scene.materialIds)
+        writeSection(f, v);
+    writeSection(f, scene.materials);
+    writeSection(f, scene.base, CompiledScene::TYPE_COUNT);
+    writeSection(f, bvh.nodes);
+    writeSection(f, bvh.unboundedFirst, CompiledScene::TYPE_COUNT);
+    writeSection(f, bvh.unboundedSize, CompiledScene::TYPE_COUNT);
+    header.fileSize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, f);
+    bool ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        cerr << "Error: cannot write " << path << endl;
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+bool SceneCache::load(const string &path, const string &source, int &level, vector<Object *> &objects,
+                      vector<PointLight *> &pointLights, vector<SpotLight *> &spotLights, BVH &bvh, string &reason)
+{
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    if (!sourceInfo(source, sourceSize, sourceMtime))
+    {
+        reason = "cannot stat " + source;
+        return false;
+    }
+    MappedFile file;
+    if (!file.open(path))
+    {
+        reason = "not found";
+        return false;
+    }
+    Header header;
+    if (file.size < sizeof(header))
+    {
+        reason = "truncated";
+        return false;
+    }
+    memcpy(&header, file.data, sizeof(header));
+    file.offset = sizeof(header);
+    if (memcmp(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != VERSION)
+    {
+        reason = "not a version " + to_string(VERSION) + " scene cache";
+        return false;
+    }
+    if (header.realSize != sizeof(Real))
+    {
+        reason = string("written by a ") + (header.realSize == sizeof(float) ? "float" : "double") + " build";
+        return false;
+    }
+    if (header.fileSize != file.size)
+    {
+        reason = "truncated";
+        return false;
+    }
+    // Same size and mtime is taken as unchanged; a new mtime alone (touch, checkout) falls back to the hash
+    if (header.sourceSize != sourceSize || (header.sourceMtime != sourceMtime && header.sourceHash != hashFile(source)))
+    {
+        reason = "stale, " + source + " changed since it was compiled";
+        return false;
+    }
+
+    // Everything is read into locals first, so a corrupt file leaves the caller's scene untouched
+    uint64_t objectCount = 0, parameterCount = 0, pointCount = 0, spotCount = 0;
+    const int *types = file.take<int>(objectCount);
+    uint64_t primitiveCount = 0;
+    const int *primitives = types ? file.take<int>(primitiveCount) : nullptr;
+    const double *parameters = primitives ? file.take<double>(parameterCount) : nullptr;
+    const double *pointData = parameters ? file.take<double>(pointCount) : nullptr;
+    const double *spotData = pointData ? file.take<double>(spotCount) : nullptr;
+    uint64_t pathBytes = 0, dependencyCount = 0, vertexCount = 0, indexCount = 0, nodeCount = 0;
+    const char *paths = spotData ? file.take<char>(pathBytes) : nullptr;
+    const uint64_t *dependencies = paths ? file.take<uint64_t>(dependencyCount) : nullptr;
+    const Point *meshVertices = dependencies ? file.take<Point>(vertexCount) : nullptr;
+    const uint32_t *meshIndices = meshVertices ? file.take<uint32_t>(indexCount) : nullptr;
+    const MeshNode *meshNodes = meshIndices ? file.take<MeshNode>(nodeCount) : nullptr;
+    BVH tree;
+    CompiledScene &scene = tree.scene;
+    bool ok = meshNodes && primitiveCount == objectCount && pointCount % 6 == 0 && spotCount % 10 == 0 &&
+              dependencyCount % 3 == 0 && (pathBytes == 0 || paths[pathBytes - 1] == '\0');
+    for (vector<Real> *v : realArrays(scene))
+        ok = ok && file.take(*v);
+    for (vector<int> &v : scene.materialIds)
+        ok = ok && file.take(v);
+    ok = ok && file.take(scene.materials) && file.take(scene.base, CompiledScene::TYPE_COUNT) && file.take(tree.nodes) &&
+         file.take(tree.unboundedFirst, CompiledScene::TYPE_COUNT) && file.take(tree.unboundedSize, CompiledScene::TYPE_COUNT);
+    if (!ok)
+    {
+        reason = "corrupt";
+        return false;
+    }
+    for (uint64_t i = 0, offset = 0; i < dependencyCount; i += 3)
+    {
+        string dependency(paths + offset);
+        offset += dependency.size() + 1;
+        uint64_t size;
+        int64_t mtime;
+        if (!sourceInfo(dependency, size, mtime) || size != dependencies[i] ||
+            ((uint64_t)mtime != dependencies[i + 1] && hashFile(dependency) != dependencies[i + 2]))
+        {
+            reason = "stale, " + dependency + " changed since it was compiled";
+            return false;
+        }
+    }
+
+    int total = 0, counts[RECORD_COUNT] = {}, scenePrimitives = 0;
+    for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+        total += scene.count(type);
+    for (uint64_t k = 0; k < objectCount; k++)
+    {
+        ok = ok && types[k] >= 0 && types[k] < RECORD_COUNT && primitives[k] >= -1 && primitives[k] < total;
+        if (ok)
+        {
+            counts[types[k]]++; // prototypes included, so the vectors below never reallocate under a pointer
+            scenePrimitives += primitives[k] >= 0;
+        }
+    }
+    if (!ok || scenePrimitives != total)
+    {
+        reason = "corrupt";
+        return false;
+    }
+    vector<Sphere> newSpheres;
+    vector<Triangle> newTriangles;
+    vector<QuadraticSurface> newQuadrics;
+    vector<Floor> newFloors;
+    vector<Mesh> newMeshes;
+    newSpheres.reserve(counts[RECORD_SPHERE]);
+    newTriangles.reserve(counts[RECORD_TRIANGLE]);
+    newQuadrics.reserve(counts[RECORD_QUADRIC]);
+    newFloors.reserve(counts[RECORD_FLOOR]);
+    newMeshes.reserve(counts[RECORD_MESH]);
+    vector<Instance> newInstances;
+    newInstances.reserve(counts[RECORD_INSTANCE]);
+    vector<Object *> newObjects, records(objectCount, nullptr);
+    newObjects.reserve(total);
+    scene.sources.assign(total, nullptr);
+    uint64_t used = 0, vertexOffset = 0, indexOffset = 0, nodeOffset = 0, dependency = 0, pathOffset = 0;
+    for (uint64_t k = 0; k < objectCount; k++)
+    {
+        const double *p = parameters + used;
+        bool prototype = primitives[k] < 0;
+        used += RECORD_PARAMETERS[types[k]] + (prototype ? PROTOTYPE_MATERIAL_PARAMETERS : 0);
+        if (used > parameterCount || (!prototype && scene.sources[primitives[k]]))
+        {
+            reason = "corrupt";
+            return false;
+        }
+        Object *o;
+        if (types[k] == RECORD_SPHERE)
+        {
+            newSpheres.emplace_back(Point(p[0], p[1], p[2]), p[3]);
+            o = &newSpheres.back();
+        }
+        else if (types[k] == RECORD_TRIANGLE)
+        {
+            newTriangles.emplace_back(Point(p[0], p[1], p[2]), Point(p[3], p[4], p[5]), Point(p[6], p[7], p[8]));
+            o = &newTriangles.back();
+        }
+        else if (types[k] == RECORD_QUADRIC)
+        {
+            newQuadrics.emplace_back(Point(p[0], p[1], p[2]), p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[11],
+                                     p[12], p[13], p[14], p[15]);
+            o = &newQuadrics.back();
+        }
+        else if (types[k] == RECORD_FLOOR)
+        {
+            newFloors.emplace_back(p[0], p[1]);
+            o = &newFloors.back();
+        }
+        else if (types[k] == RECORD_INSTANCE)
+        {
+            uint64_t target = p[0];
+            double rows[16] = {p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[11], p[12], 0, 0, 0, 1};
+            Transform toWorld;
+            toWorld.setRows(rows);
+            if (target >= k || primitives[target] >= 0 || toWorld.determinant() == 0)
+            {
+                reason = "corrupt";
+                return false;
+            }
+            newInstances.emplace_back(records[target], toWorld);
+            o = &newInstances.back();
+        }
+        else
+        {
+            uint64_t vertices = p[0], indices = p[1], nodes = p[2];
+            if (vertexOffset + vertices > vertexCount || indexOffset + indices > indexCount ||
+                nodeOffset + nodes > nodeCount || 3 * dependency >= dependencyCount || pathOffset >= pathBytes)
+            {
+                reason = "corrupt";
+                return false;
+            }
+            newMeshes.emplace_back();
+            Mesh &mesh = newMeshes.back();
+            mesh.vertices.assign(meshVertices + vertexOffset, meshVertices + vertexOffset + vertices);
+            mesh.indices.assign(meshIndices + indexOffset, meshIndices + indexOffset + indices);
+            mesh.nodes.assign(meshNodes + nodeOffset, meshNodes + nodeOffset + nodes);
+            mesh.path = paths + pathOffset;
+            pathOffset += mesh.path.size() + 1;
+            vertexOffset += vertices;
+            indexOffset += indices;
+            nodeOffset += nodes;
+            dependency++;
+            o = &mesh;
+        }
+        records[k] = o;
+        if (prototype)
+        {
+            const double *m = p + RECORD_PARAMETERS[types[k]];
+            o->setColor(Color(m[0], m[1], m[2]));
+            o->setCoefficients(m[3], m[4], m[5], m[6], (int)m[7]);
+            continue;
+        }
+        const Material &m = scene.materials.at(scene.materialOf(primitives[k]));
+        o->setColor(m.color);
+        o->setCoefficients(m.ambient, m.diffuse, m.specular, m.reflectionCoefficient, m.shine);
+        scene.sources[primitives[k]] = o;
+        newObjects.push_back(o);
+    }
+    for (int i = 0; i < scene.count(CompiledScene::OBJECT); i++)
+        scene.otherObjects.push_back(scene.sources[scene.base[CompiledScene::OBJECT] + i]);
+    scene.classifyQuadrics();
+
+    release();
+    spheres.swap(newSpheres); // swapping keeps the element addresses handed to the BVH
+    triangles.swap(newTriangles);
+    quadrics.swap(newQuadrics);
+    floors.swap(newFloors);
+    meshes.swap(newMeshes);
+    instances.swap(newInstances);
+    objects.insert(objects.end(), newObjects.begin(), newObjects.end());
+    for (uint64_t i = 0; i < pointCount; i += 6)
+    {
+        const double *p = pointData + i;
+        pointLights.push_back(new PointLight(Point(p[0], p[1], p[2]), Color(p[3], p[4], p[5])));
+    }
+    for (uint64_t i = 0; i < spotCount; i += 10)
+    {
+        const double *p = spotData + i;
+        SpotLight *sl = new SpotLight(Point(p[0], p[1], p[2]), Vector(p[6], p[7], p[8]), p[9], Color(p[3], p[4], p[5]));
+        sl->direction = Vector(p[6], p[7], p[8]); // already normalized when it was written
+        spotLights.push_back(sl);
+    }
+    bvh = move(tree);
+    level = header.level;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                               RenderStats                                                      //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+thread_local RenderStats RenderStats::local;
+void RenderStats::clear() { *this = RenderStats(); }
+void RenderStats::merge(const RenderStats &other)
+{
+    primaryRays += other.primaryRays;
+    shadowRays += other.shadowRays;
+    reflectionRays += other.reflectionRays;
+    missedPixels += other.missedPixels;
+    for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+        tests[type] += other.tests[type];
+    nodesVisited += other.nodesVisited;
+}
+long long RenderStats::totalTests() const
+{
+    long long n = 0;
+    for (int type = 0; type < CompiledScene::TYPE_COUNT; type++)
+        n += tests[type];
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                 GBuffer                                                        //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// FNV-1a over every object's geometry, in order; materials and lights are left out
+uint64_t GBuffer::geometrySignature(const vector<Object *> &objects)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const Object *object : objects)
+    {
+        uint64_t h = FrameDependencies::objectGeometry(object);
+        for (int i = 0; i < 8; i++)
+            hash = (hash ^ ((h >> (8 * i)) & 0xff)) * 1099511628211ULL;
+    }
+    return hash;
+}
+bool GBuffer::matches(const vector<double> &view, uint64_t geometry) const
+{
+    return valid && this->view == view && this->geometry == geometry;
+}
+void GBuffer::reset(int width, int height, const vector<double> &view, uint64_t geometry,
+                    const vector<Object *> &objects)
+{
+    this->width = width;
+    this->height = height;
+    this->view = view;
+    this->geometry = geometry;
+    valid = false;
+    samples.assign((size_t)width * height, Sample());
+    indexOf.clear();
+    for (int i = 0; i < (int)objects.size(); i++)
+        indexOf[objects[i]] = i;
+}
+void GBuffer::update(uint64_t geometry, const vector<Object *> &objects)
+{
+    this->geometry = geometry;
+    valid = false;
+    indexOf.clear();
+    for (int i = 0; i < (int)objects.size(); i++)
+        indexOf[objects[i]] = i;
+}
+void GBuffer::finish()
+{
+    valid = true;
+    unordered_map<const Object *, int>().swap(indexOf);
+}
+void GBuffer::clear()
+{
+    vector<Sample>().swap(samples);
+    unordered_map<const Object *, int>().swap(indexOf);
+    width = height = 0;
+    valid = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                            FrameDependencies                                                   //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+thread_local DependencyRecorder DependencyRecorder::local;
+bool FrameDependencies::recording = false;
+AABB FrameDependencies::recordingWorld;
+
+void DependencyRecorder::clear()
+{
+    touched.clear();
+    shading = AABB();
+    reflections = AABB();
+}
+void DependencyRecorder::hit(const Object *object, const Point &p)
+{
+    touched.push_back(object);
+    shading.expand(p);
+}
+void DependencyRecorder::reflection(const Point &from, const Point &to)
+{
+    Point a, b;
+    if (FrameDependencies::recordingWorld.clip(from, to, a, b))
+    {
+        reflections.expand(a);
+        reflections.expand(b);
+    }
+}
+
+static void fnv(uint64_t &hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+}
+uint64_t FrameDependencies::objectGeometry(const Object *object)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    const char *type = typeid(*object).name();
+    fnv(hash, type, strlen(type));
+    vector<double> values;
+    if (const Sphere *s = dynamic_cast<const Sphere *>(object))
+        values = {s->referencePoint.x, s->referencePoint.y, s->referencePoint.z, s->radius};
+    else if (const Triangle *t = dynamic_cast<const Triangle *>(object))
+        values = {t->p1.x, t->p1.y, t->p1.z, t->p2.x, t->p2.y, t->p2.z, t->p3.x, t->p3.y, t->p3.z};
+    else if (const QuadraticSurface *q = dynamic_cast<const QuadraticSurface *>(object))
+    {
+        values = {q->A, q->B, q->C, q->D, q->E, q->F, q->G, q->H, q->I, q->J};
+        double clip[6];
+        q->getClip(clip);
+        values.insert(values.end(), clip, clip + 6);
+    }
+    else
+    {
+        // Meshes and instances by their bounds, the floor by its corner
+        AABB box;
+        if (object->getBoundingBox(box))
+            values = {box.minPoint.x, box.minPoint.y, box.minPoint.z, box.maxPoint.x, box.maxPoint.y, box.maxPoint.z};
+        else
+            values = {object->referencePoint.x, object->referencePoint.y, object->referencePoint.z};
+    }
+    fnv(hash, values.data(), values.size() * sizeof(double));
+    return hash;
+}
+uint64_t FrameDependencies::objectMaterial(const Object *object)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    double values[8] = {object->color.r, object->color.g, object->color.b, object->ambient, object->diffuse,
+                        object->specular, object->reflectionCoefficient, (double)object->shine};
+    fnv(hash, values, sizeof(values));
+    if (const Floor *floor = dynamic_cast<const Floor *>(object))
+        fnv(hash, &floor->useTexture, sizeof(floor->useTexture));
+    return hash;
+}
+uint64_t FrameDependencies::lightSignature(const vector<PointLight *> &pointLights, const vector<SpotLight *> &spotLights)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const PointLight *p : pointLights)
+    {
+        double values[6] = {p->position.x, p->position.y, p->position.z, p->color.r, p->color.g, p->color.b};
+        fnv(hash, values, sizeof(values));
+    }
+    for (const SpotLight *s : spotLights)
+    {
+        double values[10] = {s->position.x, s->position.y, s->position.z, s->color.r, s->color.g, s->color.b,
+                             s->direction.x, s->direction.y, s->direction.z, s->cutoffAngle};
+        fnv(hash, values, sizeof(values));
+    }
+    return hash;
+}
+void FrameDependencies::reset(int tileSize, int width, int height, const vector<double> &view,
+                              const vector<Object *> &objects, const vector<PointLight *> &pointLights,
+                              const vector<SpotLight *> &spotLights)
+{
+    this->tileSize = tileSize;
+    this->width = width;
+    this->height = height;
+    this->view = view;
+    tilesX = (width + tileSize - 1) / tileSize;
+    tilesY = (height + tileSize - 1) / tileSize;
+    tiles.assign((size_t)tilesX * tilesY, TileDependencies());
+    lights = lightSignature(pointLights, spotLights);
+    valid = false;
+    update(objects);
+    // Padded so that small moves stay inside; a change that leaves it renders everything
+    world = AABB();
+    for (const AABB &box : bounds)
+        if (box.minPoint.x <= box.maxPoint.x)
+            world.expand(box);
+    if (world.minPoint.x <= world.maxPoint.x)
+    {
+        double size = max(world.extent(0), max(world.extent(1), world.extent(2)));
+        world.pad(0.25 * size + 1.0);
+    }
+}
+void FrameDependencies::update(const vector<Object *> &objects)
+{
+    geometry.resize(objects.size());
+    materials.resize(objects.size());
+    bounds.assign(objects.size(), AABB());
+    for (size_t i = 0; i < objects.size(); i++)
+    {
+        geometry[i] = objectGeometry(objects[i]);
+        materials[i] = objectMaterial(objects[i]);
+        objects[i]->getBoundingBox(bounds[i]);
+    }
+}
+bool FrameDependencies::changes(const vector<double> &view, const vector<Object *> &objects,
+                                const vector<PointLight *> &pointLights, const vector<SpotLight *> &spotLights,
+                                vector<int> &changed, vector<char> &moved) const
+{
+    changed.clear();
+    moved.clear();
+    if (!valid || this->view != view || objects.size() != geometry.size() ||
+        lightSignature(pointLights, spotLights) != lights)
+        return false;
+    for (size_t i = 0; i < objects.size(); i++)
+    {
+        bool geometryChanged = objectGeometry(objects[i]) != geometry[i];
+        if (!geometryChanged && objectMaterial(objects[i]) == materials[i])
+            continue;
+        AABB box;
+        // A change that no tile's rays can be checked against: an unbounded object moved, or one left the world box
+        if (geometryChanged && (!objects[i]->getBoundingBox(box) || !world.contains(box)))
+            return false;
+        changed.push_back(i);
+        moved.push_back(geometryChanged);
+    }
+    return true;
+}
+// Distance from p to the segment a-b
+static double segmentDistance(const Point &p, const Point &a, const Point &b)
+{
+    Vector ab = b - a;
+    double length2 = ab.dot(ab);
+    double u = length2 > 0 ? max(0.0, min(1.0, (double)(p - a).dot(ab) / length2)) : 0.0;
+    return p.distance(a + ab * u);
+}
+bool FrameDependencies::affects(int t, int index, bool moved, const AABB &newBounds,
+                                const vector<PointLight *> &pointLights, const vector<SpotLight *> &spotLights) const
+{
+    const TileDependencies &tile = tiles[t];
+    if (binary_search(tile.objects.begin(), tile.objects.end(), index) ||
+        (!tile.objects.empty() && tile.objects[0] == -1))
+        return true;
+    if (!moved)
+        return false; // a new material only shows where the object was already seen
+    if (tile.reflections.overlaps(newBounds))
+        return true;
+    if (tile.shadingRadius < 0)
+        return false;
+    // Shadow rays run from the shading points to the lights: inside capsules around the centre-to-light segments
+    Point center = newBounds.centroid();
+    double reach = tile.shadingRadius + center.distance(newBounds.maxPoint);
+    for (const PointLight *p : pointLights)
+        if (segmentDistance(center, tile.shadingCenter, p->position) <= reach)
+            return true;
+    for (const SpotLight *s : spotLights)
+        if (segmentDistance(center, tile.shadingCenter, s->position) <= reach)
+            return true;
+    return false;
+}
+void FrameDependencies::store(const Tile &tile, DependencyRecorder &recorder,
+                              const unordered_map<const Object *, int> &objectIndex)
+{
+    TileDependencies &record = tiles[tileOf(tile.x0, tile.y0)];
+    sort(recorder.touched.begin(), recorder.touched.end());
+    recorder.touched.erase(unique(recorder.touched.begin(), recorder.touched.end()), recorder.touched.end());
+    record.objects.clear();
+    for (const Object *object : recorder.touched)
+    {
+        auto found = objectIndex.find(object);
+        record.objects.push_back(found != objectIndex.end() ? found->second : -1); // -1: affected by any change
+    }
+    sort(record.objects.begin(), record.objects.end());
+    record.objects.erase(unique(record.objects.begin(), record.objects.end()), record.objects.end());
+    if (recorder.shading.minPoint.x <= recorder.shading.maxPoint.x)
+    {
+        record.shadingCenter = recorder.shading.centroid();
+        record.shadingRadius = record.shadingCenter.distance(recorder.shading.maxPoint);
+    }
+    else
+        record.shadingRadius = -1.0;
+    record.reflections = recorder.reflections;
+    recorder.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                              TileScheduler                                                     //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+static unsigned int mortonCode(unsigned int x, unsigned int y)
+{
+    unsigned int code = 0;
+    for (int bit = 0; bit < 16; bit++)
+        code |= ((x >> bit) & 1u) << (2 * bit) | ((y >> bit) & 1u) << (2 * bit + 1);
+    return code;
+}
+// A thread's remaining run of tiles is packed into one word, [begin, end) = (high 32 bits, low 32 bits),
+// so the owner taking from the front and a thief cutting off the back agree through a single CAS
+static unsigned long long packRange(unsigned int begin, unsigned int end) { return (unsigned long long)begin << 32 | end; }
+
+TileScheduler::TileScheduler(int tileSize, int numThreads)
+    : tileSize(max(1, tileSize)), numThreads(numThreads)
+{
+    if (this->numThreads <= 0)
+        this->numThreads = max(1u, thread::hardware_concurrency());
+}
+void TileScheduler::makeTiles(int width, int height) { makeTiles(Tile(0, 0, width, height)); }
+void TileScheduler::makeTiles(const Tile &region)
+{
+    tiles.clear();
+    vector<pair<unsigned int, Tile>> ordered;
+    for (int ty = 0; region.y0 + ty * tileSize < region.y1; ty++)
+    {
+        for (int tx = 0; region.x0 + tx * tileSize < region.x1; tx++)
+        {
+            int x0 = region.x0 + tx * tileSize, y0 = region.y0 + ty * tileSize;
+            Tile tile(x0, y0, min(region.x1, x0 + tileSize), min(region.y1, y0 + tileSize));
+            if (!filter || filter(tile))
+                ordered.push_back({mortonCode(tx, ty), tile});
+        }
+    }
+    sort(ordered.begin(), ordered.end(), [](const pair<unsigned int, Tile> &a, const pair<unsigned int, Tile> &b)
+         { return a.first < b.first; });
+    for (auto &entry : ordered)
+        tiles.push_back(entry.second);
+}
+void TileScheduler::run(const function<void(const Tile &tile, int thread)> &renderTile)
+{
+    int n = numThreads;
+    // Counters add up over runs, e.g. the bands of one image
+    if ((int)busyTime.size() != n)
+    {
+        busyTime.assign(n, 0.0);
+        tilesRendered.assign(n, 0);
+        steals.assign(n, 0);
+    }
+    vector<atomic<unsigned long long>> ranges(n);
+    for (int i = 0; i < n; i++)
+        ranges[i].store(packRange(tiles.size() * i / n, tiles.size() * (i + 1) / n));
+
+    auto worker = [&](int self)
+    {
+        while (true)
+        {
+            // Cancelling stops at tile boundaries: tiles already started finish
+            if (cancel && cancel->load(memory_order_relaxed))
+                return;
+            // Take the next tile from the front of our own run
+            unsigned long long range = ranges[self].load();
+            unsigned int begin = range >> 32, end = range & 0xffffffffu;
+            if (begin < end)
+            {
+                if (!ranges[self].compare_exchange_weak(range, packRange(begin + 1, end)))
+                    continue;
+                auto start = chrono::steady_clock::now();
+                renderTile(tiles[begin], self);
+                busyTime[self] += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+                tilesRendered[self]++;
+                continue;
+            }
+            // Out of work: steal the back half of the longest remaining run
+            int victim = -1;
+            unsigned int longest = 0;
+            for (int i = 0; i < n; i++)
+            {
+                unsigned long long r = ranges[i].load();
+                unsigned int length = (r & 0xffffffffu) > (r >> 32) ? (r & 0xffffffffu) - (r >> 32) : 0;
+                if (length > longest)
+                {
+                    longest = length;
+                    victim = i;
+                }
+            }
+            if (victim == -1)
+                return;
+            unsigned long long r = ranges[victim].load();
+            unsigned int vBegin = r >> 32, vEnd = r & 0xffffffffu;
+            if (vBegin >= vEnd)
+                continue;
+            unsigned int split = vEnd - (vEnd - vBegin + 1) / 2;
+            if (ranges[victim].compare_exchange_strong(r, packRange(vBegin, split)))
+            {
+                ranges[self].store(packRange(split, vEnd)); // our run is empty, nobody else writes it
+                steals[self]++;
+            }
+        }
+    };
+    if (n == 1)
+    {
+        worker(0);
+        return;
+    }
+    {
+        lock_guard<mutex> lock(poolMutex);
+        poolJob = worker;
+        poolBusy = n - 1;
+        poolGeneration++;
+    }
+    poolWake.notify_all();
+    for (int i = (int)pool.size() + 1; i < n; i++)
+        pool.emplace_back(&TileScheduler::poolLoop, this, i);
+    worker(0);
+    unique_lock<mutex> lock(poolMutex);
+    poolDone.wait(lock, [&] { return poolBusy == 0; });
+    poolJob = nullptr; // it refers to this call's locals
+}
+void TileScheduler::poolLoop(int self)
+{
+    long long seen = 0;
+    while (true)
+    {
+        function<void(int)> job;
+        {
+            unique_lock<mutex> lock(poolMutex);
+            poolWake.wait(lock, [&] { return poolStopping || poolGeneration != seen; });
+            if (poolStopping)
+                return;
+            seen = poolGeneration;
+            job = poolJob;
+        }
+        job(self);
+        lock_guard<mutex> lock(poolMutex);
+        if (--poolBusy == 0)
+            poolDone.notify_one();
+    }
+}
+TileScheduler::~TileScheduler()
+{
+    {
+        lock_guard<mutex> lock(poolMutex);
+        poolStopping = true;
+    }
+    poolWake.notify_all();
+    for (thread &t : pool)
+        t.join();
+}
+void TileScheduler::printStats() const
+{
+    double total = 0.0, longest = 0.0;
+    for (double t : busyTime)
+    {
+        total += t;
+        longest = max(longest, t);
+    }
+    double average = busyTime.empty() ? 0.0 : total / busyTime.size();
+    long long rendered = 0;
+    for (int count : tilesRendered)
+        rendered += count;
+    cout << "Scheduler: " << rendered << " tiles of " << tileSize << "x" << tileSize << " on " << numThreads
+         << " threads, imbalance (max/avg busy) " << (average > 0 ? longest / average : 1.0) << endl;
+    for (int i = 0; i < (int)busyTime.size(); i++)
+        cout << "  thread " << i << ": busy " << busyTime[i] << " ms, " << tilesRendered[i] << " tiles, "
+             << steals[i] << " steals" << endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                               Connection                                                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+Connection::~Connection() { close(); }
+void Connection::close()
+{
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+    buffer.clear();
+}
+int Connection::listenOn(int port)
+{
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        cerr << "Error: cannot create a socket" << endl;
+        return -1;
+    }
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (::bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0)
+    {
+        cerr << "Error: cannot listen on port " << port << endl;
+        ::close(listener);
+        return -1;
+    }
+    return listener;
+}
+bool Connection::acceptFrom(int listener, int timeoutMs)
+{
+    pollfd waiting = {listener, POLLIN, 0};
+    if (poll(&waiting, 1, timeoutMs) <= 0)
+        return false;
+    sockaddr_in address = {};
+    socklen_t size = sizeof(address);
+    int client = accept(listener, (sockaddr *)&address, &size);
+    if (client < 0)
+        return false;
+    close();
+    fd = client;
+    char host[INET_ADDRSTRLEN] = "?";
+    inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+    peer = string(host) + ":" + to_string(ntohs(address.sin_port));
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)); // tile requests are tiny and latency-bound
+    return true;
+}
+bool Connection::connectTo(const string &host, int port)
+{
+    close();
+    addrinfo hints = {}, *found = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &found) != 0 || !found)
+        return false;
+    fd = socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+    bool ok = fd >= 0 && connect(fd, found->ai_addr, found->ai_addrlen) == 0;
+    freeaddrinfo(found);
+    if (!ok)
+    {
+        close();
+        return false;
+    }
+    peer = host + ":" + to_string(port);
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return true;
+}
+bool Connection::sendBytes(const void *data, size_t size)
+{
+    const char *p = (const char *)data;
+    while (size > 0)
+    {
+        ssize_t sent = send(fd, p, size, 0);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        p += sent;
+        size -= sent;
+    }
+    return true;
+}
+bool Connection::sendLine(const string &line)
+{
+    string message = line + "\n";
+    return sendBytes(message.data(), message.size());
+}
+int Connection::readLine(string &line, int timeoutMs)
+{
+    while (true)
+    {
+        size_t end = buffer.find('\n');
+        if (end != string::npos)
+        {
+            line = buffer.substr(0, end);
+            buffer.erase(0, end + 1);
+            return 1;
+        }
+        pollfd waiting = {fd, POLLIN, 0};
+        int ready = poll(&waiting, 1, timeoutMs);
+        if (ready == 0)
+            return 0;
+        if (ready < 0 && errno == EINTR)
+            continue;
+        char chunk[4096];
+        ssize_t received = ready < 0 ? -1 : recv(fd, chunk, sizeof(chunk), 0);
+        if (received <= 0)
+            return -1;
+        buffer.append(chunk, received);
+    }
+}
+int Connection::readBytes(void *data, size_t size, int timeoutMs)
+{
+    // Bytes collect in buffer, so a call that timed out picks up where it left off
+    while (buffer.size() < size)
+    {
+        pollfd waiting = {fd, POLLIN, 0};
+        int ready = poll(&waiting, 1, timeoutMs);
+        if (ready == 0)
+            return 0;
+        if (ready < 0 && errno == EINTR)
+            continue;
+        char chunk[65536];
+        ssize_t received = ready < 0 ? -1 : recv(fd, chunk, min(sizeof(chunk), size - buffer.size()), 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return -1;
+        buffer.append(chunk, received);
+    }
+    memcpy(data, buffer.data(), size);
+    buffer.erase(0, size);
+    return 1;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //                                                 Matrix                                                         //
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
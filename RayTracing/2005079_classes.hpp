@@ -1,25 +1,79 @@
 #include <string>
 #include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <map>
+#include <unordered_map>
+#include <cmath>
+#include <climits>
+#include <cstdio>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <limits>
+#include <algorithm>
 #include <GLUT/glut.h>
 
-class Point;
-class Vector;
+// Scalar type of the renderer's geometry, rays and packets: build with -DRT_FLOAT for single precision
+#ifdef RT_FLOAT
+typedef float Real;
+#else
+typedef double Real;
+#endif
+
+template <typename T>
+class Point3;
+template <typename T>
+class Vec3;
+template <typename T>
+class Color3;
+typedef Point3<Real> Point;
+typedef Vec3<Real> Vector;
+typedef Color3<Real> Color;
+
 class Plane;
 class Camera;
-class Color;
+class CameraPath;
 class Object;
 class Sphere;
 class Triangle;
 class QuadraticSurface;
 class Floor;
+class Mesh;
+class MeshNode;
+class Transform;
+class Instance;
+class PreviewMesh;
+class Texture;
 class Ray;
+class RayPacket;
 class Light;
 class PointLight;
 class SpotLight;
+class AABB;
+class Material;
+class Hit;
+class CompiledScene;
+class BVHNode;
+class BVH;
+class Tile;
+class TileScheduler;
+class OcclusionCache;
+class RenderStats;
+class GBuffer;
+class DependencyRecorder;
+class TileDependencies;
+class FrameDependencies;
+class SceneCache;
+class Connection;
 
 extern std::vector<Object *> objects;
 extern std::vector<PointLight *> pointLights;
 extern std::vector<SpotLight *> spotLights;
+extern BVH bvh;
 
 // template <typename T>
 // T clamp(T value, T low, T high)
@@ -30,60 +84,151 @@ extern std::vector<SpotLight *> spotLights;
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //                                                  Point                                                         //
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-class Point
+template <typename T>
+class Point3 // trivially copyable, instantiated as float or double through Real
 {
 public:
-    double x, y, z;
+    T x, y, z;
 
-    Point(double x = 0.0, double y = 0.0, double z = 0.0)
+    Point3(T x = 0, T y = 0, T z = 0)
         : x(x), y(y), z(z) {}
-    Point(const Point &p)
-        : x(p.x), y(p.y), z(p.z) {}
-
-    Vector operator-(const Point &p) const;
-    Point operator+(const Vector &v) const;
-    Point operator-(const Vector &v) const;
-    Point operator+=(const Vector &v);
-    Point operator-=(const Vector &v);
-    double distance(const Point &p) const;
-    Vector toVector() const;
-    void print() const;
+
+    Vec3<T> operator-(const Point3 &p) const { return Vec3<T>(x - p.x, y - p.y, z - p.z); }
+    Point3 operator+(const Vec3<T> &v) const { return Point3(x + v.x, y + v.y, z + v.z); }
+    Point3 operator-(const Vec3<T> &v) const { return Point3(x - v.x, y - v.y, z - v.z); }
+    Point3 &operator+=(const Vec3<T> &v)
+    {
+        x += v.x;
+        y += v.y;
+        z += v.z;
+        return *this;
+    }
+    Point3 &operator-=(const Vec3<T> &v)
+    {
+        x -= v.x;
+        y -= v.y;
+        z -= v.z;
+        return *this;
+    }
+    T distance(const Point3 &p) const
+    {
+        return std::sqrt((x - p.x) * (x - p.x) +
+                         (y - p.y) * (y - p.y) +
+                         (z - p.z) * (z - p.z));
+    }
+    Vec3<T> toVector() const { return Vec3<T>(x, y, z); }
+    void print() const { std::cout << "Point(" << x << ", " << y << ", " << z << ")" << std::endl; }
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //                                                  Vector                                                        //
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-class Vector
+template <typename T>
+class Vec3 // trivially copyable, instantiated as float or double through Real
 {
 public:
-    double x, y, z;
+    T x, y, z;
 
-    Vector(double x = 0.0, double y = 0.0, double z = 0.0)
+    Vec3(T x = 0, T y = 0, T z = 0)
         : x(x), y(y), z(z) {}
-    Vector(const Vector &v) : x(v.x), y(v.y), z(v.z) {}
-
-    Vector operator=(const Vector &v);
-    Vector operator+(const Vector &v) const;
-    Vector operator-(const Vector &v) const;
-    Vector operator*(const double &d) const;
-    Vector operator/(const double &d) const;
-    Vector operator+=(const Vector &v);
-    Vector operator+=(const double &d);
-    Vector operator-=(const double &d);
-    Vector operator-=(const Vector &v);
-    Vector operator*=(const double &d);
-    Vector operator/=(const double &d);
-    double dot(const Vector &v) const;
-    Vector cross(const Vector &v) const;
-    Vector normalize() const;
-    Vector rotate(const Vector &axis, double angle) const;
-    Vector rotateAroundAxis(const Vector &axis, double angle);
-    double norm() const;
-    Vector reflect(const Plane &plane) const;
-    Vector reflect(const Vector &normal) const;
-    void print() const;
+
+    Vec3 operator+(const Vec3 &v) const { return Vec3(x + v.x, y + v.y, z + v.z); }
+    Vec3 operator-(const Vec3 &v) const { return Vec3(x - v.x, y - v.y, z - v.z); }
+    Vec3 operator*(T d) const { return Vec3(x * d, y * d, z * d); }
+    Vec3 operator/(T d) const
+    {
+        if (d == 0)
+            throw std::invalid_argument("Division by zero is not allowed.");
+        return Vec3(x / d, y / d, z / d);
+    }
+    Vec3 &operator+=(const Vec3 &v)
+    {
+        x += v.x;
+        y += v.y;
+        z += v.z;
+        return *this;
+    }
+    Vec3 &operator+=(T d)
+    {
+        x += d;
+        y += d;
+        z += d;
+        return *this;
+    }
+    Vec3 &operator-=(T d)
+    {
+        x -= d;
+        y -= d;
+        z -= d;
+        return *this;
+    }
+    Vec3 &operator-=(const Vec3 &v)
+    {
+        x -= v.x;
+        y -= v.y;
+        z -= v.z;
+        return *this;
+    }
+    Vec3 &operator*=(T d)
+    {
+        x *= d;
+        y *= d;
+        z *= d;
+        return *this;
+    }
+    Vec3 &operator/=(T d)
+    {
+        if (d == 0)
+            throw std::invalid_argument("Division by zero is not allowed.");
+        x /= d;
+        y /= d;
+        z /= d;
+        return *this;
+    }
+    T dot(const Vec3 &v) const { return x * v.x + y * v.y + z * v.z; }
+    Vec3 cross(const Vec3 &v) const
+    {
+        return Vec3(
+            y * v.z - z * v.y,
+            z * v.x - x * v.z,
+            x * v.y - y * v.x);
+    }
+    T norm() const { return std::sqrt(x * x + y * y + z * z); }
+    Vec3 normalize() const
+    {
+        T len = norm();
+        if (len == 0)
+            return Vec3(0, 0, 0);
+        return Vec3(x / len, y / len, z / len);
+    }
+    Vec3 rotate(const Vec3 &axis, double angle) const
+    {
+        T cosTheta = std::cos(angle);
+        T sinTheta = std::sin(angle);
+        Vec3 normalizedAxis = axis.normalize();
+        return *this * cosTheta +
+               (normalizedAxis.cross(*this)) * sinTheta +
+               normalizedAxis * (normalizedAxis.dot(*this)) * (1 - cosTheta);
+    }
+    Vec3 rotateAroundAxis(const Vec3 &axis, double angle)
+    {
+        *this = rotate(axis, angle);
+        return *this;
+    }
+    Vec3 reflect(const Plane &plane) const;
+    Vec3 reflect(const Vec3 &normal) const { return *this - normal * (2 * this->dot(normal)); }
+    void print() const { printf("Vector: (%.2f, %.2f, %.2f)\n", (double)x, (double)y, (double)z); }
 };
 
+// How far a ray leaving a surface at p must skip before it may hit again: a fixed number of Real ulps of the
+// larger of p's coordinates and the distance t it travelled to get there. Never below the 1e-6 the double renderer
+// has always used, so double builds are unchanged while float builds get a step wide enough to avoid shadow acne.
+inline double surfaceEpsilon(const Point &p, double t = 0.0)
+{
+    double scale = std::max(std::max(std::fabs((double)p.x), std::fabs((double)p.y)), std::max(std::fabs((double)p.z), t));
+    return std::max(1e-6, scale * std::numeric_limits<Real>::epsilon() * 256);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //                                                  Plane                                                         //
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -103,6 +248,13 @@ public:
     double intersect(const Ray &r) const;
 };
 
+template <typename T>
+Vec3<T> Vec3<T>::reflect(const Plane &plane) const
+{
+    Vec3<T> normal = plane.normal.normalize();
+    return *this - normal * (2 * this->dot(normal));
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //                                                  Camera                                                        //
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -143,23 +295,67 @@ public:
     void moveDown_wo_refPoint();
 };
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                              CameraPath                                                        //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Camera keyframes for sequence rendering, spaced evenly over the frames and joined by Catmull-Rom splines. A path
+// whose last key repeats the first is closed: it wraps around smoothly and its last frame stops one step short of the
+// first, so the sequence loops.
+class CameraPath
+{
+public:
+    std::vector<Point> eyes, centers;
+    std::vector<Vector> ups;
+    bool closed = false;
+
+    bool load(const std::string &path); // key count, then eye, center and up (three numbers each) per key
+    void at(int frame, int frames, Camera &camera) const; // sets eye, center and up for frame [0, frames)
+};
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //                                                  Color                                                         //
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-class Color
+template <typename T>
+class Color3 // trivially copyable, instantiated as float or double through Real
 {
 public:
-    std::string name;
-    double r, g, b;
+    T r, g, b;
 
-    Color(double r = 0.0, double g = 0.0, double b = 0.0)
+    Color3(T r = 0, T g = 0, T b = 0)
         : r(r), g(g), b(b) {}
 
-    Color operator+(const Color &c) const;
-    Color operator*(const double &d) const;
-    Color operator*(const Color &c) const;
-    void clamp();
-    void print() const;
+    Color3 operator+(const Color3 &c) const { return Color3(r + c.r, g + c.g, b + c.b); }
+    Color3 operator*(T d) const { return Color3(r * d, g * d, b * d); }
+    Color3 operator*(const Color3 &c) const { return Color3(r * c.r, g * c.g, b * c.b); }
+    void clamp()
+    {
+        r = std::max(T(0), std::min(T(1), r));
+        g = std::max(T(0), std::min(T(1), g));
+        b = std::max(T(0), std::min(T(1), b));
+    }
+    void print() const { std::cout << "Color(" << r << ", " << g << ", " << b << ")\n"; }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                              PreviewMesh                                                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+class PreviewMesh // preview geometry built once on the CPU, then drawn with a single call every frame
+{
+public:
+    GLenum mode = GL_TRIANGLES;
+    std::vector<GLfloat> vertices;  // xyz per vertex, released once uploaded
+    std::vector<GLfloat> texCoords; // st per vertex, or empty
+    int count = 0;                  // vertices uploaded
+    bool textured = false;
+    GLuint buffer = 0; // vertex buffer object (GL 1.5 and later)
+    GLuint list = 0;   // display list, the fallback on older GL
+
+    bool ready() const;
+    void upload(); // needs a current GL context
+    void draw() const;
+    void release();
+
+    static PreviewMesh &unitSphere(); // shared by every sphere and light marker in the preview
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -170,9 +366,9 @@ class Object
 public:
     Point referencePoint;
     Color color;
-    double width, height, length;
-    double ambient, diffuse, specular, reflectionCoefficient;
-    int shine;
+    double width = 0.0, height = 0.0, length = 0.0; // not every type sets these
+    double ambient = 0.0, diffuse = 0.0, specular = 0.0, reflectionCoefficient = 0.0;
+    int shine = 0;
 
     Object(const Point &referencePoint = Point(0.0, 0.0, 0.0))
         : referencePoint(referencePoint) {}
@@ -188,9 +384,25 @@ public:
     virtual Vector getNormal(const Point &point) const = 0;
     virtual double intersect(const Ray &r) const = 0;
     virtual Color getColor(const Point &p) const;
+    virtual Color colorAt(const Point &p, double footprint) const; // footprint = width of the ray cone at p, getColor() by default
+    virtual bool getBoundingBox(AABB &box) const; // false for objects with no finite bounds
+    virtual void intersectPacket(const RayPacket &packet, Real *t) const; // t[lane] = intersect(ray of lane)
+    virtual Vector normalAt(const Ray &r, const Point &point) const;        // normal where r hit, getNormal() by default
+    virtual bool occludes(const Ray &r, double tMax, double epsilon) const; // any hit with t in (epsilon, tMax - epsilon)
     // virtual void traceRay(const Ray &r, Color &color, int level) const;
 
-    void traceRay(const Ray &r, Color &color, int level, const std::vector<PointLight *> &pointLights, const std::vector<SpotLight *> &spotLights) const;
+    static int rouletteDepth; // bounces before Russian roulette may end a path, 0 = never
+    static double pixelSpread; // angle a pixel subtends, widens ray cones for texture filtering; 0 = finest level only
+    static double radianceBound;   // the most one bounce's shade() can add to a channel, see setRadianceBound
+    static double reflectionBound; // the largest reflection coefficient in the scene
+    // From every material and light, so that traceRay knows when the rest of a path stays under one 8-bit step
+    static void setRadianceBound(const std::vector<Material> &materials, const std::vector<PointLight *> &pointLights,
+                                 const std::vector<SpotLight *> &spotLights);
+
+    void traceRay(const Ray &r, Color &color, int level, const std::vector<PointLight *> &pointLights, const std::vector<SpotLight *> &spotLights,
+                  OcclusionCache *shadowCache = nullptr, double t = -1.0, const Vector *normal = nullptr) const;
+    Color shade(const Ray &r, const Point &intersection, const Vector &normal, const std::vector<PointLight *> &pointLights,
+                const std::vector<SpotLight *> &spotLights, OcclusionCache *shadowCache, double footprint = 0.0) const;
     void setColor(const Color &c);
     void setCoefficients(double ambient, double diffuse, double specular, double reflectionCoefficient, int shine);
     Object *nextReflectionObject(const Ray &r) const;
@@ -204,15 +416,18 @@ class Triangle : public Object
 {
 public:
     Point p1, p2, p3;
+    Vector edge1, edge2; // p2 - p1 and p3 - p1, cached for intersect()
 
-    Triangle(Point p1, Point p2, Point p3) : p1(p1), p2(p2), p3(p3) {}
-    Triangle(const Triangle &t) : Object(t), p1(t.p1), p2(t.p2), p3(t.p3) {}
+    Triangle(Point p1, Point p2, Point p3) : p1(p1), p2(p2), p3(p3), edge1(p2 - p1), edge2(p3 - p1) {}
+    Triangle(const Triangle &t) : Object(t), p1(t.p1), p2(t.p2), p3(t.p3), edge1(t.edge1), edge2(t.edge2) {}
     virtual ~Triangle() {}
 
     virtual void draw() const override;
     virtual void print() const override;
     virtual Vector getNormal(const Point &point) const override;
     virtual double intersect(const Ray &r) const override;
+    virtual bool getBoundingBox(AABB &box) const override;
+    virtual void intersectPacket(const RayPacket &packet, Real *t) const override;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -233,6 +448,8 @@ public:
     virtual void print() const override;
     virtual Vector getNormal(const Point &point) const override;
     virtual double intersect(const Ray &r) const override;
+    virtual bool getBoundingBox(AABB &box) const override;
+    virtual void intersectPacket(const RayPacket &packet, Real *t) const override;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -260,6 +477,52 @@ public:
     virtual void print() const override;
     virtual Vector getNormal(const Point &point) const override;
     virtual double intersect(const Ray &r) const override;
+    virtual bool getBoundingBox(AABB &box) const override; // only when clipped on all three axes
+    void getClip(double clip[6]) const;
+
+    // Intersection kernels, picked once per surface from its coefficients (A..J)
+    enum Kind
+    {
+        GENERAL,
+        AXIS_ALIGNED, // no xy, xz or yz terms: axis-aligned ellipsoids, cones, paraboloids, hyperboloids
+        CYLINDER_X,   // axis-aligned and free of x (A = G = 0): a cylinder or other extrusion along x
+        CYLINDER_Y,
+        CYLINDER_Z,
+        KIND_COUNT
+    };
+    static int classify(const double q[10]);
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                               Texture                                                          //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Mip-mapped RGB8 image for the ray tracer, every level row-major and top row first, one after another
+class Texture
+{
+public:
+    static const int TEXEL = 3; // bytes per texel
+
+    class Level
+    {
+    public:
+        int width, height;
+        size_t offset; // first texel of the level, in texels
+    };
+
+    std::vector<Level> levels; // levels[0] is the full image, each next one half the size down to 1x1
+    std::vector<unsigned char> texels; // RGB
+
+    bool empty() const { return levels.empty(); }
+    void build(const unsigned char *data, int width, int height, int channels); // row-major, top row first
+    void clear();
+    Color texel(int level, int x, int y) const;          // clamped to the level, y = 0 is the top row
+    Color bilinear(int level, double u, double v) const; // u, v in [0, 1], v = 0 is the bottom row
+    // Trilinear lookup; footprint is the width the sample covers in texture space (1 = the whole image)
+    Color sample(double u, double v, double footprint) const;
+    void levelRGB(int level, std::vector<unsigned char> &rgb) const; // row-major copy, e.g. for glTexImage2D
+
+private:
+    size_t index(const Level &level, int x, int y) const;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -273,23 +536,29 @@ public:
     bool useTexture = false;
     unsigned char *textureData = nullptr;
     mutable GLuint glTextureID = 0; // OpenGL texture handle
+    mutable GLuint checkerTextureID = 0; // 2x2 checkerboard repeated over the preview floor
+    mutable PreviewMesh previewMesh;
     int textureWidth = 0, textureHeight = 0, textureChannels = 0;
+    Texture texture; // mip pyramid of textureData that the ray tracer samples
     Floor(double floorWidth, double tileWidth)
         : Object(Point(-floorWidth / 2.0, -floorWidth / 2.0, 0.0)), floorWidth(floorWidth), tileWidth(tileWidth),
-          useTexture(false), glTextureID(0), plane(Vector(0.0, 0.0, 1.0), Point(-floorWidth / 2.0, -floorWidth / 2.0, 0.0)) {}
+          plane(Vector(0.0, 0.0, 1.0), Point(-floorWidth / 2.0, -floorWidth / 2.0, 0.0)), useTexture(false), glTextureID(0) {}
     Floor(const Floor &f)
         : Object(f), floorWidth(f.floorWidth), tileWidth(f.tileWidth), plane(f.plane) {}
-    virtual ~Floor() {}
+    virtual ~Floor();
 
     virtual void draw() const override;
     virtual void print() const override;
     virtual Vector getNormal(const Point &point) const override;
     virtual double intersect(const Ray &r) const override;
     virtual Color getColor(const Point &p) const override;
+    virtual Color colorAt(const Point &p, double footprint) const override;
+    virtual void intersectPacket(const RayPacket &packet, Real *t) const override;
 
     void loadTexture(const std::string &path);
-    Color sampleTexture(double u, double v) const;
-    void setTexture(unsigned char *data, int width, int height, int channels);
+    Color sampleTexture(double u, double v, double footprint = 0.0) const; // footprint in tiles, 0 = finest level
+    void setTexture(unsigned char *data, int width, int height, int channels); // CPU copy only, no GL needed
+    void uploadTexture();                                                      // needs a current GL context
     void setGLTextureID(GLuint id);
 };
 
@@ -302,9 +571,35 @@ public:
     Point origin;
     Vector direction;
 
+    // Normalises once here; copies keep the direction as is
     Ray(const Point &origin, const Vector &direction)
         : origin(origin), direction(direction.normalize()) {}
-    Ray(const Ray &r) : origin(r.origin), direction(r.direction.normalize()) {}
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                               RayPacket                                                        //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+class RayPacket // up to 16 rays in structure-of-arrays form for the SIMD kernels (Real precision)
+{
+public:
+    static const int MAX_SIZE = 16;
+    int size = 0;  // rays added
+    int lanes = 0; // size rounded up to a multiple of the SIMD width, the extra lanes repeat ray 0
+    alignas(32) Real ox[MAX_SIZE], oy[MAX_SIZE], oz[MAX_SIZE];
+    alignas(32) Real dx[MAX_SIZE], dy[MAX_SIZE], dz[MAX_SIZE];
+    alignas(32) Real ix[MAX_SIZE], iy[MAX_SIZE], iz[MAX_SIZE]; // inverse directions
+    alignas(32) Real tMin[MAX_SIZE];
+    Object *hit[MAX_SIZE];
+    int hitId[MAX_SIZE]; // primitive id of hit, -1 for a miss
+    int id[MAX_SIZE];    // caller's tag per ray, e.g. its pixel
+
+    void clear();
+    void add(const Ray &r, int id);
+    void finalize();
+    bool coherent() const; // every direction lies in the same octant
+    int split(RayPacket parts[8]) const; // one packet per octant, returns how many
+    int octant(int lane) const;
+    Ray ray(int lane) const;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -356,6 +651,497 @@ public:
     virtual void print() const override;
 };
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                  AABB                                                          //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+class AABB
+{
+public:
+    Point minPoint, maxPoint;
+
+    AABB() : minPoint(1e18, 1e18, 1e18), maxPoint(-1e18, -1e18, -1e18) {}
+    AABB(const Point &minPoint, const Point &maxPoint) : minPoint(minPoint), maxPoint(maxPoint) {}
+
+    void expand(const Point &p);
+    void expand(const AABB &b);
+    void pad(double d);
+    Point centroid() const;
+    double extent(int axis) const;
+    double surfaceArea() const;
+    bool intersect(const Point &origin, const Vector &invDir, double tMax) const;
+    bool overlaps(const AABB &b) const; // false when either box is empty
+    bool contains(const AABB &b) const;
+    bool clip(const Point &from, const Point &to, Point &clippedFrom, Point &clippedTo) const; // false = misses the box
+    void print() const;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                             CompiledScene                                                      //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+class Material
+{
+public:
+    Color color;
+    double ambient = 0, diffuse = 0, specular = 0, reflectionCoefficient = 0;
+    int shine = 0;
+};
+
+class Hit
+{
+public:
+    double t;
+    int id; // primitive id in CompiledScene, -1 for a miss
+
+    Hit(double t = 1e9, int id = -1) : t(t), id(id) {}
+};
+
+// Render-time copy of the scene: one structure-of-arrays block per primitive type, so the
+// intersection loops stream through plain doubles instead of calling virtual Object::intersect.
+// Objects stay the authoring/preview layer; sources maps every primitive id back to its Object for shading.
+class CompiledScene
+{
+public:
+    enum Type
+    {
+        SPHERE,
+        TRIANGLE,
+        QUADRIC,
+        OBJECT, // anything else, intersected through its virtual functions
+        TYPE_COUNT
+    };
+
+    std::vector<Real> sphereX, sphereY, sphereZ, sphereRadius;
+    std::vector<Real> triangleX, triangleY, triangleZ; // first vertex
+    std::vector<Real> edge1X, edge1Y, edge1Z, edge2X, edge2Y, edge2Z;
+    std::vector<Real> quadricCoefficients[10]; // A..J
+    std::vector<Real> quadricClip[6];          // x lo/hi, y lo/hi, z lo/hi, see QuadraticSurface::getClip
+    std::vector<unsigned char> quadricKinds;   // QuadraticSurface::Kind, derived from the coefficients
+    std::vector<Object *> otherObjects;
+    std::vector<int> materialIds[TYPE_COUNT];
+    std::vector<Material> materials;
+    std::vector<Object *> sources; // primitive id -> Object
+    int base[TYPE_COUNT] = {0, 0, 0, 0}; // first primitive id of each type
+    std::map<std::vector<double>, int> materialLookup; // deduplicates identical materials while compiling
+
+    void clear();
+    void reserve(const int counts[TYPE_COUNT]);
+    int add(Object *o, int type); // returns the index within its type
+    void classifyQuadrics();      // refills quadricKinds, e.g. after the coefficients were loaded from a cache
+    int count(int type) const;
+    static int typeOf(const Object *o);
+    int materialOf(int id) const;
+
+    // Batched kernels over [first, first + count) of one type; they update hit when they find a nearer t > 0
+    void intersectSpheres(const Ray &r, int first, int count, Hit &hit) const;
+    void intersectTriangles(const Ray &r, int first, int count, Hit &hit) const;
+    void intersectQuadrics(const Ray &r, int first, int count, Hit &hit) const;
+    void intersectObjects(const Ray &r, int first, int count, Hit &hit) const;
+    void intersect(int type, const Ray &r, int first, int count, Hit &hit) const;
+    // First id with t in (epsilon, tMax - epsilon), or -1
+    int anyHit(int type, const Ray &r, int first, int count, double tMax, double epsilon = 1e-6) const;
+    bool occludes(int id, const Ray &r, double tMax, double epsilon = 1e-6) const; // same test for a single primitive
+    void intersectPacket(int type, RayPacket &packet, int first, int count) const;
+
+private:
+    double primitiveT(int type, int index, const Ray &r) const;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                  BVH                                                           //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+class BVHNode
+{
+public:
+    AABB box;
+    int left = -1, right = -1; // children (inner nodes)
+    int count = 0;             // primitives in a leaf, 0 for inner nodes
+    int first[CompiledScene::TYPE_COUNT] = {0, 0, 0, 0}; // leaf ranges inside each CompiledScene array
+    int size[CompiledScene::TYPE_COUNT] = {0, 0, 0, 0};
+    int axis = 0; // split axis, used to visit the nearer child first
+};
+
+class OcclusionCache // one per render thread: the primitive that last blocked each light is tested before the tree
+{
+public:
+    std::vector<int> lastOccluder; // indexed by light, -1 when unknown
+    long long queries = 0, cacheHits = 0;
+    char padding[64]; // keeps the counters of neighbouring threads off the same cache line
+};
+
+class BVH // binned SAH tree over the compiled scene, unbounded primitives are tested linearly
+{
+public:
+    std::vector<BVHNode> nodes;
+    CompiledScene scene;
+    int unboundedFirst[CompiledScene::TYPE_COUNT] = {0, 0, 0, 0}; // unbounded primitives sit after the tree's ones
+    int unboundedSize[CompiledScene::TYPE_COUNT] = {0, 0, 0, 0};
+    double buildTime = 0.0; // milliseconds
+
+    void build(const std::vector<Object *> &objects);
+    void clear();
+    int nodeCount() const;
+    int unboundedCount() const;
+    Hit intersect(const Ray &r, double tMax = 1e9) const;
+    Object *closestHit(const Ray &r, double &tMin) const;
+    bool anyHit(const Ray &r, double tMax, double epsilon = 1e-6) const;  // any t in (epsilon, tMax - epsilon)
+    int occluder(const Ray &r, double tMax, double epsilon = 1e-6) const; // id of the first blocker in traversal order, or -1
+    // Shadow query from origin toward target, stops at the first blocker; cache may be null.
+    // Blockers closer than epsilon to either end are ignored, see surfaceEpsilon().
+    bool occluded(const Point &origin, const Point &target, int light, OcclusionCache *cache = nullptr,
+                  double epsilon = 1e-6) const;
+    void closestHitPacket(RayPacket &packet) const; // packet must be coherent()
+    // Leaves whose boxes reach the pyramid from origin along the four corner directions (in order around it), nearest
+    // first: the candidates of one screen tile's primary rays. False, with no leaves, once there are more than limit.
+    bool frustumLeaves(const Point &origin, const Vector corners[4], std::vector<int> &leaves, int limit = INT_MAX) const;
+    Object *closestHitLeaves(const Ray &r, double &tMin, const std::vector<int> &leaves) const; // those leaves only
+
+private:
+    int buildNode(std::vector<int> &order, int begin, int end, const std::vector<AABB> &boxes,
+                  const std::vector<Point> &centroids, const std::vector<Object *> &bounded, int depth);
+    int makeLeaf(int index, std::vector<int> &order, int begin, int end, const std::vector<Object *> &bounded);
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                  Mesh                                                          //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+class MeshNode
+{
+public:
+    AABB box;
+    int first = 0, count = 0; // leaf: triangles [first, first + count); inner node: count 0, right child in first
+    int axis = 0;             // split axis; the left child always directly follows its parent
+};
+class Mesh : public Object // indexed triangles with one shared vertex buffer, one material and their own BVH
+{
+public:
+    std::vector<Point> vertices;
+    std::vector<uint32_t> indices; // three per triangle, reordered by build() so every leaf is a contiguous run
+    std::vector<MeshNode> nodes;
+    std::string path;
+    mutable PreviewMesh previewMesh;
+
+    Mesh() {}
+    virtual ~Mesh() {}
+
+    bool load(const std::string &path); // .obj or binary .ply, then build(); prints why and returns false on failure
+    void build();
+    int triangleCount() const;
+    int closestTriangle(const Ray &r, double &tMin) const; // -1 on a miss, otherwise tMin is lowered to the hit
+
+    virtual void draw() const override;
+    virtual void print() const override;
+    virtual Vector getNormal(const Point &point) const override; // searches for the triangle under point
+    virtual Vector normalAt(const Ray &r, const Point &point) const override;
+    virtual double intersect(const Ray &r) const override;
+    virtual bool occludes(const Ray &r, double tMax, double epsilon) const override;
+    virtual bool getBoundingBox(AABB &box) const override;
+
+private:
+    bool loadOBJ(const std::string &path);
+    bool loadPLY(const std::string &path);
+    int buildNode(std::vector<int> &order, int begin, int end, const std::vector<AABB> &boxes,
+                  const std::vector<Point> &centroids, int depth);
+    double triangleT(int triangle, const Ray &r) const;
+    Vector faceNormal(int triangle) const;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                               Transform                                                        //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+class Transform // affine 4x4 matrix; the last row is always 0 0 0 1, so only the top three rows are kept
+{
+public:
+    double m[3][4];
+
+    Transform(); // identity
+    bool setRows(const double rows[16]); // row-major 4x4, false when the last row is not 0 0 0 1
+    Point apply(const Point &p) const;
+    Vector applyVector(const Vector &v) const;          // no translation
+    Vector applyTransposed(const Vector &v) const;       // transposed linear part: called on the inverse to move normals
+    double determinant() const;
+    Transform inverse() const;                           // only meaningful when determinant() is not 0
+    void toGL(double columnMajor[16]) const;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                               Instance                                                         //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+class Instance : public Object // a shared prototype seen through a transform; rays are moved into prototype space
+{
+public:
+    const Object *prototype; // owned by whoever loaded the scene, shared by every instance of it
+    Transform toWorld, toObject;
+    AABB bounds; // world box around the transformed prototype box, empty when the prototype is unbounded
+    bool bounded = false;
+
+    Instance(const Object *prototype, const Transform &toWorld); // takes the prototype's material
+    virtual ~Instance() {}
+
+    virtual void draw() const override;
+    virtual void print() const override;
+    virtual Vector getNormal(const Point &point) const override;
+    virtual Vector normalAt(const Ray &r, const Point &point) const override;
+    virtual double intersect(const Ray &r) const override;
+    virtual bool occludes(const Ray &r, double tMax, double epsilon) const override;
+    virtual bool getBoundingBox(AABB &box) const override;
+
+private:
+    Ray objectRay(const Ray &r, double &scale) const; // t in prototype space = t in world space * scale
+    Vector worldNormal(const Vector &normal) const;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                               SceneCache                                                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Binary image of a loaded scene: object records, lights, the compiled arrays and the built BVH. load() maps the
+// file with mmap and copies each array in one go, so a cached scene starts without parsing or rebuilding the tree.
+class SceneCache
+{
+public:
+    static const uint32_t VERSION = 3; // bump whenever the file layout or a cached class changes
+
+    class Header
+    {
+    public:
+        char magic[8];
+        uint32_t version, realSize; // realSize = sizeof(Real) of the build that wrote the file
+        uint64_t sourceSize;
+        int64_t sourceMtime;  // nanoseconds
+        uint64_t sourceHash;  // FNV-1a of the scene text, checked when only the mtime changed
+        int32_t level, padding;
+        uint64_t fileSize;    // catches truncated files
+    };
+
+    // Objects loaded from the cache live here, one allocation per type instead of one new per object. Loading copies
+    // every section out of the mapping (here, into the BVH and into the meshes), and the file is unmapped afterwards:
+    // nothing points into it.
+    std::vector<Sphere> spheres;
+    std::vector<Triangle> triangles;
+    std::vector<QuadraticSurface> quadrics;
+    std::vector<Floor> floors;
+    std::vector<Mesh> meshes;
+    std::vector<Instance> instances;
+
+    bool loaded() const;
+    // Writes objects (spheres, triangles, quadrics, floors, meshes and instances, with the prototypes they use),
+    // their lights and the BVH built over them
+    static bool write(const std::string &path, const std::string &source, int level, const std::vector<Object *> &objects,
+                      const std::vector<PointLight *> &pointLights, const std::vector<SpotLight *> &spotLights,
+                      const BVH &bvh);
+    // False, with the reason, when the file is missing, stale or from another build; nothing is touched then
+    bool load(const std::string &path, const std::string &source, int &level, std::vector<Object *> &objects,
+              std::vector<PointLight *> &pointLights, std::vector<SpotLight *> &spotLights, BVH &bvh,
+              std::string &reason);
+    void release(); // frees the cached objects, pointers handed out by load() must be dropped first
+    static uint64_t hashFile(const std::string &path);
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                               RenderStats                                                      //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Build with -DRT_STATS=0 to compile every counter out of the tracing code
+#ifndef RT_STATS
+#define RT_STATS 1
+#endif
+#if RT_STATS
+#define RT_COUNT(counter, n) (RenderStats::local.counter += (n))
+#else
+#define RT_COUNT(counter, n) ((void)0)
+#endif
+
+class RenderStats // plain per-thread counters: the tracing code bumps RenderStats::local, capture() merges them per tile
+{
+public:
+    long long primaryRays = 0, shadowRays = 0, reflectionRays = 0;
+    long long missedPixels = 0;                                  // no hit, or hit beyond zFar
+    long long tests[CompiledScene::TYPE_COUNT] = {0, 0, 0, 0}; // ray-primitive tests per CompiledScene type
+    long long nodesVisited = 0;                                  // BVH nodes popped by every traversal
+
+    static thread_local RenderStats local;
+
+    void clear();
+    void merge(const RenderStats &other);
+    long long totalTests() const;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                                 GBuffer                                                        //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Primary hits of the last capture. While the view and the geometry stay the same, a capture re-shades these hits
+// (lights, materials, floor texture, reflections) instead of tracing the primary rays again.
+class GBuffer
+{
+public:
+    class Sample
+    {
+    public:
+        int object = -1; // index into objects; -1 = background, -2 = not cached (traced as usual)
+        double t = 0.0;  // along the pixel's primary ray, which gives the position (and the floor's texture lookup)
+        Vector normal;   // facing the ray
+    };
+
+    std::vector<Sample> samples; // row-major, whole image
+    int width = 0, height = 0;
+    std::vector<double> view; // camera and projection the samples were traced with
+    uint64_t geometry = 0;    // geometrySignature() of the scene they were traced in
+    bool valid = false;       // false while a capture is still filling it
+    std::unordered_map<const Object *, int> indexOf; // objects -> index, while filling
+
+    // Changes when an object is added, removed, moved or reshaped, not when only materials or lights change
+    static uint64_t geometrySignature(const std::vector<Object *> &objects);
+    bool matches(const std::vector<double> &view, uint64_t geometry) const;
+    void reset(int width, int height, const std::vector<double> &view, uint64_t geometry,
+               const std::vector<Object *> &objects); // invalid until finish()
+    void update(uint64_t geometry, const std::vector<Object *> &objects); // keeps the samples, for a partial re-render
+    void finish();
+    void clear();
+    Sample &at(int x, int y) { return samples[(size_t)y * width + x]; }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                            FrameDependencies                                                   //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// What each tile of the last capture depended on, so that after an object changes only the tiles it can affect are
+// rendered again. A tile depends on the objects its rays hit or were blocked by. It may also start to depend on a
+// moved object whose new bounds reach its primary rays, its shadow rays (a capsule around its shading points towards
+// each light) or its reflection rays (their box).
+class DependencyRecorder // per render thread, filled by the tracing code while FrameDependencies::recording is set
+{
+public:
+    std::vector<const Object *> touched; // hit or blocked a ray, may repeat
+    AABB shading;                         // every shading point
+    AABB reflections;                     // reflection segments inside the world box
+
+    static thread_local DependencyRecorder local;
+
+    void clear();
+    void hit(const Object *object, const Point &p);
+    void reflection(const Point &from, const Point &to); // to = the far end, hit or not
+};
+
+class TileDependencies
+{
+public:
+    std::vector<int> objects; // indices into objects, sorted
+    Point shadingCenter;      // sphere around the shading points, radius < 0 when there are none
+    double shadingRadius = -1.0;
+    AABB reflections;
+};
+
+class FrameDependencies
+{
+public:
+    int tileSize = 0, width = 0, height = 0, tilesX = 0, tilesY = 0;
+    std::vector<TileDependencies> tiles; // row-major by tile
+    std::vector<double> view;            // camera, projection and recursion level of the capture
+    std::vector<uint64_t> geometry, materials; // per object
+    std::vector<AABB> bounds;                  // per object, empty for unbounded ones
+    uint64_t lights = 0;
+    AABB world; // bounded objects, padded; reflection segments are clipped to it
+    bool valid = false;
+
+    static bool recording;      // the tracing code only reports to DependencyRecorder::local while this is set
+    static AABB recordingWorld; // world box of the capture being recorded
+
+    static uint64_t objectGeometry(const Object *object);
+    static uint64_t objectMaterial(const Object *object);
+    static uint64_t lightSignature(const std::vector<PointLight *> &pointLights,
+                                   const std::vector<SpotLight *> &spotLights);
+    // Starts a full capture: every tile is recorded again
+    void reset(int tileSize, int width, int height, const std::vector<double> &view,
+               const std::vector<Object *> &objects, const std::vector<PointLight *> &pointLights,
+               const std::vector<SpotLight *> &spotLights);
+    // Same view, lights and object count: the objects whose geometry or material changed since the last capture
+    // (and whether their geometry did), or false when everything has to be rendered again
+    bool changes(const std::vector<double> &view, const std::vector<Object *> &objects,
+                 const std::vector<PointLight *> &pointLights, const std::vector<SpotLight *> &spotLights,
+                 std::vector<int> &changed, std::vector<char> &moved) const;
+    // Does tile t depend on object index, or can its shadow or reflection rays reach newBounds?
+    bool affects(int t, int index, bool moved, const AABB &newBounds, const std::vector<PointLight *> &pointLights,
+                 const std::vector<SpotLight *> &spotLights) const;
+    // Takes the recorder's findings for tile (in pixels); objectIndex maps objects to their index
+    void store(const Tile &tile, DependencyRecorder &recorder,
+               const std::unordered_map<const Object *, int> &objectIndex);
+    // Adopts the new signatures and bounds once the changed tiles are rendered
+    void update(const std::vector<Object *> &objects);
+    int tileOf(int x, int y) const { return (y / tileSize) * tilesX + x / tileSize; }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                              TileScheduler                                                     //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+class Tile
+{
+public:
+    int x0, y0, x1, y1; // pixel range [x0, x1) x [y0, y1)
+
+    Tile(int x0 = 0, int y0 = 0, int x1 = 0, int y1 = 0) : x0(x0), y0(y0), x1(x1), y1(y1) {}
+};
+
+class TileScheduler // Morton-ordered tiles, each thread owns a contiguous run and steals half of the largest one left
+{
+public:
+    int tileSize;
+    int numThreads;
+    std::vector<Tile> tiles;
+    std::vector<double> busyTime; // milliseconds spent inside renderTile, per thread
+    std::vector<int> tilesRendered, steals;
+    const std::atomic<bool> *cancel = nullptr; // once it reads true, run() hands out no more tiles and returns
+    std::function<bool(const Tile &tile)> filter; // when set, makeTiles() keeps only the tiles it accepts
+
+    TileScheduler(int tileSize = 16, int numThreads = 0);
+    ~TileScheduler(); // stops the pool
+    TileScheduler(const TileScheduler &) = delete;
+    TileScheduler &operator=(const TileScheduler &) = delete;
+
+    void makeTiles(int width, int height);
+    void makeTiles(const Tile &region); // tiles of the pixel range region only
+    void run(const std::function<void(const Tile &tile, int thread)> &renderTile);
+    void printStats() const;
+
+private:
+    // Threads 1..numThreads-1 are started by the first run() and parked between runs, so a sequence of frames
+    // pays for them once. The calling thread is always thread 0.
+    std::vector<std::thread> pool;
+    std::mutex poolMutex;
+    std::condition_variable poolWake, poolDone;
+    std::function<void(int)> poolJob;
+    long long poolGeneration = 0; // bumped by every run()
+    int poolBusy = 0;             // pool threads still working on the current run
+    bool poolStopping = false;
+
+    void poolLoop(int self);
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//                                               Connection                                                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Blocking TCP stream for distributed rendering (POSIX sockets): '\n'-terminated text messages, each optionally
+// followed by a raw payload whose size the message announces.
+class Connection
+{
+public:
+    int fd = -1;
+    std::string peer; // host:port of the other end
+
+    Connection() {}
+    ~Connection();
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    static int listenOn(int port); // listening socket on every interface, -1 (with a message) on error
+    bool acceptFrom(int listener, int timeoutMs); // false on timeout or error
+    bool connectTo(const std::string &host, int port);
+    bool sendLine(const std::string &line); // appends the '\n'
+    bool sendBytes(const void *data, size_t size);
+    int readLine(std::string &line, int timeoutMs = -1); // 1 = got a line, 0 = timed out, -1 = closed or error
+    int readBytes(void *data, size_t size, int timeoutMs = -1); // like readLine; a timeout keeps what has arrived
+    void close();
+
+private:
+    std::string buffer; // received bytes past the last line handed out
+};
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //                                                 Matrix                                                         //
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -5,12 +5,25 @@
 #include <GL/glut.h> // Use standard GLUT location on Linux/Windows
 #endif
 #include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <cmath>
 #include <thread>
 #include <vector>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <csignal>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "2005079_classes.hpp"
 #include "bitmap_image.hpp"
-#include <mutex>
-std::mutex imageMutex;
+#include "image_writer.hpp"
 
 using namespace std;
 
@@ -24,14 +37,81 @@ Camera camera(Point(125.0, -125.0, 125.0), Point(0.0, 0.0, 0.0), Vector(0.0, 0.0
 vector<Object *> objects;
 vector<PointLight *> pointLights;
 vector<SpotLight *> spotLights;
+BVH bvh;
 int windowWidth = 1000, windowHeight = 1000;
 int imageWidth = 1000, imageHeight = 1000;
+int tileSize = 16;
+int renderThreads = 0; // 0 = one per hardware thread
+int packetSize = 0;    // 4, 8 or 16 traces primary rays in SIMD packets, 0 = one ray at a time
+bool headless = false;
+string outputFilename = ""; // empty = Output_<n>.bmp
+int levelOverride = -1;     // --level, applied after the scene file sets level
+bool floorTextureOn = false;
+string statsFormat = "text"; // --stats=text|json|off
+double loadTime = 0.0;       // milliseconds spent in the last load_data
+string sceneCacheFilename = ""; // empty = <scene>.cache
+bool useSceneCache = true;      // --no-cache parses the text file even when a fresh cache exists
+bool compileScene = false;      // --compile writes the scene cache and exits
+SceneCache sceneCache;
+map<string, Object *> prototypes; // named objects that only appear in the scene through instance records
+string keyframesFilename = "";    // --keyframes renders a camera path instead of a single image
+int sequenceFrames = 60;          // --frames
+string coordinatorAddress = "";   // --worker host:port renders tiles for that coordinator
+int coordinatorPort = 0;          // --coordinator <port> hands tiles out to workers instead of rendering
+int spawnWorkers = 0;             // --spawn <n> starts n local workers for the coordinator
+bool gbufferEnabled = false;      // keep the primary hits of each capture for relighting (the preview window only)
+GBuffer gbuffer;
+bool incrementalEnabled = false;  // re-render only the tiles changed objects affect (the preview window only)
+FrameDependencies frameDependencies;
+bitmap_image lastFrame; // the last capture, which an incremental one starts from
+int aaSamples = 1;          // --aa: stratified samples for a pixel on an edge (a square, 1 = off)
+double aaThreshold = 0.1;   // --aa-threshold: colour difference to a neighbour that makes a pixel an edge
+double aaBudget = 3.0;      // --aa-budget: extra samples per frame, per pixel on average
+long long aaBudgetLeft = 0; // unspent budget of the frame so far; render_frame adds each region's share
+long long aaExtraSamples = 0, aaRefinedPixels = 0; // of the frame so far
+string cullMode = "auto"; // --cull: primary rays test only the BVH leaves in their tile's frustum (on, off or auto)
+int cullLeaves = 96;      // auto culls the tiles whose frustum reaches at most this many BVH leaves
+
+// Capture started from the preview window ('0'): it renders on captureThread while the event loop keeps running, and
+// finished tiles are copied into previewPixels, which the main thread uploads to previewTexture for display().
+thread captureThread;
+atomic<bool> captureRunning(false), captureCancel(false);
+atomic<int> captureTilesDone(0);
+int captureTilesTotal = 0;
+chrono::steady_clock::time_point captureStart;
+mutex previewMutex;                 // guards previewPixels and previewDirty
+vector<unsigned char> previewPixels; // RGB, top row first, every previewStep-th pixel of the image
+int previewStep = 1, previewWidth = 0, previewHeight = 0;
+bool previewDirty = false;
+bool previewVisible = false; // the overlay stays up after the capture until the next key press
+GLuint previewTexture = 0;
+int previewTextureSize = 0; // power of two, so it works without NPOT texture support
 
 void initGL();
 void reshapeListener(GLsizei width, GLsizei height);
+Object *read_object(istream &input, const string &type);
 void load_data(const string &filename);
-void capture();
+double render_frame(TileScheduler &scheduler, bitmap_image &image, vector<OcclusionCache> &shadowCaches,
+                    vector<RenderStats> &threadStats, const Tile &region, float *rgb = nullptr,
+                    const function<void(const Tile &tile)> &tileDone = nullptr, GBuffer *gbuffer = nullptr);
+bool capture(const atomic<bool> *cancel = nullptr,
+             const function<void(const Tile &tile, bitmap_image &band, int bandY0)> &tileDone = nullptr);
+void antialias_region(TileScheduler &scheduler, bitmap_image &image, vector<OcclusionCache> &shadowCaches,
+                      vector<RenderStats> &threadStats, const Tile &region, float *rgb,
+                      const function<void(const Tile &tile)> &tileDone, const vector<Color> &aaColor,
+                      const vector<const Object *> &aaHit);
+vector<char> select_tiles(const vector<int> &changed, const vector<char> &moved);
+void start_capture();
+void capture_progress(int value);
+void reload_scene();
+bool save_image(bitmap_image &image, const string &file);
+bool render_sequence();
+bool run_worker(int argc, char **argv);
+bool run_coordinator(int argc, char **argv);
+void print_stats_json(const RenderStats &stats, const TileScheduler &scheduler, long long shadowQueries,
+                      long long shadowCacheHits, double traceMs, double saveMs);
 void free_memory();
+bool parse_args(int argc, char **argv);
 
 void initGL()
 {
@@ -51,14 +131,136 @@ void reshapeListener(GLsizei width, GLsizei height)
     gluPerspective(viewAngle, aspect, zNear, zFar);
 }
 
+// One object record after its type keyword; nullptr (with a message) when it cannot be read
+Object *read_object(istream &input, const string &type)
+{
+    if (type == "sphere")
+    {
+        double x, y, z, radius;
+        input >> x >> y >> z >> radius;
+        Point center(x, y, z);
+        double r, g, b;
+        input >> r >> g >> b;
+        Color color(r, g, b);
+        // cout << "DEBUG: Sphere color read: " << r << ", " << g << ", " << b << endl;
+        // color.print();
+        double ambient, diffuse, specular, reflectionCoefficient;
+        input >> ambient >> diffuse >> specular >> reflectionCoefficient;
+        int shine;
+        input >> shine;
+        Object *temp = new Sphere(center, radius);
+        temp->setColor(color);
+        // cout << "DEBUG: After setColor, sphere color: ";
+        // temp->color.print();
+        temp->setCoefficients(ambient, diffuse, specular, reflectionCoefficient, shine);
+        return temp;
+    }
+    else if (type == "triangle")
+    {
+        double x1, y1, z1, x2, y2, z2, x3, y3, z3;
+        input >> x1 >> y1 >> z1 >> x2 >> y2 >> z2 >> x3 >> y3 >> z3;
+        Point p1(x1, y1, z1), p2(x2, y2, z2), p3(x3, y3, z3);
+        double r, g, b;
+        input >> r >> g >> b;
+        Color color(r, g, b);
+        // cout << "DEBUG: Triangle color read: " << r << ", " << g << ", " << b << endl;
+        // color.print();
+        double ambient, diffuse, specular, reflection;
+        input >> ambient >> diffuse >> specular >> reflection;
+        int shine;
+        input >> shine;
+        Object *temp = new Triangle(p1, p2, p3);
+        temp->setColor(color);
+        // cout << "DEBUG: After setColor, triangle color: ";
+        // temp->color.print();
+        temp->setCoefficients(ambient, diffuse, specular, reflection, shine);
+        return temp;
+    }
+    else if (type == "general")
+    {
+        double A, B, C, D, E, F, G, H, I, J;
+        input >> A >> B >> C >> D >> E >> F >> G >> H >> I >> J;
+        double x, y, z;
+        input >> x >> y >> z;
+        double length, width, height;
+        input >> length >> width >> height;
+        double r, g, b;
+        input >> r >> g >> b;
+        Color color(r, g, b);
+        double ambient, diffuse, specular, reflection;
+        input >> ambient >> diffuse >> specular >> reflection;
+        int shine;
+        input >> shine;
+        Point reference(x, y, z);
+        Object *temp = new QuadraticSurface(reference, height, width, length,
+                                            A, B, C, D, E, F, G, H, I, J);
+        temp->setColor(color);
+        temp->setCoefficients(ambient, diffuse, specular, reflection, shine);
+        return temp;
+    }
+    else if (type == "mesh")
+    {
+        // mesh <file.obj|file.ply>, then colour, coefficients and shine like the other objects
+        string path;
+        input >> path;
+        double r, g, b;
+        input >> r >> g >> b;
+        double ambient, diffuse, specular, reflection;
+        input >> ambient >> diffuse >> specular >> reflection;
+        int shine;
+        input >> shine;
+        Mesh *mesh = new Mesh();
+        if (!mesh->load(path))
+        {
+            delete mesh;
+            return nullptr;
+        }
+        mesh->setColor(Color(r, g, b));
+        mesh->setCoefficients(ambient, diffuse, specular, reflection, shine);
+        mesh->print();
+        return mesh;
+    }
+    else if (type == "instance")
+    {
+        // instance <prototype name>, then the prototype-to-world transform as a row-major 4x4 matrix
+        string name;
+        input >> name;
+        double rows[16];
+        for (double &value : rows)
+            input >> value;
+        auto found = prototypes.find(name);
+        if (found == prototypes.end())
+        {
+            cerr << "Error reading file: unknown prototype " << name << endl;
+            return nullptr;
+        }
+        Transform toWorld;
+        if (!toWorld.setRows(rows) || fabs(toWorld.determinant()) < 1e-12)
+        {
+            cerr << "Error reading file: the transform of an instance of " << name << " must be affine and invertible" << endl;
+            return nullptr;
+        }
+        return new Instance(found->second, toWorld);
+    }
+    cerr << "Error reading file: Unknown object type" << endl;
+    return nullptr;
+}
+
 void load_data(const string &filename)
 {
+    auto start = chrono::steady_clock::now();
     ifstream input(filename);
     if (!input.is_open())
     {
         cerr << "Error: File not found" << endl;
         return;
     }
+    string cachePath = sceneCacheFilename.empty() ? filename + ".cache" : sceneCacheFilename;
+    string reason;
+    bool fromCache = useSceneCache && sceneCache.load(cachePath, filename, level, objects, pointLights, spotLights, bvh, reason);
+    if (useSceneCache && !fromCache)
+        cout << "Scene cache " << cachePath << " not used: " << reason << endl;
+    double sceneTime = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
 
     bitmap_image texImage(textureFilename);
     if (!texImage)
@@ -78,13 +280,18 @@ void load_data(const string &filename)
         }
     }
     // cout << "Texture loaded successfully: " << texImage.width() << "x" << texImage.height() << endl;
-    GLuint texID;
-    glGenTextures(1, &texID);
-    glBindTexture(GL_TEXTURE_2D, texID);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, texImage.width(), texImage.height(), 0, GL_RGB, GL_UNSIGNED_BYTE, texData);
-    // cout << "Texture OpenGL ID: " << texID << endl;
+    if (fromCache)
+    {
+        input.close();
+        static_cast<Floor *>(objects.back())->setTexture(texData, texImage.width(), texImage.height(), 3);
+        loadTime = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << "Scene read from " << cachePath << " in " << sceneTime << " ms (" << objects.size() << " objects)" << endl;
+        cout << "Data loaded successfully from " << filename << endl;
+        if (!headless)
+            cout << "Press '0' to capture the image." << endl;
+        return;
+    }
+    auto parseStart = chrono::steady_clock::now();
     // Window setup
     int pixel;
     input >> level >> pixel;
@@ -93,77 +300,28 @@ void load_data(const string &filename)
     input >> numObjects;
     for (int i = 0; i < numObjects; i++)
     {
-        string type;
+        string type, name;
         input >> type;
-        if (type == "sphere")
-        {
-            double x, y, z, radius;
-            input >> x >> y >> z >> radius;
-            Point center(x, y, z);
-            double r, g, b;
-            input >> r >> g >> b;
-            Color color(r, g, b);
-            // cout << "DEBUG: Sphere color read: " << r << ", " << g << ", " << b << endl;
-            // color.print();
-            double ambient, diffuse, specular, reflectionCoefficient;
-            input >> ambient >> diffuse >> specular >> reflectionCoefficient;
-            int shine;
-            input >> shine;
-            Object *temp = new Sphere(center, radius);
-            temp->setColor(color);
-            // cout << "DEBUG: After setColor, sphere color: ";
-            // temp->color.print();
-            temp->setCoefficients(ambient, diffuse, specular, reflectionCoefficient, shine);
-            objects.push_back(temp);
-        }
-        else if (type == "triangle")
-        {
-            double x1, y1, z1, x2, y2, z2, x3, y3, z3;
-            input >> x1 >> y1 >> z1 >> x2 >> y2 >> z2 >> x3 >> y3 >> z3;
-            Point p1(x1, y1, z1), p2(x2, y2, z2), p3(x3, y3, z3);
-            double r, g, b;
-            input >> r >> g >> b;
-            Color color(r, g, b);
-            // cout << "DEBUG: Triangle color read: " << r << ", " << g << ", " << b << endl;
-            // color.print();
-            double ambient, diffuse, specular, reflection;
-            input >> ambient >> diffuse >> specular >> reflection;
-            int shine;
-            input >> shine;
-            Object *temp = new Triangle(p1, p2, p3);
-            temp->setColor(color);
-            // cout << "DEBUG: After setColor, triangle color: ";
-            // temp->color.print();
-            temp->setCoefficients(ambient, diffuse, specular, reflection, shine);
-            objects.push_back(temp);
-        }
-        else if (type == "general")
-        {
-            double A, B, C, D, E, F, G, H, I, J;
-            input >> A >> B >> C >> D >> E >> F >> G >> H >> I >> J;
-            double x, y, z;
-            input >> x >> y >> z;
-            double length, width, height;
-            input >> length >> width >> height;
-            double r, g, b;
-            input >> r >> g >> b;
-            Color color(r, g, b);
-            double ambient, diffuse, specular, reflection;
-            input >> ambient >> diffuse >> specular >> reflection;
-            int shine;
-            input >> shine;
-            Point reference(x, y, z);
-            Object *temp = new QuadraticSurface(reference, height, width, length,
-                                                A, B, C, D, E, F, G, H, I, J);
-            temp->setColor(color);
-            temp->setCoefficients(ambient, diffuse, specular, reflection, shine);
-            objects.push_back(temp);
+        if (type == "prototype")
+            input >> name >> type; // prototype <name>, then any object record: defined, but only drawn through instances
+        Object *object = read_object(input, type);
+        if (object && !name.empty() && prototypes.count(name))
+        {
+            cerr << "Error reading file: prototype " << name << " defined twice" << endl;
+            delete object;
+            object = nullptr;
         }
-        else
+        if (!object)
         {
-            cerr << "Error reading file: Unknown object type" << endl;
+            // Nothing half-loaded is left behind: callers see no objects and give up
+            delete[] texData;
+            free_memory();
             return;
         }
+        if (name.empty())
+            objects.push_back(object);
+        else
+            prototypes[name] = object;
         // cout << "Object " << objects.size() << " loaded successfully." << endl;
     }
     // Floor
@@ -172,7 +330,6 @@ void load_data(const string &filename)
     // floor->setCoefficients(0.4, 0.2, 0.2, 0.2, 5);
     // floor->setReferencePoint(camera.center);
     static_cast<Floor *>(floor)->setTexture(texData, texImage.width(), texImage.height(), 3);
-    static_cast<Floor *>(floor)->setGLTextureID(texID);
     objects.push_back(floor);
     // Point Lights
     int numPointLights;
@@ -207,23 +364,37 @@ void load_data(const string &filename)
         spotLights.push_back(sl);
     }
     input.close();
+    bvh.build(objects);
+    loadTime = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    cout << "Scene parsed from " << filename << " in "
+         << chrono::duration<double, milli>(chrono::steady_clock::now() - parseStart).count() << " ms (BVH build "
+         << bvh.buildTime << " ms)" << endl;
     cout << "Total objects loaded: " << objects.size() << endl;
     cout << "Total point lights loaded: " << pointLights.size() << endl;
     cout << "Total spot lights loaded: " << spotLights.size() << endl;
     cout << "Data loaded successfully from " << filename << endl;
-    cout << "Press '0' to capture the image." << endl;
+    if (!headless)
+        cout << "Press '0' to capture the image." << endl;
     // for (Object *obj : objects)
     // {
     //     obj->color.print();
     // }
 }
 
-void capture()
+// Renders the pixels in region of the current camera view into image (region-sized, pixel (region.x0, region.y0)
+// at its top left) on the scheduler's threads and returns the trace time in ms. rgb, when given, also receives the
+// colours as floats: 3 per pixel, region-sized rows. tileDone, when given, is called on the render thread after each
+// tile. A valid gbuffer supplies the primary hits instead of tracing them; an invalid one is filled in for the region.
+// With --aa, edge pixels are sampled again afterwards out of aaBudgetLeft, and tileDone follows that pass instead.
+// Nothing here is per-frame state: scenes, BVH, threads and caches all carry over between calls.
+double render_frame(TileScheduler &scheduler, bitmap_image &image, vector<OcclusionCache> &shadowCaches,
+                    vector<RenderStats> &threadStats, const Tile &region, float *rgb,
+                    const function<void(const Tile &tile)> &tileDone, GBuffer *gbuffer)
 {
-    cout << "Capturing image..." << endl;
-    auto start = std::chrono::steady_clock::now();
-    bitmap_image image(imageWidth, imageHeight);
     image.set_all_channels(0, 0, 0);
+    int regionWidth = region.x1 - region.x0;
+    if (rgb)
+        fill(rgb, rgb + (size_t)regionWidth * (region.y1 - region.y0) * 3, 0.0f);
     double planeDistance = (windowHeight / 2.0) / tan((viewAngle * M_PI / 360) / 2.0);
     // double planeDistance = 1.0;
     // double windowHeight = 2 * tan(viewAngle * M_PI / 360.0) * planeDistance;
@@ -231,69 +402,1154 @@ void capture()
     Vector r = camera.right().normalize();
     Point topLeft = camera.eye + (camera.center - camera.eye).normalize() * planeDistance -
                     r * windowWidth / 2.0 + camera.up.normalize() * windowHeight / 2.0;
-    double du = windowWidth / imageWidth;
-    double dv = windowHeight / imageHeight;
+    double du = (double)windowWidth / imageWidth;
+    double dv = (double)windowHeight / imageHeight;
     topLeft = topLeft + r * 0.5 * du - camera.up * 0.5 * dv;
-    auto renderSegment = [&](int startCol, int endCol)
+    Object::pixelSpread = du / planeDistance; // picks the floor texture's mip level
+    Object::setRadianceBound(bvh.scene.materials, pointLights, spotLights);
+    auto planePoint = [&](double x, double y) { return topLeft + r * x * du - camera.up * y * dv; };
+    auto primaryRay = [&](int i, int j)
+    {
+        Point curPixel = planePoint(i, j);
+        return Ray(camera.eye, (curPixel - camera.eye).normalize());
+    };
+    // Each tile first collects the BVH leaves in its frustum, and its primary rays test only those. A tile that reaches
+    // more than cullLeaves of them keeps the tree. Packets keep the tree, which they traverse together; shadow and
+    // reflection rays always use it.
+    bool cull = packetSize <= 1 && cullMode != "off";
+    vector<vector<int>> tileLeaves(cull ? scheduler.numThreads : 0);
+    bool relight = gbuffer && gbuffer->valid, record = gbuffer && !gbuffer->valid;
+    // First-pass colour and object of every pixel in the region, which anti-aliasing compares with the neighbours
+    bool antialias = aaSamples > 1;
+    size_t regionPixels = (size_t)regionWidth * (region.y1 - region.y0);
+    vector<Color> aaColor(antialias ? regionPixels : 0, Color(0, 0, 0));
+    vector<const Object *> aaHit(antialias ? regionPixels : 0, nullptr);
+    // Tiles cover disjoint pixels, so every thread writes straight into image (and gbuffer)
+    auto shadePixel = [&](int i, int j, const Ray &ray, Object *nearest, double tMin, int thread,
+                          const Vector *normal = nullptr)
     {
-        bitmap_image localImage(imageWidth, imageHeight);
-        localImage.set_all_channels(0, 0, 0);
-        for (int i = startCol; i < endCol; i++)
+        bool missed = nearest == nullptr || (camera.center - camera.eye).normalize().dot(ray.direction * tMin) > zFar;
+        if (record)
         {
-            for (int j = 0; j < imageHeight; j++)
+            GBuffer::Sample &sample = gbuffer->at(i, j);
+            auto index = missed ? gbuffer->indexOf.end() : gbuffer->indexOf.find(nearest);
+            sample.object = missed ? -1 : index == gbuffer->indexOf.end() ? -2 : index->second;
+            if (sample.object >= 0)
             {
-                Point curPixel = topLeft + r * i * du - camera.up * j * dv;
-                Ray ray(camera.eye, (curPixel - camera.eye).normalize());
-                int nearest = -1;
-                double tMin = 1e9;
-                for (int k = 0; k < objects.size(); k++)
+                sample.t = tMin;
+                sample.normal = nearest->normalAt(ray, ray.origin + ray.direction * tMin);
+                if (ray.direction.dot(sample.normal) > 0)
+                    sample.normal = sample.normal * (-1);
+                normal = &sample.normal;
+            }
+        }
+        if (missed)
+        {
+            RT_COUNT(missedPixels, 1);
+            return;
+        }
+        Color color(0, 0, 0);
+        nearest->traceRay(ray, color, level, pointLights, spotLights, &shadowCaches[thread], tMin, normal);
+        color.clamp();
+        if (antialias)
+        {
+            size_t k = (size_t)(j - region.y0) * regionWidth + (i - region.x0);
+            aaColor[k] = color;
+            aaHit[k] = nearest;
+        }
+        image.set_pixel(i - region.x0, j - region.y0, 255 * color.r, 255 * color.g, 255 * color.b);
+        if (rgb)
+        {
+            float *p = rgb + ((size_t)(j - region.y0) * regionWidth + (i - region.x0)) * 3;
+            p[0] = color.r;
+            p[1] = color.g;
+            p[2] = color.b;
+        }
+    };
+    auto tracePacket = [&](RayPacket &packet, int thread)
+    {
+        bvh.closestHitPacket(packet);
+        for (int k = 0; k < packet.size; k++)
+            shadePixel(packet.id[k] % imageWidth, packet.id[k] / imageWidth, packet.ray(k), packet.hit[k], packet.tMin[k], thread);
+    };
+    // Packets are blockW x blockH pixel blocks: 2x2, 4x2 or 4x4
+    int blockW = packetSize >= 8 ? 4 : 2, blockH = packetSize >= 16 ? 4 : 2;
+    auto traceTile = [&](const Tile &tile, int thread)
+    {
+        if (relight)
+        {
+            // Only the shading is redone: the first hit and its normal come from the last capture
+            for (int i = tile.x0; i < tile.x1; i++)
+                for (int j = tile.y0; j < tile.y1; j++)
                 {
-                    double t = objects[k]->intersect(ray);
-                    if (t > 0 && t < tMin)
+                    const GBuffer::Sample &sample = gbuffer->at(i, j);
+                    Ray ray = primaryRay(i, j);
+                    if (sample.object >= 0)
+                        shadePixel(i, j, ray, objects[sample.object], sample.t, thread, &sample.normal);
+                    else if (sample.object == -1)
+                        RT_COUNT(missedPixels, 1);
+                    else
                     {
-                        tMin = t;
-                        nearest = k;
+                        RT_COUNT(primaryRays, 1);
+                        double tMin = 1e9;
+                        Object *nearest = bvh.closestHit(ray, tMin);
+                        shadePixel(i, j, ray, nearest, tMin, thread);
                     }
                 }
-                if (nearest == -1)
+            return;
+        }
+        if (packetSize <= 1)
+        {
+            bool listed = false;
+            if (cull)
+            {
+                // The tile's pixels span the plane from (x0, y0) to (x1, y1) less half a pixel
+                Vector corners[4] = {planePoint(tile.x0 - 0.5, tile.y0 - 0.5) - camera.eye,
+                                     planePoint(tile.x1 - 0.5, tile.y0 - 0.5) - camera.eye,
+                                     planePoint(tile.x1 - 0.5, tile.y1 - 0.5) - camera.eye,
+                                     planePoint(tile.x0 - 0.5, tile.y1 - 0.5) - camera.eye};
+                listed = bvh.frustumLeaves(camera.eye, corners, tileLeaves[thread], cullMode == "on" ? INT_MAX : cullLeaves);
+            }
+            for (int i = tile.x0; i < tile.x1; i++)
+            {
+                for (int j = tile.y0; j < tile.y1; j++)
+                {
+                    Ray ray = primaryRay(i, j);
+                    RT_COUNT(primaryRays, 1);
+                    double tMin = 1e9;
+                    Object *nearest = listed ? bvh.closestHitLeaves(ray, tMin, tileLeaves[thread]) : bvh.closestHit(ray, tMin);
+                    shadePixel(i, j, ray, nearest, tMin, thread);
+                }
+            }
+            return;
+        }
+        RayPacket packet, parts[8];
+        for (int bj = tile.y0; bj < tile.y1; bj += blockH)
+        {
+            for (int bi = tile.x0; bi < tile.x1; bi += blockW)
+            {
+                packet.clear();
+                for (int j = bj; j < min(bj + blockH, tile.y1); j++)
+                    for (int i = bi; i < min(bi + blockW, tile.x1); i++)
+                        packet.add(primaryRay(i, j), j * imageWidth + i);
+                packet.finalize();
+                RT_COUNT(primaryRays, packet.size);
+                if (packet.coherent())
+                {
+                    tracePacket(packet, thread);
                     continue;
-                double dist = (camera.center - camera.eye).normalize().dot(ray.direction * tMin);
-                if (dist > zFar)
+                }
+                // Rays straddling an axis would disagree on traversal order: trace each octant on its own
+                int count = packet.split(parts);
+                for (int k = 0; k < count; k++)
+                    tracePacket(parts[k], thread);
+            }
+        }
+    };
+    // Counters live in the thread-local RenderStats::local while a tile renders, then fold into the thread's slot
+    auto renderTile = [&](const Tile &tile, int thread)
+    {
+        RenderStats::local.clear();
+        if (FrameDependencies::recording)
+            DependencyRecorder::local.clear();
+        traceTile(tile, thread);
+        threadStats[thread].merge(RenderStats::local);
+        if (tileDone && !antialias)
+            tileDone(tile);
+    };
+    scheduler.makeTiles(region);
+    auto traceStart = chrono::steady_clock::now();
+    scheduler.run(renderTile);
+    if (antialias && !(scheduler.cancel && scheduler.cancel->load()))
+        antialias_region(scheduler, image, shadowCaches, threadStats, region, rgb, tileDone, aaColor, aaHit);
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - traceStart).count();
+}
+
+// Deterministic jitter in [0, 1) for sample k of pixel (i, j), so images do not depend on the thread count
+static double jitter(int i, int j, int k)
+{
+    uint32_t h = (uint32_t)i * 73856093u ^ (uint32_t)j * 19349663u ^ (uint32_t)k * 83492791u;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h / 4294967296.0;
+}
+
+// Second pass of render_frame with --aa. A pixel is an edge when a 4-neighbour saw another object, or differs by more
+// than aaThreshold in a channel; neighbours outside the region are traced here. The region adds aaBudget per pixel to
+// aaBudgetLeft, and edges are refined strongest first (object changes, then contrast) while it lasts: each one
+// becomes the mean of aaSamples jittered samples, one per cell of a square grid over the pixel.
+void antialias_region(TileScheduler &scheduler, bitmap_image &image, vector<OcclusionCache> &shadowCaches,
+                      vector<RenderStats> &threadStats, const Tile &region, float *rgb,
+                      const function<void(const Tile &tile)> &tileDone, const vector<Color> &aaColor,
+                      const vector<const Object *> &aaHit)
+{
+    int regionWidth = region.x1 - region.x0;
+    size_t regionPixels = (size_t)regionWidth * (region.y1 - region.y0);
+    double planeDistance = (windowHeight / 2.0) / tan((viewAngle * M_PI / 360) / 2.0);
+    Vector r = camera.right().normalize(), forward = (camera.center - camera.eye).normalize();
+    double du = (double)windowWidth / imageWidth;
+    double dv = (double)windowHeight / imageHeight;
+    Point topLeft = camera.eye + forward * planeDistance - r * windowWidth / 2.0 + camera.up.normalize() * windowHeight / 2.0 +
+                    r * 0.5 * du - camera.up * 0.5 * dv;
+    // Colour and object of one primary ray through the point (x, y), in pixels with (i, j) at the centre of pixel (i, j)
+    auto tracePoint = [&](double x, double y, int thread, const Object *&hit)
+    {
+        Point p = topLeft + r * x * du - camera.up * y * dv;
+        Ray ray(camera.eye, (p - camera.eye).normalize());
+        RT_COUNT(primaryRays, 1);
+        double tMin = 1e9;
+        Object *nearest = bvh.closestHit(ray, tMin);
+        Color color(0, 0, 0);
+        hit = nearest == nullptr || forward.dot(ray.direction * tMin) > zFar ? nullptr : nearest;
+        if (hit == nullptr)
+            return color;
+        nearest->traceRay(ray, color, level, pointLights, spotLights, &shadowCaches[thread], tMin);
+        color.clamp();
+        return color;
+    };
+    vector<float> score(regionPixels, 0.0f);
+    vector<long long> traced(scheduler.numThreads, 0);
+    auto findEdges = [&](const Tile &tile, int thread)
+    {
+        RenderStats::local.clear();
+        const int dx[4] = {1, -1, 0, 0}, dy[4] = {0, 0, 1, -1};
+        for (int j = tile.y0; j < tile.y1; j++)
+            for (int i = tile.x0; i < tile.x1; i++)
+            {
+                size_t k = (size_t)(j - region.y0) * regionWidth + (i - region.x0);
+                float best = 0.0f;
+                for (int n = 0; n < 4; n++)
+                {
+                    int x = i + dx[n], y = j + dy[n];
+                    if (x < 0 || y < 0 || x >= imageWidth || y >= imageHeight)
+                        continue;
+                    Color color;
+                    const Object *hit;
+                    if (x >= region.x0 && x < region.x1 && y >= region.y0 && y < region.y1)
+                    {
+                        size_t m = (size_t)(y - region.y0) * regionWidth + (x - region.x0);
+                        color = aaColor[m];
+                        hit = aaHit[m];
+                    }
+                    else
+                    {
+                        color = tracePoint(x, y, thread, hit);
+                        traced[thread]++;
+                    }
+                    float contrast = max(fabs(color.r - aaColor[k].r), max(fabs(color.g - aaColor[k].g), fabs(color.b - aaColor[k].b)));
+                    if (hit != aaHit[k])
+                        best = max(best, 1.0f + contrast);
+                    else if (contrast > aaThreshold)
+                        best = max(best, contrast);
+                }
+                score[k] = best;
+            }
+        threadStats[thread].merge(RenderStats::local);
+    };
+    scheduler.makeTiles(region);
+    scheduler.run(findEdges);
+    if (scheduler.cancel && scheduler.cancel->load())
+        return;
+    long long neighbours = 0;
+    for (long long n : traced)
+        neighbours += n;
+    aaBudgetLeft += (long long)(aaBudget * regionPixels) - neighbours;
+    aaExtraSamples += neighbours;
+    vector<size_t> edges;
+    for (size_t k = 0; k < regionPixels; k++)
+        if (score[k] > 0.0f)
+            edges.push_back(k);
+    size_t affordable = (size_t)max(0LL, aaBudgetLeft / aaSamples);
+    if (edges.size() > affordable)
+    {
+        nth_element(edges.begin(), edges.begin() + affordable, edges.end(), [&](size_t a, size_t b)
+                    { return score[a] > score[b] || (score[a] == score[b] && a < b); });
+        edges.resize(affordable);
+    }
+    vector<char> refine(regionPixels, 0);
+    for (size_t k : edges)
+        refine[k] = 1;
+    aaBudgetLeft -= (long long)edges.size() * aaSamples;
+    aaExtraSamples += (long long)edges.size() * aaSamples;
+    aaRefinedPixels += edges.size();
+    int grid = (int)round(sqrt(aaSamples));
+    auto refineTile = [&](const Tile &tile, int thread)
+    {
+        RenderStats::local.clear();
+        for (int j = tile.y0; j < tile.y1; j++)
+            for (int i = tile.x0; i < tile.x1; i++)
+            {
+                size_t k = (size_t)(j - region.y0) * regionWidth + (i - region.x0);
+                if (!refine[k])
                     continue;
-                Color color(0, 0, 0);
-                objects[nearest]->traceRay(ray, color, level, pointLights, spotLights);
-                color.clamp();
-                localImage.set_pixel(i, j, 255 * color.r, 255 * color.g, 255 * color.b);
+                Color sum(0, 0, 0);
+                for (int cell = 0; cell < aaSamples; cell++)
+                {
+                    double x = i - 0.5 + (cell % grid + jitter(i, j, 2 * cell)) / grid;
+                    double y = j - 0.5 + (cell / grid + jitter(i, j, 2 * cell + 1)) / grid;
+                    const Object *hit;
+                    sum = sum + tracePoint(x, y, thread, hit);
+                }
+                Color color = sum * (Real)(1.0 / aaSamples);
+                image.set_pixel(i - region.x0, j - region.y0, 255 * color.r, 255 * color.g, 255 * color.b);
+                if (rgb)
+                {
+                    float *p = rgb + k * 3;
+                    p[0] = color.r;
+                    p[1] = color.g;
+                    p[2] = color.b;
+                }
+            }
+        threadStats[thread].merge(RenderStats::local);
+        if (tileDone)
+            tileDone(tile);
+    };
+    scheduler.makeTiles(region);
+    scheduler.run(refineTile);
+}
+
+// Range of tiles [tx0, tx1] x [ty0, ty1] the box can cover on screen, or false when part of it is behind the eye
+bool project_bounds(const AABB &box, int &tx0, int &ty0, int &tx1, int &ty1)
+{
+    double planeDistance = (windowHeight / 2.0) / tan((viewAngle * M_PI / 360) / 2.0);
+    Vector forward = (camera.center - camera.eye).normalize(), r = camera.right().normalize(), up = camera.up.normalize();
+    double du = (double)windowWidth / imageWidth, dv = (double)windowHeight / imageHeight;
+    double x0 = 1e30, y0 = 1e30, x1 = -1e30, y1 = -1e30;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        Point p(corner & 1 ? box.maxPoint.x : box.minPoint.x, corner & 2 ? box.maxPoint.y : box.minPoint.y,
+                corner & 4 ? box.maxPoint.z : box.minPoint.z);
+        Vector d = p - camera.eye;
+        double depth = d.dot(forward);
+        if (depth <= 1e-9)
+            return false;
+        // Same mapping as render_frame's primaryRay, solved for the pixel
+        double scale = planeDistance / depth;
+        double x = (d.dot(r) * scale + windowWidth / 2.0) / du - 0.5;
+        double y = (windowHeight / 2.0 - d.dot(up) * scale) / dv - 0.5;
+        x0 = min(x0, x), y0 = min(y0, y), x1 = max(x1, x), y1 = max(y1, y);
+    }
+    const FrameDependencies &deps = frameDependencies;
+    tx0 = max(0.0, floor(x0 - 1)) / deps.tileSize;
+    ty0 = max(0.0, floor(y0 - 1)) / deps.tileSize;
+    tx1 = min((double)imageWidth - 1, ceil(x1 + 1)) / deps.tileSize;
+    ty1 = min((double)imageHeight - 1, ceil(y1 + 1)) / deps.tileSize;
+    return true;
+}
+
+// The tiles an incremental capture renders again: those whose rays touched a changed object, and for a moved one
+// also those its new bounds cover on screen or that their shadow and reflection rays can reach
+vector<char> select_tiles(const vector<int> &changed, const vector<char> &moved)
+{
+    const FrameDependencies &deps = frameDependencies;
+    vector<char> render(deps.tiles.size(), 0);
+    for (size_t c = 0; c < changed.size(); c++)
+    {
+        AABB box;
+        if (moved[c])
+        {
+            objects[changed[c]]->getBoundingBox(box);
+            int tx0, ty0, tx1, ty1;
+            if (!project_bounds(box, tx0, ty0, tx1, ty1))
+                return vector<char>(deps.tiles.size(), 1);
+            for (int ty = ty0; ty <= ty1; ty++)
+                for (int tx = tx0; tx <= tx1; tx++)
+                    render[ty * deps.tilesX + tx] = 1;
+        }
+        for (int t = 0; t < (int)render.size(); t++)
+            if (!render[t] && deps.affects(t, changed[c], moved[c], box, pointLights, spotLights))
+                render[t] = 1;
+    }
+    return render;
+}
+
+// Renders the image in bands of rows and streams each band to the output file (BMP, PPM or PFM by extension) while
+// the next one renders, so only a few bands are ever in memory. Once *cancel reads true, the render stops after the
+// tiles in flight and the partial file is removed; returns false then or on a write error.
+bool capture(const atomic<bool> *cancel,
+             const function<void(const Tile &tile, bitmap_image &band, int bandY0)> &tileDone)
+{
+    cout << "Capturing image..." << endl;
+    auto start = std::chrono::steady_clock::now();
+    string output_file = outputFilename.empty() ? "Output_" + to_string(++capturedFrames) + ".bmp" : outputFilename;
+    ImageWriter writer;
+    if (!writer.open(output_file, imageWidth, imageHeight))
+        return false;
+    TileScheduler scheduler(tileSize, renderThreads);
+    scheduler.cancel = cancel;
+    bool floats = writer.format == ImageWriter::PFM;
+    vector<double> view = {camera.eye.x, camera.eye.y, camera.eye.z, camera.center.x, camera.center.y,
+                           camera.center.z, camera.up.x, camera.up.y, camera.up.z, viewAngle, zFar,
+                           (double)windowWidth, (double)windowHeight, (double)imageWidth, (double)imageHeight};
+    uint64_t geometry = gbufferEnabled ? GBuffer::geometrySignature(objects) : 0;
+    // Same view and geometry as the last capture: re-shade its primary hits
+    bool relit = gbufferEnabled && gbuffer.matches(view, geometry);
+    // Same view, level and lights: only the tiles that depend on a changed object are rendered, the others keep the
+    // last frame. PFM output needs float pixels, which the last frame does not keep.
+    // Anti-aliasing compares pixels across tiles and spends a frame-wide budget, so it always renders everything.
+    bool tracking = incrementalEnabled && aaSamples <= 1;
+    vector<double> tileView = view;
+    tileView.insert(tileView.end(), {(double)level, (double)tileSize});
+    vector<int> changed;
+    vector<char> moved, renderTiles;
+    bool incremental = tracking && !floats && (int)lastFrame.width() == imageWidth &&
+                       (int)lastFrame.height() == imageHeight &&
+                       frameDependencies.changes(tileView, objects, pointLights, spotLights, changed, moved) &&
+                       (!gbufferEnabled || relit || (gbuffer.valid && gbuffer.view == view));
+    if (gbufferEnabled && !relit)
+    {
+        // Otherwise record this capture's hits: all of them, or those of the tiles rendered again
+        if (incremental)
+            gbuffer.update(geometry, objects);
+        else
+            gbuffer.reset(imageWidth, imageHeight, view, geometry, objects);
+    }
+    unordered_map<const Object *, int> objectIndex;
+    if (tracking)
+    {
+        if (incremental)
+            renderTiles = select_tiles(changed, moved);
+        else
+        {
+            frameDependencies.reset(tileSize, imageWidth, imageHeight, tileView, objects, pointLights, spotLights);
+            lastFrame = bitmap_image(imageWidth, imageHeight);
+        }
+        for (int i = 0; i < (int)objects.size(); i++)
+            objectIndex[objects[i]] = i;
+        if (incremental)
+            scheduler.filter = [&](const Tile &tile) { return renderTiles[frameDependencies.tileOf(tile.x0, tile.y0)] != 0; };
+        FrameDependencies::recordingWorld = frameDependencies.world;
+        FrameDependencies::recording = true;
+    }
+    vector<OcclusionCache> shadowCaches(scheduler.numThreads);
+    vector<RenderStats> threadStats(scheduler.numThreads);
+    int bandHeight = min(imageHeight, tileSize * 4);
+    bitmap_image band(imageWidth, bandHeight);
+    vector<float> rgb(floats ? (size_t)imageWidth * bandHeight * 3 : 0);
+    vector<unsigned char> bytes(floats ? 0 : (size_t)imageWidth * bandHeight * 3);
+    double traceMs = 0.0;
+    bool written = true;
+    aaBudgetLeft = aaExtraSamples = aaRefinedPixels = 0;
+    bool cancelled = false;
+    for (int y0 = 0; y0 < imageHeight && written; y0 += bandHeight)
+    {
+        int rows = min(bandHeight, imageHeight - y0);
+        auto bandTileDone = [&](const Tile &tile)
+        {
+            if (tracking)
+                frameDependencies.store(tile, DependencyRecorder::local, objectIndex);
+            if (tileDone)
+                tileDone(tile, band, y0);
+        };
+        traceMs += render_frame(scheduler, band, shadowCaches, threadStats, Tile(0, y0, imageWidth, y0 + rows),
+                                floats ? rgb.data() : nullptr,
+                                tileDone || tracking ? function<void(const Tile &)>(bandTileDone) : nullptr,
+                                gbufferEnabled ? &gbuffer : nullptr);
+        if (cancel && cancel->load())
+        {
+            cancelled = true;
+            break;
+        }
+        if (tracking)
+        {
+            // Rendered tiles go into the last frame, the others come from it
+            for (int j = 0; j < rows; j++)
+                for (int i = 0; i < imageWidth; i++)
+                {
+                    unsigned char r, g, b;
+                    if (!incremental || renderTiles[frameDependencies.tileOf(i, y0 + j)])
+                    {
+                        band.get_pixel(i, j, r, g, b);
+                        lastFrame.set_pixel(i, y0 + j, r, g, b);
+                    }
+                    else
+                    {
+                        lastFrame.get_pixel(i, y0 + j, r, g, b);
+                        band.set_pixel(i, j, r, g, b);
+                    }
+                }
+            // The preview counts and shows the kept tiles too
+            for (int ty = y0; incremental && tileDone && ty < y0 + rows; ty += tileSize)
+                for (int tx = 0; tx < imageWidth; tx += tileSize)
+                    if (!renderTiles[frameDependencies.tileOf(tx, ty)])
+                        tileDone(Tile(tx, ty, min(imageWidth, tx + tileSize), min(y0 + rows, ty + tileSize)), band, y0);
+        }
+        if (floats)
+        {
+            written = writer.writeRows(y0, rows, rgb.data());
+            continue;
+        }
+        unsigned char *p = bytes.data();
+        for (int j = 0; j < rows; j++)
+            for (int i = 0; i < imageWidth; i++, p += 3)
+                band.get_pixel(i, j, p[0], p[1], p[2]);
+        written = writer.writeRows(y0, rows, bytes.data());
+    }
+    FrameDependencies::recording = false;
+    auto traceEnd = chrono::steady_clock::now();
+    written = writer.close() && written;
+    auto end = std::chrono::steady_clock::now();
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+    double saveMs = chrono::duration<double, milli>(end - traceEnd).count();
+    if (cancelled)
+    {
+        remove(output_file.c_str());
+        cout << "Capture cancelled after " << (ms / 1000.0) << " seconds" << endl;
+        return false;
+    }
+    if (!written)
+    {
+        cerr << "Error: could not write " << output_file << endl;
+        return false;
+    }
+    if (gbufferEnabled && !relit)
+        gbuffer.finish();
+    if (tracking)
+    {
+        frameDependencies.update(objects);
+        frameDependencies.valid = true;
+    }
+    cout << "Captured to " << output_file << " in " << (ms / 1000.0) << " seconds (" << writer.peakBuffered / 1024
+         << " KB of output buffers)" << endl;
+    RenderStats stats;
+    for (const RenderStats &s : threadStats)
+        stats.merge(s);
+    long long shadowQueries = 0, shadowCacheHits = 0;
+    for (const OcclusionCache &cache : shadowCaches)
+    {
+        shadowQueries += cache.queries;
+        shadowCacheHits += cache.cacheHits;
+    }
+    if (statsFormat == "json")
+    {
+        print_stats_json(stats, scheduler, shadowQueries, shadowCacheHits, traceMs, saveMs);
+        return true;
+    }
+    if (statsFormat == "off")
+        return true;
+    cout << "Primary rays: " << (packetSize > 1 ? "packets of " + to_string(packetSize) : string("single rays"))
+         << ", " << (double)imageWidth * imageHeight / max(1.0, (double)ms) / 1000.0 << " M pixels/s" << endl;
+    if (gbufferEnabled)
+        cout << "G-buffer: " << (relit ? "primary hits reused from the last capture (relit)" : "primary hits recorded")
+             << ", " << gbuffer.samples.size() * sizeof(GBuffer::Sample) / 1048576 << " MB" << endl;
+    if (incremental)
+    {
+        long long rendered = count(renderTiles.begin(), renderTiles.end(), 1);
+        cout << "Incremental: " << changed.size() << " changed object(s), " << rendered << " of " << renderTiles.size()
+             << " tiles rendered (" << 100.0 * rendered / renderTiles.size() << "%)" << endl;
+    }
+    else if (tracking)
+        cout << "Incremental: full render, tile dependencies recorded" << endl;
+    if (aaSamples > 1)
+        cout << "Anti-aliasing: " << aaRefinedPixels << " pixels refined with " << aaSamples << " samples ("
+             << 100.0 * aaRefinedPixels / ((double)imageWidth * imageHeight) << "%), "
+             << 1.0 + (double)aaExtraSamples / ((double)imageWidth * imageHeight) << " samples per pixel" << endl;
+    const CompiledScene &scene = bvh.scene;
+    cout << "BVH: " << bvh.nodeCount() << " nodes over " << scene.count(CompiledScene::SPHERE) << " spheres, "
+         << scene.count(CompiledScene::TRIANGLE) << " triangles, " << scene.count(CompiledScene::QUADRIC) << " quadrics, "
+         << scene.count(CompiledScene::OBJECT) << " other (" << bvh.unboundedCount() << " unbounded), "
+         << scene.materials.size() << " materials, built in " << bvh.buildTime << " ms" << endl;
+    cout << "Shadow rays: " << shadowQueries << " occlusion queries, "
+         << 100.0 * shadowCacheHits / max(1LL, shadowQueries) << "% answered by the last-occluder cache" << endl;
+#if RT_STATS
+    cout << "Rays: " << stats.primaryRays << " primary, " << stats.shadowRays << " shadow, " << stats.reflectionRays
+         << " reflection, " << (stats.primaryRays + stats.shadowRays + stats.reflectionRays) / max(1e-3, traceMs) / 1000.0
+         << " M rays/s; " << stats.missedPixels << " pixels with no hit" << endl;
+    cout << "Tests: " << stats.tests[CompiledScene::SPHERE] << " sphere, " << stats.tests[CompiledScene::TRIANGLE] << " triangle, "
+         << stats.tests[CompiledScene::QUADRIC] << " quadric, " << stats.tests[CompiledScene::OBJECT] << " other; "
+         << stats.nodesVisited << " BVH nodes visited" << endl;
+#endif
+    cout << "Time: load " << loadTime << " ms, trace " << traceMs << " ms, save " << saveMs << " ms" << endl;
+    scheduler.printStats();
+    return true;
+}
+
+// Starts capture() on captureThread and polls it from the event loop; finished tiles appear over the preview
+void start_capture()
+{
+    if (captureRunning || objects.empty())
+        return;
+    if (captureThread.joinable())
+        captureThread.join();
+    // The overlay is at most 1024 pixels across, so large captures only keep every previewStep-th pixel
+    previewStep = max(1, (max(imageWidth, imageHeight) + 1023) / 1024);
+    previewWidth = (imageWidth + previewStep - 1) / previewStep;
+    previewHeight = (imageHeight + previewStep - 1) / previewStep;
+    previewPixels.assign((size_t)previewWidth * previewHeight * 3, 0);
+    previewDirty = true;
+    previewVisible = true;
+    captureTilesTotal = ((imageWidth + tileSize - 1) / tileSize) * ((imageHeight + tileSize - 1) / tileSize);
+    captureTilesDone = 0;
+    captureCancel = false;
+    captureRunning = true;
+    captureStart = chrono::steady_clock::now();
+    auto tileDone = [](const Tile &tile, bitmap_image &band, int bandY0)
+    {
+        {
+            lock_guard<mutex> lock(previewMutex);
+            for (int j = (tile.y0 + previewStep - 1) / previewStep * previewStep; j < tile.y1; j += previewStep)
+                for (int i = (tile.x0 + previewStep - 1) / previewStep * previewStep; i < tile.x1; i += previewStep)
+                {
+                    unsigned char *p = &previewPixels[((size_t)(j / previewStep) * previewWidth + i / previewStep) * 3];
+                    band.get_pixel(i, j - bandY0, p[0], p[1], p[2]);
+                }
+            previewDirty = true;
+        }
+        captureTilesDone++;
+    };
+    captureThread = thread([tileDone]
+                           {
+                               capture(&captureCancel, tileDone);
+                               captureRunning = false;
+                           });
+    cout << "Rendering in the background, press ESC to cancel" << endl;
+    glutTimerFunc(100, capture_progress, 0);
+}
+
+// 'l' in the preview: reads the scene file again after lights or materials were edited. The next capture only
+// re-shades if the geometry came back the same (see GBuffer::geometrySignature).
+void reload_scene()
+{
+    bool textureOn = !objects.empty() && static_cast<Floor *>(objects.back())->useTexture;
+    free_memory();
+    load_data(inputFilename);
+    if (objects.empty())
+    {
+        // The old scene is gone and the file no longer loads
+        if (captureThread.joinable())
+            captureThread.join();
+        exit(1);
+    }
+    if (levelOverride >= 0)
+        level = levelOverride;
+    static_cast<Floor *>(objects.back())->useTexture = textureOn;
+    static_cast<Floor *>(objects.back())->uploadTexture();
+    if (gbuffer.valid)
+        cout << (gbuffer.geometry == GBuffer::geometrySignature(objects)
+                     ? "Geometry unchanged: the next capture reuses the primary hits"
+                     : "Geometry changed: the next capture traces every primary ray")
+             << endl;
+}
+
+// Timer callback while a capture runs: uploads new tiles, shows the progress in the title
+void capture_progress(int value)
+{
+    bool running = captureRunning;
+    if (!running && captureThread.joinable())
+        captureThread.join();
+    {
+        lock_guard<mutex> lock(previewMutex);
+        if (previewDirty)
+        {
+            if (previewTexture == 0)
+                glGenTextures(1, &previewTexture);
+            glBindTexture(GL_TEXTURE_2D, previewTexture);
+            int size = 1;
+            while (size < max(previewWidth, previewHeight))
+                size *= 2;
+            if (size != previewTextureSize)
+            {
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, size, size, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                previewTextureSize = size;
+            }
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, previewWidth, previewHeight, GL_RGB, GL_UNSIGNED_BYTE,
+                            previewPixels.data());
+            glBindTexture(GL_TEXTURE_2D, 0);
+            previewDirty = false;
+        }
+    }
+    glutPostRedisplay();
+    if (running)
+        glutTimerFunc(100, capture_progress, 0);
+}
+// Writes a finished image in the format its file extension asks for (BMP, PPM or PFM)
+bool save_image(bitmap_image &image, const string &file)
+{
+    ImageWriter writer;
+    if (!writer.open(file, image.width(), image.height()))
+        return false;
+    const int bandHeight = 64;
+    vector<unsigned char> band((size_t)image.width() * bandHeight * 3);
+    for (int y0 = 0; y0 < (int)image.height(); y0 += bandHeight)
+    {
+        int rows = min(bandHeight, (int)image.height() - y0);
+        unsigned char *p = band.data();
+        for (int j = y0; j < y0 + rows; j++)
+            for (unsigned int i = 0; i < image.width(); i++, p += 3)
+                image.get_pixel(i, j, p[0], p[1], p[2]);
+        if (!writer.writeRows(y0, rows, band.data()))
+            break;
+    }
+    if (writer.close())
+        return true;
+    cerr << "Error: could not write " << file << endl;
+    return false;
+}
+
+// Frame n of a sequence: <output stem>_0001.bmp, or Frame_0001.bmp without --output
+string frame_filename(int frame)
+{
+    char number[16];
+    snprintf(number, sizeof(number), "%04d", frame + 1);
+    if (outputFilename.empty())
+        return "Frame_" + string(number) + ".bmp";
+    size_t dot = outputFilename.find_last_of('.');
+    size_t slash = outputFilename.find_last_of('/');
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+        return outputFilename + "_" + number + ".bmp";
+    return outputFilename.substr(0, dot) + "_" + number + outputFilename.substr(dot);
+}
+
+// Renders every frame of the camera path in one go. The scene, BVH, scheduler threads and shadow caches are set up
+// once; two images alternate so a helper thread writes frame n while frame n + 1 renders.
+bool render_sequence()
+{
+    CameraPath path;
+    if (!path.load(keyframesFilename))
+        return false;
+    cout << "Rendering " << sequenceFrames << " frames along " << path.eyes.size() << " keyframes"
+         << (path.closed ? " (closed path)" : "") << endl;
+    auto start = chrono::steady_clock::now();
+    TileScheduler scheduler(tileSize, renderThreads);
+    vector<OcclusionCache> shadowCaches(scheduler.numThreads);
+    vector<RenderStats> threadStats(scheduler.numThreads);
+    bitmap_image images[2] = {bitmap_image(imageWidth, imageHeight), bitmap_image(imageWidth, imageHeight)};
+    thread writer;
+    double traceMs = 0.0, waitMs = 0.0;
+    for (int frame = 0; frame < sequenceFrames; frame++)
+    {
+        path.at(frame, sequenceFrames, camera);
+        bitmap_image &image = images[frame % 2];
+        aaBudgetLeft = aaExtraSamples = aaRefinedPixels = 0;
+        double frameMs = render_frame(scheduler, image, shadowCaches, threadStats, Tile(0, 0, imageWidth, imageHeight));
+        traceMs += frameMs;
+        // The writer of the previous frame owns the other image; it has to be done before that image is reused
+        auto waitStart = chrono::steady_clock::now();
+        if (writer.joinable())
+            writer.join();
+        waitMs += chrono::duration<double, milli>(chrono::steady_clock::now() - waitStart).count();
+        string file = frame_filename(frame);
+        writer = thread([&image, file] { save_image(image, file); });
+        if (statsFormat != "off")
+            cout << "Frame " << frame + 1 << "/" << sequenceFrames << ": " << file << ", trace " << frameMs << " ms"
+                 << (aaSamples > 1 ? ", " + to_string(1.0 + (double)aaExtraSamples / ((double)imageWidth * imageHeight)) +
+                                         " samples per pixel"
+                                   : "")
+                 << endl;
+    }
+    if (writer.joinable())
+        writer.join();
+    double totalMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    cout << "Sequence: " << sequenceFrames << " frames in " << totalMs / 1000.0 << " seconds, "
+         << totalMs / max(1, sequenceFrames) << " ms/frame (trace " << traceMs / max(1, sequenceFrames)
+         << " ms/frame, " << waitMs << " ms waiting for writes)" << endl;
+    return true;
+}
+
+// Arguments a coordinator passes on to its workers: its own command line without the flags that only concern the
+// coordinator (where the image goes, how many local threads or workers, sequences and statistics)
+vector<string> worker_args(int argc, char **argv)
+{
+    vector<string> args;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--headless" || arg.rfind("--stats=", 0) == 0)
+            continue;
+        if (arg == "--coordinator" || arg == "--spawn" || arg == "--output" || arg == "--threads" ||
+            arg == "--keyframes" || arg == "--frames" || arg == "--worker")
+        {
+            i++;
+            continue;
+        }
+        args.push_back(arg);
+    }
+    return args;
+}
+
+// Worker side of a distributed render: connect, take the job's arguments, load the scene once, then render
+// tiles until the coordinator says QUIT or goes away. Local flags (--scene, --threads, ...) override the job's.
+bool run_worker(int argc, char **argv)
+{
+    size_t colon = coordinatorAddress.rfind(':');
+    string host = coordinatorAddress.substr(0, colon);
+    int port = atoi(coordinatorAddress.substr(colon + 1).c_str());
+    Connection connection;
+    // Workers may be started before the coordinator: keep trying for a while
+    for (int attempt = 0; !connection.connectTo(host, port); attempt++)
+    {
+        if (attempt == 100)
+        {
+            cerr << "Error: cannot connect to coordinator " << coordinatorAddress << endl;
+            return false;
+        }
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    string line;
+    int count = 0;
+    if (!connection.sendLine("RTWORKER 2") || connection.readLine(line) != 1 || sscanf(line.c_str(), "JOB %d", &count) != 1)
+    {
+        cerr << "Error: no job from coordinator " << coordinatorAddress << endl;
+        return false;
+    }
+    vector<string> jobArgs = {argv[0]};
+    for (int i = 0; i < count; i++)
+    {
+        if (connection.readLine(line) != 1)
+            return false;
+        jobArgs.push_back(line);
+    }
+    vector<char *> jobArgv;
+    for (string &arg : jobArgs)
+        jobArgv.push_back(&arg[0]);
+    if (!parse_args((int)jobArgv.size(), jobArgv.data()) || !parse_args(argc, argv))
+    {
+        connection.sendLine("FAIL bad arguments");
+        return false;
+    }
+    headless = true;
+    load_data(inputFilename);
+    if (objects.empty())
+    {
+        connection.sendLine("FAIL cannot load " + inputFilename);
+        return false;
+    }
+    if (levelOverride >= 0)
+        level = levelOverride;
+    static_cast<Floor *>(objects.back())->useTexture = floorTextureOn;
+    connection.sendLine("READY " + to_string(loadTime));
+    TileScheduler scheduler(tileSize, renderThreads);
+    vector<OcclusionCache> shadowCaches(scheduler.numThreads);
+    vector<RenderStats> threadStats(scheduler.numThreads);
+    vector<unsigned char> pixels;
+    int tiles = 0;
+    double traceMs = 0.0;
+    while (connection.readLine(line) == 1 && line != "QUIT")
+    {
+        int id;
+        Tile tile;
+        if (sscanf(line.c_str(), "TILE %d %d %d %d %d", &id, &tile.x0, &tile.y0, &tile.x1, &tile.y1) != 5 ||
+            tile.x0 < 0 || tile.y0 < 0 || tile.x1 > imageWidth || tile.y1 > imageHeight || tile.x0 >= tile.x1 || tile.y0 >= tile.y1)
+        {
+            cerr << "Error: bad request from coordinator: " << line << endl;
+            break;
+        }
+        int width = tile.x1 - tile.x0, height = tile.y1 - tile.y0;
+        bitmap_image image(width, height);
+        // With --aa, each tile spends only its own share of the frame budget: nothing carries over between tiles
+        aaBudgetLeft = aaExtraSamples = aaRefinedPixels = 0;
+        double ms = render_frame(scheduler, image, shadowCaches, threadStats, tile);
+        traceMs += ms;
+        tiles++;
+        // Raw RGB rows, top to bottom
+        pixels.resize((size_t)width * height * 3);
+        unsigned char *p = pixels.data();
+        for (int j = 0; j < height; j++)
+            for (int i = 0; i < width; i++, p += 3)
+                image.get_pixel(i, j, p[0], p[1], p[2]);
+        if (!connection.sendLine("DONE " + to_string(id) + " " + to_string(ms) + " " + to_string(pixels.size()) + " " +
+                                 to_string(aaRefinedPixels) + " " + to_string(aaExtraSamples)) ||
+            !connection.sendBytes(pixels.data(), pixels.size()))
+            break;
+    }
+    if (statsFormat != "off")
+        cout << "Worker: " << tiles << " tiles for " << coordinatorAddress << ", trace " << traceMs << " ms" << endl;
+    free_memory();
+    return true;
+}
+
+// Coordinator side: cut the image into large Morton-ordered tiles and let every worker that connects pull them one
+// at a time. A worker that dies gives its tile back to the queue. Once the queue is empty, idle workers also take a
+// copy of tiles that have been out for much longer than usual, so a slow or hung worker cannot hold up the image;
+// the first copy back wins.
+bool run_coordinator(int argc, char **argv)
+{
+    int listener = Connection::listenOn(coordinatorPort);
+    if (listener < 0)
+        return false;
+    auto start = chrono::steady_clock::now();
+    vector<string> job = worker_args(argc, argv);
+    vector<pid_t> children;
+    for (int i = 0; i < spawnWorkers; i++)
+    {
+        string address = "127.0.0.1:" + to_string(coordinatorPort), threads = to_string(renderThreads);
+        pid_t child = fork();
+        if (child == 0)
+        {
+            close(listener);
+            vector<char *> childArgv = {argv[0], (char *)"--worker", &address[0], (char *)"--threads", &threads[0], nullptr};
+            execv("/proc/self/exe", childArgv.data());
+            execvp(argv[0], childArgv.data());
+            _exit(127);
+        }
+        if (child > 0)
+            children.push_back(child);
+    }
+    cout << "Coordinator: listening on port " << coordinatorPort << " for workers"
+         << (spawnWorkers > 0 ? " (" + to_string(children.size()) + " started here)" : string("")) << endl;
+
+    TileScheduler jobs(tileSize * 8, 1);
+    jobs.makeTiles(imageWidth, imageHeight);
+    const vector<Tile> &tiles = jobs.tiles;
+    class WorkerInfo
+    {
+    public:
+        string peer;
+        int tiles = 0, wasted = 0;
+        double loadMs = 0.0, traceMs = 0.0;
+        bool lost = false;
+    };
+    mutex stateMutex;
+    condition_variable changed;
+    deque<int> pending;
+    vector<int> copies(tiles.size(), 0); // copies of each tile currently out with workers
+    vector<bool> done(tiles.size(), false);
+    vector<chrono::steady_clock::time_point> issued(tiles.size());
+    vector<WorkerInfo> workers;
+    int remaining = (int)tiles.size(), liveWorkers = 0;
+    double doneMs = 0.0; // trace time of the finished tiles, for the "much longer than usual" test
+    for (int i = 0; i < (int)tiles.size(); i++)
+        pending.push_back(i);
+    bitmap_image image(imageWidth, imageHeight);
+    aaExtraSamples = aaRefinedPixels = 0; // summed over the tiles the workers send back
+
+    // Next tile for a worker, or -1 when the image is complete. Called with the state lock held.
+    auto nextTile = [&](unique_lock<mutex> &lock)
+    {
+        while (remaining > 0)
+        {
+            if (!pending.empty())
+            {
+                int id = pending.front();
+                pending.pop_front();
+                return id;
             }
+            auto now = chrono::steady_clock::now();
+            int finished = (int)tiles.size() - remaining;
+            double usualMs = finished > 0 ? doneMs / finished : 1000.0;
+            int oldest = -1;
+            for (int id = 0; id < (int)tiles.size(); id++)
+                if (!done[id] && copies[id] == 1 && (oldest < 0 || issued[id] < issued[oldest]))
+                    oldest = id;
+            if (oldest >= 0 && chrono::duration<double, milli>(now - issued[oldest]).count() > max(200.0, 3.0 * usualMs))
+                return oldest;
+            changed.wait_for(lock, chrono::milliseconds(100));
         }
-        std::lock_guard<std::mutex> guard(imageMutex);
-        for (int i = startCol; i < endCol; i++)
+        return -1;
+    };
+    // Next message or tile payload from a worker. Both poll, so the thread of a hung worker gives up once the image is
+    // finished without it.
+    auto awaitLine = [&](Connection *connection, string &line)
+    {
+        int got;
+        while ((got = connection->readLine(line, 200)) == 0)
+        {
+            lock_guard<mutex> lock(stateMutex);
+            if (remaining == 0)
+                return false;
+        }
+        return got == 1;
+    };
+    auto awaitBytes = [&](Connection *connection, void *data, size_t size)
+    {
+        int got;
+        while ((got = connection->readBytes(data, size, 200)) == 0)
+        {
+            lock_guard<mutex> lock(stateMutex);
+            if (remaining == 0)
+                return false;
+        }
+        return got == 1;
+    };
+    auto serve = [&](Connection *connection, int self)
+    {
+        string line;
+        bool ok = connection->readLine(line, 5000) == 1 && line == "RTWORKER 2" &&
+                  connection->sendLine("JOB " + to_string(job.size()));
+        for (size_t i = 0; ok && i < job.size(); i++)
+            ok = connection->sendLine(job[i]);
+        double loadMs = 0.0;
+        ok = ok && awaitLine(connection, line) && sscanf(line.c_str(), "READY %lf", &loadMs) == 1;
+        unique_lock<mutex> lock(stateMutex);
+        workers[self].loadMs = loadMs;
+        if (!ok && remaining > 0)
+            cerr << "Coordinator: worker " << workers[self].peer << " failed to start" << (line.rfind("FAIL", 0) == 0 ? ": " + line.substr(5) : string("")) << endl;
+        vector<unsigned char> pixels;
+        while (ok)
         {
-            for (int j = 0; j < imageHeight; j++)
+            int id = nextTile(lock);
+            if (id < 0)
+                break;
+            copies[id]++;
+            issued[id] = chrono::steady_clock::now();
+            const Tile &tile = tiles[id];
+            lock.unlock();
+            ok = connection->sendLine("TILE " + to_string(id) + " " + to_string(tile.x0) + " " + to_string(tile.y0) +
+                                      " " + to_string(tile.x1) + " " + to_string(tile.y1));
+            int doneId = -1;
+            double ms = 0.0;
+            size_t bytes = 0;
+            long long refined = 0, extra = 0;
+            size_t expected = (size_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * 3;
+            ok = ok && awaitLine(connection, line) &&
+                 sscanf(line.c_str(), "DONE %d %lf %zu %lld %lld", &doneId, &ms, &bytes, &refined, &extra) == 5 &&
+                 doneId == id && bytes == expected;
+            if (ok)
             {
-                unsigned char r, g, b;
-                localImage.get_pixel(i, j, r, g, b);
-                image.set_pixel(i, j, r, g, b);
+                pixels.resize(bytes);
+                ok = awaitBytes(connection, pixels.data(), bytes);
             }
+            lock.lock();
+            copies[id]--;
+            if (ok && !done[id])
+            {
+                const unsigned char *p = pixels.data();
+                for (int j = tile.y0; j < tile.y1; j++)
+                    for (int i = tile.x0; i < tile.x1; i++, p += 3)
+                        image.set_pixel(i, j, p[0], p[1], p[2]);
+                done[id] = true;
+                remaining--;
+                doneMs += ms;
+                aaRefinedPixels += refined;
+                aaExtraSamples += extra;
+                workers[self].tiles++;
+                workers[self].traceMs += ms;
+            }
+            else if (ok)
+                workers[self].wasted++;
+            else if (!done[id] && copies[id] == 0)
+                pending.push_front(id);
+            changed.notify_all();
+        }
+        if (remaining > 0)
+        {
+            workers[self].lost = true;
+            cerr << "Coordinator: lost worker " << workers[self].peer << ", " << remaining << " tiles left" << endl;
         }
+        liveWorkers--;
+        lock.unlock();
+        connection->sendLine("QUIT");
+        connection->close();
     };
-    int numThreads = std::thread::hardware_concurrency();
-    // cout << "Using " << numThreads << " threads\n";
-    int colsPerThread = imageWidth / numThreads;
+
     vector<thread> threads;
-    for (int i = 0; i < numThreads; ++i)
+    vector<unique_ptr<Connection>> connections;
+    while (true)
+    {
+        {
+            lock_guard<mutex> lock(stateMutex);
+            if (remaining == 0)
+                break;
+        }
+        unique_ptr<Connection> connection(new Connection());
+        if (connection->acceptFrom(listener, 100))
+        {
+            lock_guard<mutex> lock(stateMutex);
+            workers.push_back(WorkerInfo());
+            workers.back().peer = connection->peer;
+            liveWorkers++;
+            threads.emplace_back(serve, connection.get(), (int)workers.size() - 1);
+            connections.push_back(move(connection));
+            continue;
+        }
+        // With only local workers there is nobody left to wait for once they have all exited
+        if (!children.empty())
+        {
+            bool alive = false;
+            for (pid_t &child : children)
+                if (child > 0 && waitpid(child, nullptr, WNOHANG) == child)
+                    child = -1;
+                else if (child > 0)
+                    alive = true;
+            lock_guard<mutex> lock(stateMutex);
+            if (!alive && liveWorkers == 0 && remaining > 0)
+            {
+                cerr << "Error: all workers exited with " << remaining << " of " << tiles.size() << " tiles left" << endl;
+                break;
+            }
+        }
+    }
+    close(listener);
     {
-        int startCol = i * colsPerThread;
-        int endCol = (i == numThreads - 1) ? imageWidth : (i + 1) * colsPerThread;
-        threads.emplace_back(renderSegment, startCol, endCol);
+        // Wake threads still waiting for duplicate work
+        lock_guard<mutex> lock(stateMutex);
+        changed.notify_all();
     }
-    for (auto &t : threads)
+    for (thread &t : threads)
         t.join();
-    string output_file = "Output_" + to_string(++capturedFrames) + ".bmp";
-    image.save_image(output_file);
-    auto end = std::chrono::steady_clock::now();
-    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-    cout << "Captured to " << output_file << " in " << (ms / 1000.0) << " seconds" << endl;
+    bool complete = remaining == 0;
+    if (complete)
+    {
+        string output_file = outputFilename.empty() ? "Output_" + to_string(++capturedFrames) + ".bmp" : outputFilename;
+        complete = save_image(image, output_file);
+        cout << "Captured to " << output_file << " in "
+             << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " seconds ("
+             << tiles.size() << " tiles of " << jobs.tileSize << " pixels, " << workers.size() << " workers)" << endl;
+        if (aaSamples > 1)
+            cout << "Anti-aliasing: " << aaRefinedPixels << " pixels refined with " << aaSamples << " samples ("
+                 << 100.0 * aaRefinedPixels / ((double)imageWidth * imageHeight) << "%), "
+                 << 1.0 + (double)aaExtraSamples / ((double)imageWidth * imageHeight) << " samples per pixel" << endl;
+    }
+    if (statsFormat != "off")
+        for (const WorkerInfo &worker : workers)
+            cout << "Worker " << worker.peer << ": " << worker.tiles << " tiles, " << worker.wasted
+                 << " duplicates discarded, load " << worker.loadMs << " ms, trace " << worker.traceMs << " ms"
+                 << (worker.lost ? ", lost" : "") << endl;
+    // Local workers exit on QUIT; give a hung one a moment, then stop it
+    for (int wait = 0; wait < 20; wait++)
+    {
+        bool alive = false;
+        for (pid_t &child : children)
+            if (child > 0 && waitpid(child, nullptr, WNOHANG) == child)
+                child = -1;
+            else if (child > 0)
+                alive = true;
+        if (!alive)
+            break;
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    for (pid_t child : children)
+        if (child > 0)
+        {
+            kill(child, SIGKILL);
+            waitpid(child, nullptr, 0);
+        }
+    return complete;
+}
+
+// One JSON object on a single line, so scripts can take the last line of the output
+void print_stats_json(const RenderStats &stats, const TileScheduler &scheduler, long long shadowQueries,
+                      long long shadowCacheHits, double traceMs, double saveMs)
+{
+    const CompiledScene &scene = bvh.scene;
+    cout << "{\"image\":{\"width\":" << imageWidth << ",\"height\":" << imageHeight << ",\"level\":" << level
+         << ",\"packet\":" << packetSize << ",\"aaSamples\":" << aaSamples << ",\"aaRefinedPixels\":" << aaRefinedPixels
+         << ",\"samplesPerPixel\":" << 1.0 + (double)aaExtraSamples / ((double)imageWidth * imageHeight) << "}"
+         << ",\"scene\":{\"spheres\":" << scene.count(CompiledScene::SPHERE) << ",\"triangles\":" << scene.count(CompiledScene::TRIANGLE)
+         << ",\"quadrics\":" << scene.count(CompiledScene::QUADRIC) << ",\"other\":" << scene.count(CompiledScene::OBJECT)
+         << ",\"bvhNodes\":" << bvh.nodeCount() << ",\"bvhBuildMs\":" << bvh.buildTime << "}"
+         << ",\"timeMs\":{\"load\":" << loadTime << ",\"trace\":" << traceMs << ",\"save\":" << saveMs << "}"
+         << ",\"counters\":" << (RT_STATS ? "true" : "false")
+         << ",\"rays\":{\"primary\":" << stats.primaryRays << ",\"shadow\":" << stats.shadowRays
+         << ",\"reflection\":" << stats.reflectionRays << ",\"perSecond\":"
+         << (stats.primaryRays + stats.shadowRays + stats.reflectionRays) / max(1e-3, traceMs) * 1000.0 << "}"
+         << ",\"missedPixels\":" << stats.missedPixels
+         << ",\"tests\":{\"sphere\":" << stats.tests[CompiledScene::SPHERE] << ",\"triangle\":" << stats.tests[CompiledScene::TRIANGLE]
+         << ",\"quadric\":" << stats.tests[CompiledScene::QUADRIC] << ",\"other\":" << stats.tests[CompiledScene::OBJECT] << "}"
+         << ",\"bvhNodesVisited\":" << stats.nodesVisited
+         << ",\"shadowCache\":{\"queries\":" << shadowQueries << ",\"hits\":" << shadowCacheHits << "}"
+         << ",\"threads\":[";
+    for (int i = 0; i < (int)scheduler.busyTime.size(); i++)
+        cout << (i ? "," : "") << "{\"busyMs\":" << scheduler.busyTime[i] << ",\"utilisation\":"
+             << scheduler.busyTime[i] / max(1e-3, traceMs) << ",\"tiles\":" << scheduler.tilesRendered[i]
+             << ",\"steals\":" << scheduler.steals[i] << "}";
+    cout << "]}" << endl;
 }
 
 // void capture()
@@ -354,11 +1610,204 @@ void capture()
 //     cout << "Captured frame " << capturedFrames << " saved as " << output_file << endl;
 // }
 
+static bool parse_point(const string &arg, double &x, double &y, double &z)
+{
+    return sscanf(arg.c_str(), "%lf,%lf,%lf", &x, &y, &z) == 3;
+}
+// Whole-string numbers only: "abc", "1e3x" or out-of-range values fail instead of throwing
+static bool parse_int(const string &arg, int &value)
+{
+    char *end;
+    errno = 0;
+    long parsed = strtol(arg.c_str(), &end, 10);
+    if (arg.empty() || *end != '\0' || errno == ERANGE || parsed < INT_MIN || parsed > INT_MAX)
+        return false;
+    value = (int)parsed;
+    return true;
+}
+static bool parse_real(const string &arg, double &value)
+{
+    char *end;
+    errno = 0;
+    double parsed = strtod(arg.c_str(), &end);
+    if (arg.empty() || *end != '\0' || errno == ERANGE || !isfinite(parsed))
+        return false;
+    value = parsed;
+    return true;
+}
+
+void print_usage(const char *program)
+{
+    cerr << "Usage: " << program << " [--headless] [options]\n"
+         << "  --headless            render once without a window and exit\n"
+         << "  --scene <file>        scene description (default " << inputFilename << ")\n"
+         << "  --texture <file>      floor texture (default " << textureFilename << ")\n"
+         << "  --floor-texture       shade the floor with the texture instead of the checkerboard\n"
+         << "  --eye x,y,z           camera position\n"
+         << "  --center x,y,z        camera look-at point\n"
+         << "  --up x,y,z            camera up vector\n"
+         << "  --width <n>           image width in pixels\n"
+         << "  --height <n>          image height in pixels\n"
+         << "  --level <n>           recursion level (overrides the scene file)\n"
+         << "  --roulette <n>        Russian roulette on reflection paths after n bounces (0 = off)\n"
+         << "  --threads <n>         render threads (0 = all hardware threads)\n"
+         << "  --tile <n>            tile size in pixels\n"
+         << "  --packet <0|4|8|16>   trace primary rays in SIMD packets of this size (0 = off)\n"
+         << "  --cull <auto|on|off>  primary rays test only the BVH leaves in their tile's frustum (auto: tiles that\n"
+         << "                        reach at most " << cullLeaves << " leaves, without --packet)\n"
+         << "  --aa <n>              anti-alias edges with n stratified samples: 4, 9, 16, ... (default 1 = off)\n"
+         << "  --aa-threshold <x>    colour difference between neighbours that marks an edge (default " << aaThreshold << ")\n"
+         << "  --aa-budget <x>       extra samples per frame, per pixel on average (default " << aaBudget << ")\n"
+         << "  --output <file>       output image, .bmp, .ppm or .pfm (default Output_<n>.bmp); sequences add _0001\n"
+         << "                        etc. to the name\n"
+         << "  --keyframes <file>    render a camera path: key count, then eye, center and up per key\n"
+         << "  --frames <n>          frames in the camera path (default " << sequenceFrames << ")\n"
+         << "  --coordinator <port>  render by handing tiles to workers that connect to this port\n"
+         << "  --spawn <n>           with --coordinator: also start n workers on this machine\n"
+         << "  --worker <host:port>  render tiles for the coordinator at host:port\n"
+         << "  --compile             parse the scene, write its binary cache and exit\n"
+         << "  --cache <file>        scene cache (default <scene>.cache)\n"
+         << "  --no-cache            always parse the scene text\n"
+         << "  --stats=<fmt>         render statistics: text (default), json (one line) or off\n";
+}
+
+bool parse_args(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        string value = hasValue ? argv[i + 1] : "";
+        double x, y, z, d;
+        int n;
+        if (arg == "--headless")
+            headless = true;
+        else if (arg == "--floor-texture")
+            floorTextureOn = true;
+        else if (arg == "--compile")
+            compileScene = true;
+        else if (arg == "--no-cache")
+            useSceneCache = false;
+        else if (arg.rfind("--stats=", 0) == 0)
+        {
+            statsFormat = arg.substr(8);
+            if (statsFormat != "text" && statsFormat != "json" && statsFormat != "off")
+            {
+                cerr << "Error: --stats must be text, json or off" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--help" || arg == "-h")
+            return false;
+        else if (arg.rfind("--", 0) != 0)
+        {
+            cerr << "Error: unknown argument " << arg << endl;
+            return false;
+        }
+        else if (!hasValue)
+        {
+            cerr << "Error: missing value for " << arg << endl;
+            return false;
+        }
+        else if (arg == "--scene")
+            inputFilename = value;
+        else if (arg == "--texture")
+            textureFilename = value;
+        else if (arg == "--output")
+            outputFilename = value;
+        else if (arg == "--cache")
+            sceneCacheFilename = value;
+        else if (arg == "--keyframes")
+            keyframesFilename = value;
+        else if (arg == "--frames" && parse_int(value, n))
+            sequenceFrames = n;
+        else if (arg == "--coordinator" && parse_int(value, n))
+            coordinatorPort = n;
+        else if (arg == "--spawn" && parse_int(value, n))
+            spawnWorkers = n;
+        else if (arg == "--worker" && value.find(':') != string::npos)
+            coordinatorAddress = value;
+        else if (arg == "--width" && parse_int(value, n))
+            imageWidth = n;
+        else if (arg == "--height" && parse_int(value, n))
+            imageHeight = n;
+        else if (arg == "--level" && parse_int(value, n))
+            levelOverride = n;
+        else if (arg == "--roulette" && parse_int(value, n))
+            Object::rouletteDepth = n;
+        else if (arg == "--threads" && parse_int(value, n))
+            renderThreads = n;
+        else if (arg == "--tile" && parse_int(value, n))
+            tileSize = n;
+        else if (arg == "--packet" && (value == "0" || value == "4" || value == "8" || value == "16"))
+            packetSize = stoi(value);
+        else if (arg == "--cull" && (value == "auto" || value == "on" || value == "off"))
+            cullMode = value;
+        else if (arg == "--aa" && parse_int(value, n))
+            aaSamples = n;
+        else if (arg == "--aa-threshold" && parse_real(value, d))
+            aaThreshold = d;
+        else if (arg == "--aa-budget" && parse_real(value, d))
+            aaBudget = d;
+        else if (arg == "--eye" && parse_point(value, x, y, z))
+            camera.eye = Point(x, y, z);
+        else if (arg == "--center" && parse_point(value, x, y, z))
+            camera.center = Point(x, y, z);
+        else if (arg == "--up" && parse_point(value, x, y, z))
+            camera.up = Vector(x, y, z);
+        else
+        {
+            cerr << "Error: bad argument " << arg << " " << value << endl;
+            return false;
+        }
+        if (arg != "--headless" && arg != "--floor-texture" && arg != "--compile" && arg != "--no-cache" &&
+            arg.rfind("--stats=", 0) != 0)
+            i++;
+    }
+    if (imageWidth <= 0 || imageHeight <= 0)
+    {
+        cerr << "Error: image size must be positive" << endl;
+        return false;
+    }
+    if (tileSize <= 0 || renderThreads < 0)
+    {
+        cerr << "Error: --tile must be positive and --threads not negative" << endl;
+        return false;
+    }
+    if (sequenceFrames <= 0)
+    {
+        cerr << "Error: --frames must be positive" << endl;
+        return false;
+    }
+    int grid = (int)round(sqrt(max(1, aaSamples)));
+    if (aaSamples < 1 || grid * grid != aaSamples || aaThreshold < 0 || aaBudget < 0)
+    {
+        cerr << "Error: --aa must be a square (1, 4, 9, 16, ...), --aa-threshold and --aa-budget not negative" << endl;
+        return false;
+    }
+    if (coordinatorPort < 0 || coordinatorPort > 65535 || spawnWorkers < 0)
+    {
+        cerr << "Error: bad --coordinator port or --spawn count" << endl;
+        return false;
+    }
+    // Keep pixels square: the view plane follows the image aspect ratio
+    windowWidth = (int)round(windowHeight * (double)imageWidth / imageHeight);
+    return true;
+}
+
 void free_memory()
 {
-    for (Object *object : objects)
-        delete object;
+    bvh.clear();
+    if (!sceneCache.loaded())
+    {
+        for (Object *object : objects)
+            delete object;
+        for (auto &prototype : prototypes)
+            delete prototype.second;
+    }
     objects.clear();
+    prototypes.clear();
+    sceneCache.release();
     for (PointLight *pl : pointLights)
         delete pl;
     pointLights.clear();
@@ -367,8 +1816,10 @@ void free_memory()
     spotLights.clear();
 }
 
+// Only called when something changed: key presses post a redisplay, GLUT does on reshape/expose
 void display()
 {
+    auto start = chrono::steady_clock::now();
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
@@ -385,17 +1836,70 @@ void display()
         pl->draw();
     for (SpotLight *sl : spotLights)
         sl->draw();
+    if (previewVisible && previewTextureSize > 0)
+    {
+        // The capture so far, stretched over the whole window; unrendered tiles are black
+        glMatrixMode(GL_PROJECTION);
+        glPushMatrix();
+        glLoadIdentity();
+        glOrtho(0, 1, 0, 1, -1, 1);
+        glMatrixMode(GL_MODELVIEW);
+        glLoadIdentity();
+        glDisable(GL_DEPTH_TEST);
+        glEnable(GL_TEXTURE_2D); // Floor::draw leaves texturing off
+        glBindTexture(GL_TEXTURE_2D, previewTexture);
+        glColor3f(1, 1, 1);
+        float s = (float)previewWidth / previewTextureSize, t = (float)previewHeight / previewTextureSize;
+        glBegin(GL_QUADS); // texture rows run top to bottom
+        glTexCoord2f(0, t);
+        glVertex2f(0, 0);
+        glTexCoord2f(s, t);
+        glVertex2f(1, 0);
+        glTexCoord2f(s, 0);
+        glVertex2f(1, 1);
+        glTexCoord2f(0, 0);
+        glVertex2f(0, 1);
+        glEnd();
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glDisable(GL_TEXTURE_2D);
+        glEnable(GL_DEPTH_TEST);
+        glMatrixMode(GL_PROJECTION);
+        glPopMatrix();
+        glMatrixMode(GL_MODELVIEW);
+    }
     glutSwapBuffers();
+    glFinish(); // wait for the rasteriser so the frame time is real, also with Mesa's software renderer
+    char title[96];
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - captureStart).count();
+    int done = captureTilesDone;
+    if (captureRunning && done > 0)
+        snprintf(title, sizeof(title), "Ray Tracing - capturing %.0f%%, %.0f s left (ESC cancels)",
+                 100.0 * done / captureTilesTotal, elapsed * (captureTilesTotal - done) / done);
+    else if (captureRunning)
+        snprintf(title, sizeof(title), "Ray Tracing - capturing (ESC cancels)");
+    else
+        snprintf(title, sizeof(title), "Ray Tracing - %.1f ms/frame",
+                 chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+    glutSetWindowTitle(title);
 }
 
-void idle() { glutPostRedisplay(); }
-
 void keyboardListener(unsigned char key, int x, int y)
 {
+    // The render thread reads the camera and the scene, so only ESC works until it is done
+    if (captureRunning)
+    {
+        if (key == 27 && !captureCancel)
+        {
+            captureCancel = true;
+            cout << "Cancelling capture..." << endl;
+        }
+        return;
+    }
+    previewVisible = false;
     switch (key)
     {
     case '0':
-        capture();
+        start_capture();
         break;
     case '1':
         camera.lookLeft();
@@ -421,6 +1925,9 @@ void keyboardListener(unsigned char key, int x, int y)
     case 's':
         camera.moveDown_wo_refPoint();
         break;
+    case 'l':
+        reload_scene();
+        break;
     case 'p':
         cout << "Camera Position: (" << camera.eye.x << ", "
              << camera.eye.y << ", " << camera.eye.z << ")" << endl;
@@ -430,6 +1937,8 @@ void keyboardListener(unsigned char key, int x, int y)
         cout << "Toggled floor texture: " << (static_cast<Floor *>(objects.back())->useTexture ? "ON" : "OFF") << endl;
         break;
     case 27:
+        if (captureThread.joinable())
+            captureThread.join();
         exit(0);
         break;
     default:
@@ -441,6 +1950,9 @@ void keyboardListener(unsigned char key, int x, int y)
 
 void specialKeyListener(int key, int x, int y)
 {
+    if (captureRunning)
+        return;
+    previewVisible = false;
     switch (key)
     {
     case GLUT_KEY_UP:
@@ -470,6 +1982,65 @@ void specialKeyListener(int key, int x, int y)
 
 int main(int argc, char **argv)
 {
+    if (!parse_args(argc, argv))
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (compileScene)
+    {
+        // Parse the text, write the cache, then map it back so both load times are printed side by side
+        headless = true;
+        useSceneCache = false;
+        load_data(inputFilename);
+        if (objects.empty())
+            return 1;
+        string cachePath = sceneCacheFilename.empty() ? inputFilename + ".cache" : sceneCacheFilename;
+        bool written = SceneCache::write(cachePath, inputFilename, level, objects, pointLights, spotLights, bvh);
+        free_memory();
+        if (!written)
+            return 1;
+        cout << "Scene cache written to " << cachePath << endl;
+        useSceneCache = true;
+        load_data(inputFilename);
+        free_memory();
+        return 0;
+    }
+    if (!coordinatorAddress.empty() || coordinatorPort > 0)
+    {
+        // Distributed render: a dropped connection must show up as a failed send, not kill the process
+        signal(SIGPIPE, SIG_IGN);
+        headless = true;
+        bool ok = coordinatorAddress.empty() ? run_coordinator(argc, argv) : run_worker(argc, argv);
+        return ok ? 0 : 1;
+    }
+    if (!keyframesFilename.empty())
+    {
+        // Like --headless, but along the camera path
+        headless = true;
+        load_data(inputFilename);
+        if (objects.empty())
+            return 1;
+        if (levelOverride >= 0)
+            level = levelOverride;
+        static_cast<Floor *>(objects.back())->useTexture = floorTextureOn;
+        bool rendered = render_sequence();
+        free_memory();
+        return rendered ? 0 : 1;
+    }
+    if (headless)
+    {
+        // No window and no GL context: load, render once, exit
+        load_data(inputFilename);
+        if (objects.empty())
+            return 1;
+        if (levelOverride >= 0)
+            level = levelOverride;
+        static_cast<Floor *>(objects.back())->useTexture = floorTextureOn;
+        capture();
+        free_memory();
+        return 0;
+    }
     glutInit(&argc, argv);
     glutInitWindowSize(windowWidth, windowHeight);
     glutInitWindowPosition(50, 50);
@@ -477,7 +2048,15 @@ int main(int argc, char **argv)
     // glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH | GLUT_MULTISAMPLE);
     glutCreateWindow("Ray Tracing");
     initGL();
+    gbufferEnabled = true;
+    incrementalEnabled = true;
     load_data(inputFilename);
+    if (objects.empty())
+        return 1;
+    if (levelOverride >= 0)
+        level = levelOverride;
+    static_cast<Floor *>(objects.back())->useTexture = floorTextureOn;
+    static_cast<Floor *>(objects.back())->uploadTexture();
     // glutDisplayFunc(display);
     // glutKeyboardFunc(handle_keys);
     // glutSpecialFunc(handle_special_keys);
@@ -485,7 +2064,6 @@ int main(int argc, char **argv)
     glutReshapeFunc(reshapeListener);
     glutKeyboardFunc(keyboardListener);
     glutSpecialFunc(specialKeyListener);
-    glutIdleFunc(idle);
     // glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_CONTINUE_EXECUTION);
     // Note: glutSetOption may not be available in all GLUT implementations.
     // glutCloseFunc(free_memory);
@@ -0,0 +1,276 @@
+#pragma once
+#include <cmath>
+
+// Thin wrapper over the widest vector unit the compiler targets:
+// AVX (4 doubles / 8 floats, build with -mavx2), SSE2 (2 / 4, every x86-64) or plain scalar code (1 lane).
+// Packet kernels are written once against SimdReal/SimdRealMask (double, or float under RT_FLOAT)
+// and loop over a packet in steps of WIDTH.
+
+#if defined(__AVX__)
+#include <immintrin.h>
+
+class SimdMask
+{
+public:
+    __m256d v;
+
+    SimdMask(__m256d v) : v(v) {}
+
+    SimdMask operator&(const SimdMask &m) const { return _mm256_and_pd(v, m.v); }
+    SimdMask operator|(const SimdMask &m) const { return _mm256_or_pd(v, m.v); }
+    int bits() const { return _mm256_movemask_pd(v); }
+    bool any() const { return bits() != 0; }
+};
+
+class SimdDouble
+{
+public:
+    static const int WIDTH = 4;
+    __m256d v;
+
+    SimdDouble(__m256d v) : v(v) {}
+    SimdDouble(double d) : v(_mm256_set1_pd(d)) {}
+
+    static SimdDouble load(const double *p) { return _mm256_load_pd(p); }
+    void store(double *p) const { _mm256_store_pd(p, v); }
+
+    SimdDouble operator+(const SimdDouble &o) const { return _mm256_add_pd(v, o.v); }
+    SimdDouble operator-(const SimdDouble &o) const { return _mm256_sub_pd(v, o.v); }
+    SimdDouble operator*(const SimdDouble &o) const { return _mm256_mul_pd(v, o.v); }
+    SimdDouble operator/(const SimdDouble &o) const { return _mm256_div_pd(v, o.v); }
+    SimdMask operator<(const SimdDouble &o) const { return _mm256_cmp_pd(v, o.v, _CMP_LT_OQ); }
+    SimdMask operator<=(const SimdDouble &o) const { return _mm256_cmp_pd(v, o.v, _CMP_LE_OQ); }
+    SimdMask operator>(const SimdDouble &o) const { return _mm256_cmp_pd(v, o.v, _CMP_GT_OQ); }
+    SimdMask operator>=(const SimdDouble &o) const { return _mm256_cmp_pd(v, o.v, _CMP_GE_OQ); }
+
+    friend SimdDouble sqrt(const SimdDouble &a) { return _mm256_sqrt_pd(a.v); }
+    friend SimdDouble abs(const SimdDouble &a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a.v); }
+    friend SimdDouble min(const SimdDouble &a, const SimdDouble &b) { return _mm256_min_pd(a.v, b.v); }
+    friend SimdDouble max(const SimdDouble &a, const SimdDouble &b) { return _mm256_max_pd(a.v, b.v); }
+    // mask ? a : b, lane by lane
+    friend SimdDouble select(const SimdMask &m, const SimdDouble &a, const SimdDouble &b) { return _mm256_blendv_pd(b.v, a.v, m.v); }
+};
+
+class SimdFloatMask
+{
+public:
+    __m256 v;
+
+    SimdFloatMask(__m256 v) : v(v) {}
+
+    SimdFloatMask operator&(const SimdFloatMask &m) const { return _mm256_and_ps(v, m.v); }
+    SimdFloatMask operator|(const SimdFloatMask &m) const { return _mm256_or_ps(v, m.v); }
+    int bits() const { return _mm256_movemask_ps(v); }
+    bool any() const { return bits() != 0; }
+};
+
+class SimdFloat
+{
+public:
+    static const int WIDTH = 8;
+    __m256 v;
+
+    SimdFloat(__m256 v) : v(v) {}
+    SimdFloat(float f) : v(_mm256_set1_ps(f)) {}
+
+    static SimdFloat load(const float *p) { return _mm256_load_ps(p); }
+    void store(float *p) const { _mm256_store_ps(p, v); }
+
+    SimdFloat operator+(const SimdFloat &o) const { return _mm256_add_ps(v, o.v); }
+    SimdFloat operator-(const SimdFloat &o) const { return _mm256_sub_ps(v, o.v); }
+    SimdFloat operator*(const SimdFloat &o) const { return _mm256_mul_ps(v, o.v); }
+    SimdFloat operator/(const SimdFloat &o) const { return _mm256_div_ps(v, o.v); }
+    SimdFloatMask operator<(const SimdFloat &o) const { return _mm256_cmp_ps(v, o.v, _CMP_LT_OQ); }
+    SimdFloatMask operator<=(const SimdFloat &o) const { return _mm256_cmp_ps(v, o.v, _CMP_LE_OQ); }
+    SimdFloatMask operator>(const SimdFloat &o) const { return _mm256_cmp_ps(v, o.v, _CMP_GT_OQ); }
+    SimdFloatMask operator>=(const SimdFloat &o) const { return _mm256_cmp_ps(v, o.v, _CMP_GE_OQ); }
+
+    friend SimdFloat sqrt(const SimdFloat &a) { return _mm256_sqrt_ps(a.v); }
+    friend SimdFloat abs(const SimdFloat &a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+    friend SimdFloat min(const SimdFloat &a, const SimdFloat &b) { return _mm256_min_ps(a.v, b.v); }
+    friend SimdFloat max(const SimdFloat &a, const SimdFloat &b) { return _mm256_max_ps(a.v, b.v); }
+    friend SimdFloat select(const SimdFloatMask &m, const SimdFloat &a, const SimdFloat &b) { return _mm256_blendv_ps(b.v, a.v, m.v); }
+};
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+class SimdMask
+{
+public:
+    __m128d v;
+
+    SimdMask(__m128d v) : v(v) {}
+
+    SimdMask operator&(const SimdMask &m) const { return _mm_and_pd(v, m.v); }
+    SimdMask operator|(const SimdMask &m) const { return _mm_or_pd(v, m.v); }
+    int bits() const { return _mm_movemask_pd(v); }
+    bool any() const { return bits() != 0; }
+};
+
+class SimdDouble
+{
+public:
+    static const int WIDTH = 2;
+    __m128d v;
+
+    SimdDouble(__m128d v) : v(v) {}
+    SimdDouble(double d) : v(_mm_set1_pd(d)) {}
+
+    static SimdDouble load(const double *p) { return _mm_load_pd(p); }
+    void store(double *p) const { _mm_store_pd(p, v); }
+
+    SimdDouble operator+(const SimdDouble &o) const { return _mm_add_pd(v, o.v); }
+    SimdDouble operator-(const SimdDouble &o) const { return _mm_sub_pd(v, o.v); }
+    SimdDouble operator*(const SimdDouble &o) const { return _mm_mul_pd(v, o.v); }
+    SimdDouble operator/(const SimdDouble &o) const { return _mm_div_pd(v, o.v); }
+    SimdMask operator<(const SimdDouble &o) const { return _mm_cmplt_pd(v, o.v); }
+    SimdMask operator<=(const SimdDouble &o) const { return _mm_cmple_pd(v, o.v); }
+    SimdMask operator>(const SimdDouble &o) const { return _mm_cmpgt_pd(v, o.v); }
+    SimdMask operator>=(const SimdDouble &o) const { return _mm_cmpge_pd(v, o.v); }
+
+    friend SimdDouble sqrt(const SimdDouble &a) { return _mm_sqrt_pd(a.v); }
+    friend SimdDouble abs(const SimdDouble &a) { return _mm_andnot_pd(_mm_set1_pd(-0.0), a.v); }
+    friend SimdDouble min(const SimdDouble &a, const SimdDouble &b) { return _mm_min_pd(a.v, b.v); }
+    friend SimdDouble max(const SimdDouble &a, const SimdDouble &b) { return _mm_max_pd(a.v, b.v); }
+    friend SimdDouble select(const SimdMask &m, const SimdDouble &a, const SimdDouble &b)
+    {
+        return _mm_or_pd(_mm_and_pd(m.v, a.v), _mm_andnot_pd(m.v, b.v));
+    }
+};
+
+class SimdFloatMask
+{
+public:
+    __m128 v;
+
+    SimdFloatMask(__m128 v) : v(v) {}
+
+    SimdFloatMask operator&(const SimdFloatMask &m) const { return _mm_and_ps(v, m.v); }
+    SimdFloatMask operator|(const SimdFloatMask &m) const { return _mm_or_ps(v, m.v); }
+    int bits() const { return _mm_movemask_ps(v); }
+    bool any() const { return bits() != 0; }
+};
+
+class SimdFloat
+{
+public:
+    static const int WIDTH = 4;
+    __m128 v;
+
+    SimdFloat(__m128 v) : v(v) {}
+    SimdFloat(float f) : v(_mm_set1_ps(f)) {}
+
+    static SimdFloat load(const float *p) { return _mm_load_ps(p); }
+    void store(float *p) const { _mm_store_ps(p, v); }
+
+    SimdFloat operator+(const SimdFloat &o) const { return _mm_add_ps(v, o.v); }
+    SimdFloat operator-(const SimdFloat &o) const { return _mm_sub_ps(v, o.v); }
+    SimdFloat operator*(const SimdFloat &o) const { return _mm_mul_ps(v, o.v); }
+    SimdFloat operator/(const SimdFloat &o) const { return _mm_div_ps(v, o.v); }
+    SimdFloatMask operator<(const SimdFloat &o) const { return _mm_cmplt_ps(v, o.v); }
+    SimdFloatMask operator<=(const SimdFloat &o) const { return _mm_cmple_ps(v, o.v); }
+    SimdFloatMask operator>(const SimdFloat &o) const { return _mm_cmpgt_ps(v, o.v); }
+    SimdFloatMask operator>=(const SimdFloat &o) const { return _mm_cmpge_ps(v, o.v); }
+
+    friend SimdFloat sqrt(const SimdFloat &a) { return _mm_sqrt_ps(a.v); }
+    friend SimdFloat abs(const SimdFloat &a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+    friend SimdFloat min(const SimdFloat &a, const SimdFloat &b) { return _mm_min_ps(a.v, b.v); }
+    friend SimdFloat max(const SimdFloat &a, const SimdFloat &b) { return _mm_max_ps(a.v, b.v); }
+    friend SimdFloat select(const SimdFloatMask &m, const SimdFloat &a, const SimdFloat &b)
+    {
+        return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v));
+    }
+};
+
+#else
+
+class SimdMask
+{
+public:
+    bool v;
+
+    SimdMask(bool v) : v(v) {}
+
+    SimdMask operator&(const SimdMask &m) const { return v && m.v; }
+    SimdMask operator|(const SimdMask &m) const { return v || m.v; }
+    int bits() const { return v ? 1 : 0; }
+    bool any() const { return v; }
+};
+
+class SimdDouble
+{
+public:
+    static const int WIDTH = 1;
+    double v;
+
+    SimdDouble(double d) : v(d) {}
+
+    static SimdDouble load(const double *p) { return *p; }
+    void store(double *p) const { *p = v; }
+
+    SimdDouble operator+(const SimdDouble &o) const { return v + o.v; }
+    SimdDouble operator-(const SimdDouble &o) const { return v - o.v; }
+    SimdDouble operator*(const SimdDouble &o) const { return v * o.v; }
+    SimdDouble operator/(const SimdDouble &o) const { return v / o.v; }
+    SimdMask operator<(const SimdDouble &o) const { return v < o.v; }
+    SimdMask operator<=(const SimdDouble &o) const { return v <= o.v; }
+    SimdMask operator>(const SimdDouble &o) const { return v > o.v; }
+    SimdMask operator>=(const SimdDouble &o) const { return v >= o.v; }
+
+    friend SimdDouble sqrt(const SimdDouble &a) { return std::sqrt(a.v); }
+    friend SimdDouble abs(const SimdDouble &a) { return std::fabs(a.v); }
+    friend SimdDouble min(const SimdDouble &a, const SimdDouble &b) { return a.v < b.v ? a.v : b.v; }
+    friend SimdDouble max(const SimdDouble &a, const SimdDouble &b) { return a.v > b.v ? a.v : b.v; }
+    friend SimdDouble select(const SimdMask &m, const SimdDouble &a, const SimdDouble &b) { return m.v ? a.v : b.v; }
+};
+
+class SimdFloatMask
+{
+public:
+    bool v;
+
+    SimdFloatMask(bool v) : v(v) {}
+
+    SimdFloatMask operator&(const SimdFloatMask &m) const { return v && m.v; }
+    SimdFloatMask operator|(const SimdFloatMask &m) const { return v || m.v; }
+    int bits() const { return v ? 1 : 0; }
+    bool any() const { return v; }
+};
+
+class SimdFloat
+{
+public:
+    static const int WIDTH = 1;
+    float v;
+
+    SimdFloat(float f) : v(f) {}
+
+    static SimdFloat load(const float *p) { return *p; }
+    void store(float *p) const { *p = v; }
+
+    SimdFloat operator+(const SimdFloat &o) const { return v + o.v; }
+    SimdFloat operator-(const SimdFloat &o) const { return v - o.v; }
+    SimdFloat operator*(const SimdFloat &o) const { return v * o.v; }
+    SimdFloat operator/(const SimdFloat &o) const { return v / o.v; }
+    SimdFloatMask operator<(const SimdFloat &o) const { return v < o.v; }
+    SimdFloatMask operator<=(const SimdFloat &o) const { return v <= o.v; }
+    SimdFloatMask operator>(const SimdFloat &o) const { return v > o.v; }
+    SimdFloatMask operator>=(const SimdFloat &o) const { return v >= o.v; }
+
+    friend SimdFloat sqrt(const SimdFloat &a) { return std::sqrt(a.v); }
+    friend SimdFloat abs(const SimdFloat &a) { return std::fabs(a.v); }
+    friend SimdFloat min(const SimdFloat &a, const SimdFloat &b) { return a.v < b.v ? a.v : b.v; }
+    friend SimdFloat max(const SimdFloat &a, const SimdFloat &b) { return a.v > b.v ? a.v : b.v; }
+    friend SimdFloat select(const SimdFloatMask &m, const SimdFloat &a, const SimdFloat &b) { return m.v ? a.v : b.v; }
+};
+
+#endif
+
+#ifdef RT_FLOAT
+typedef SimdFloat SimdReal;
+typedef SimdFloatMask SimdRealMask;
+#else
+typedef SimdDouble SimdReal;
+typedef SimdMask SimdRealMask;
+#endif
@@ -0,0 +1,3 @@
+g++ -std=c++17 -O2 2005079_bench.cpp 2005079_bench_alloc.cpp 2005079_classes.cpp -o bench -framework OpenGL -framework GLUT
+g++ -std=c++17 -O2 2005079_main.cpp 2005079_classes.cpp -o main -framework OpenGL -framework GLUT
+./bench && ./bench --suite
@@ -0,0 +1,255 @@
+#pragma once
+// Streaming image output: BMP, PPM (P6) or PFM, picked by the file extension.
+// The header is written by open(), then rows arrive in bands (any order) and a background thread writes each band
+// straight to its place in the file. At most maxBands bands are buffered; writeRows blocks until one is free, so peak
+// memory is a few bands instead of the whole image.
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+#include <cctype>
+
+class ImageWriter
+{
+public:
+    enum Format
+    {
+        BMP,
+        PPM,
+        PFM
+    };
+
+    Format format = BMP;
+    int width = 0, height = 0;
+    size_t peakBuffered = 0; // most bytes held in band buffers at once
+
+    ImageWriter() {}
+    ~ImageWriter() { close(); }
+    ImageWriter(const ImageWriter &) = delete;
+    ImageWriter &operator=(const ImageWriter &) = delete;
+
+    // .ppm and .pfm by name (any case), everything else BMP
+    static Format formatOf(const std::string &filename)
+    {
+        std::string ext = filename.size() >= 4 ? filename.substr(filename.size() - 4) : "";
+        for (char &c : ext)
+            c = (char)tolower(c);
+        return ext == ".ppm" ? PPM : ext == ".pfm" ? PFM : BMP;
+    }
+
+    bool open(const std::string &filename, int width, int height, int maxBands = 4)
+    {
+        close();
+        format = formatOf(filename);
+        this->width = width;
+        this->height = height;
+        this->maxBands = maxBands < 1 ? 1 : maxBands;
+        peakBuffered = 0;
+        failed = false;
+        stopping = false;
+        file.open(filename, std::ios::binary | std::ios::trunc);
+        if (!file)
+        {
+            std::cerr << "Error: cannot open " << filename << " for writing" << std::endl;
+            return false;
+        }
+        std::string header = makeHeader();
+        headerSize = header.size();
+        file.write(header.data(), header.size());
+        if (!file)
+        {
+            std::cerr << "Error: cannot write " << filename << std::endl;
+            file.close();
+            return false;
+        }
+        writer = std::thread(&ImageWriter::writeLoop, this);
+        return true;
+    }
+
+    // rows full-width rows starting at y0 (0 = top), 3 values per pixel in R, G, B order.
+    // 8-bit rows are scaled by 1/255 for PFM; float rows are clamped to [0, 1] and scaled by 255 otherwise.
+    bool writeRows(int y0, int rows, const unsigned char *rgb) { return queueRows(y0, rows, rgb, (const float *)nullptr); }
+    bool writeRows(int y0, int rows, const float *rgb) { return queueRows(y0, rows, (const unsigned char *)nullptr, rgb); }
+
+    // Waits for the queued bands; false if any write failed
+    bool close()
+    {
+        if (!writer.joinable())
+            return !failed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        writer.join();
+        file.close();
+        if (file.fail())
+            failed = true;
+        for (Band *band : bands)
+            delete band;
+        bands.clear();
+        spare.clear();
+        return !failed;
+    }
+
+private:
+    class Band
+    {
+    public:
+        int y0 = 0, rows = 0;
+        std::vector<char> bytes; // the band's rows already in file layout and order
+    };
+
+    std::ofstream file;
+    size_t headerSize = 0;
+    int maxBands = 4;
+    std::vector<Band *> bands;   // every buffer, so close() can free them
+    std::vector<Band *> spare;   // buffers free for the next band
+    std::deque<Band *> queue;    // filled bands waiting for the writer thread
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool stopping = false, failed = false;
+
+    size_t rowBytes() const
+    {
+        if (format == PFM)
+            return (size_t)width * 3 * sizeof(float);
+        if (format == PPM)
+            return (size_t)width * 3;
+        return ((size_t)width * 3 + 3) & ~(size_t)3; // BMP rows are padded to 4 bytes
+    }
+    bool bottomUp() const { return format != PPM; }
+
+    std::string makeHeader() const
+    {
+        if (format == PPM)
+            return "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+        if (format == PFM)
+        {
+            // A negative scale means little-endian samples
+            uint16_t probe = 1;
+            bool little = *(const unsigned char *)&probe == 1;
+            return "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n" + (little ? "-1.0" : "1.0") + "\n";
+        }
+        uint32_t imageSize = (uint32_t)(rowBytes() * height);
+        unsigned char header[54] = {'B', 'M'};
+        auto put = [&](int offset, uint32_t value, int size)
+        {
+            for (int i = 0; i < size; i++)
+                header[offset + i] = (value >> (8 * i)) & 0xff;
+        };
+        put(2, 54 + imageSize, 4); // file size
+        put(10, 54, 4);            // pixel data offset
+        put(14, 40, 4);            // info header size
+        put(18, width, 4);
+        put(22, height, 4);
+        put(26, 1, 2);  // planes
+        put(28, 24, 2); // bits per pixel
+        put(34, imageSize, 4);
+        return std::string((const char *)header, sizeof(header));
+    }
+
+    bool queueRows(int y0, int rows, const unsigned char *bytes, const float *floats)
+    {
+        if (rows <= 0)
+            return !failed;
+        if (y0 < 0 || y0 + rows > height || !writer.joinable())
+            return false;
+        Band *band;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (spare.empty() && (int)bands.size() < maxBands)
+            {
+                bands.push_back(new Band());
+                spare.push_back(bands.back());
+            }
+            changed.wait(lock, [&] { return !spare.empty() || failed; });
+            if (failed)
+                return false;
+            band = spare.back();
+            spare.pop_back();
+        }
+        // Convert outside the lock, while the writer thread is busy with earlier bands
+        size_t stride = rowBytes();
+        band->y0 = y0;
+        band->rows = rows;
+        band->bytes.assign(stride * rows, 0);
+        for (int r = 0; r < rows; r++)
+        {
+            char *out = band->bytes.data() + stride * (bottomUp() ? rows - 1 - r : r);
+            size_t in = (size_t)r * width * 3;
+            for (int x = 0; x < width; x++, in += 3)
+            {
+                float c[3];
+                unsigned char b[3];
+                for (int k = 0; k < 3; k++)
+                {
+                    if (bytes)
+                    {
+                        b[k] = bytes[in + k];
+                        c[k] = bytes[in + k] / 255.0f;
+                    }
+                    else
+                    {
+                        c[k] = floats[in + k];
+                        float clamped = c[k] < 0.0f ? 0.0f : c[k] > 1.0f ? 1.0f : c[k];
+                        b[k] = (unsigned char)(255 * clamped);
+                    }
+                }
+                if (format == PFM)
+                    memcpy(out + (size_t)x * 3 * sizeof(float), c, sizeof(c));
+                else if (format == PPM)
+                    memcpy(out + (size_t)x * 3, b, 3);
+                else
+                {
+                    out[x * 3] = b[2];
+                    out[x * 3 + 1] = b[1];
+                    out[x * 3 + 2] = b[0];
+                }
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(band);
+            size_t buffered = 0;
+            for (Band *b : bands)
+                buffered += b->bytes.capacity();
+            if (buffered > peakBuffered)
+                peakBuffered = buffered;
+        }
+        changed.notify_all();
+        return true;
+    }
+
+    void writeLoop()
+    {
+        while (true)
+        {
+            Band *band;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (queue.empty())
+                    return;
+                band = queue.front();
+                queue.pop_front();
+            }
+            // Rows are a fixed size, so a band's position is known without the bands before it
+            int firstRow = bottomUp() ? height - band->y0 - band->rows : band->y0;
+            file.seekp(headerSize + rowBytes() * firstRow);
+            file.write(band->bytes.data(), band->bytes.size());
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!file)
+                failed = true;
+            spare.push_back(band);
+            changed.notify_all();
+        }
+    }
+};